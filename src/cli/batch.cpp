@@ -0,0 +1,355 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "batch.hpp"
+#include <errors.hpp>
+#include <log.hpp>
+#include <memory.hpp>
+#include <patcher.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include <nlohmann/json.hpp>
+#include <string_theory/iostream>
+
+#include <PRP/plPageInfo.h>
+#include <Stream/hsStream.h>
+
+// ===========================================================================
+
+namespace
+{
+    enum class job_status
+    {
+        e_pending,
+        e_ok,
+        e_failed,
+        e_skipped,
+    };
+
+    struct job_result
+    {
+        const gpp::batch::job* m_Job;
+        job_status m_Status{ job_status::e_pending };
+        double m_Load{};
+        double m_Patch{};
+        double m_Save{};
+        ST::string m_Error;
+    };
+
+    struct job_group
+    {
+        std::filesystem::path m_Age;
+        std::vector<job_result> m_Results;
+    };
+
+    class stopwatch
+    {
+        std::chrono::steady_clock::time_point m_Start;
+
+    public:
+        stopwatch()
+            : m_Start(std::chrono::steady_clock::now())
+        { }
+
+        /** Seconds since the last lap. */
+        double lap()
+        {
+            auto now = std::chrono::steady_clock::now();
+            std::chrono::duration<double> result = now - m_Start;
+            m_Start = now;
+            return result.count();
+        }
+    };
+
+    std::filesystem::path resolve_path(const std::filesystem::path& wd, const std::string& value)
+    {
+        std::filesystem::path result = std::filesystem::u8path(value);
+        if (result.is_relative())
+            result = wd / result;
+        return result.lexically_normal();
+    }
+
+    std::filesystem::path group_key(const std::filesystem::path& dest)
+    {
+        std::error_code ec;
+        std::filesystem::path result = std::filesystem::weakly_canonical(dest, ec);
+        if (ec)
+            result = dest;
+
+        // Saving writes out every page that was loaded, so jobs for an Age and jobs for
+        // any of its pages write the same files. They all have to go in one group.
+        ST::string ageName;
+        ST::string stupidExt = ST::string::from_path(dest.extension());
+        if (stupidExt.compare_i(".age") == 0) {
+            ageName = ST::string::from_path(dest.stem());
+        } else if (stupidExt.compare_i(".prp") == 0) {
+            hsFileStream S;
+            if (S.open(ST::string::from_path(dest), fmRead)) {
+                try {
+                    plPageInfo page;
+                    page.read(&S);
+                    ageName = page.getAge();
+                } catch (const hsException&) {
+                    // The job itself will complain about this.
+                }
+            }
+        }
+        if (ageName.empty())
+            return result;
+        return result.parent_path() / ageName.to_lower().to_path();
+    }
+
+    const char* status_name(job_status status)
+    {
+        switch (status) {
+        case job_status::e_ok:
+            return "OK";
+        case job_status::e_failed:
+            return "FAILED";
+        case job_status::e_skipped:
+            return "SKIPPED";
+        default:
+            return "PENDING";
+        }
+    }
+};
+
+// ===========================================================================
+
+gpp::batch::manifest gpp::batch::load_manifest(const std::filesystem::path& path)
+{
+    std::ifstream stream(path);
+    if (!stream)
+        error::raise("Unable to open manifest '{}'", path);
+
+    manifest result;
+    std::filesystem::path wd = path.parent_path();
+    try {
+        nlohmann::json root;
+        stream >> root;
+
+        result.m_Threads = root.value("threads", (size_t)0);
+        for (const auto& i : root.at("jobs")) {
+            job myJob;
+            std::string type = i.value("type", "patch");
+            if (type == "patch")
+                myJob.m_Type = job_type::e_patch;
+            else if (type == "merge")
+                myJob.m_Type = job_type::e_merge;
+            else
+                error::raise("Unknown job type '{}' in manifest '{}'", type, path);
+
+            const auto& source = i.at("source");
+            if (source.is_array() && myJob.m_Type == job_type::e_merge) {
+                for (const auto& j : source)
+                    myJob.m_MergeSources.push_back(resolve_path(wd, j.get<std::string>()));
+                if (myJob.m_MergeSources.empty())
+                    error::raise("Merge job with no sources in manifest '{}'", path);
+                myJob.m_Source = myJob.m_MergeSources.front();
+            } else {
+                myJob.m_Source = resolve_path(wd, source.get<std::string>());
+                myJob.m_MergeSources.push_back(myJob.m_Source);
+            }
+            myJob.m_Destination = resolve_path(wd, i.at("destination").get<std::string>());
+            myJob.m_Colliders = i.value("colliders", true);
+            myJob.m_Drawables = i.value("drawables", true);
+            myJob.m_Lazy = i.value("lazy", false);
+            result.m_Jobs.push_back(std::move(myJob));
+        }
+    } catch (const nlohmann::json::exception& ex) {
+        error::raise("Unable to parse manifest '{}': {}", path, ex.what());
+    }
+
+    if (result.m_Jobs.empty())
+        error::raise("Manifest '{}' has no jobs", path);
+    return result;
+}
+
+// ===========================================================================
+
+static void run_group(job_group& group)
+{
+    // Consecutive patch jobs share one patcher, and therefore one copy of the destination.
+    // Merges rewrite the destination wholesale, so the patcher has to be flushed first.
+    // Jobs in a group may name different files of the same Age, which can't share one.
+    std::unique_ptr<gpp::patcher> patcher;
+    std::filesystem::path lastSource, lastDestination;
+    std::vector<job_result*> unsaved;
+
+    auto flush = [&]() {
+        if (!patcher)
+            return;
+
+        gpp::memory::job_tag tag(ST::format("save {}", lastDestination.filename()));
+        stopwatch timer;
+        if (patcher->has_damage())
+            patcher->save_damage(lastSource, lastDestination);
+        double elapsed = timer.lap() / unsaved.size();
+        for (auto* result : unsaved) {
+            result->m_Save = elapsed;
+            result->m_Status = job_status::e_ok;
+        }
+        unsaved.clear();
+        patcher.reset();
+    };
+
+    size_t i = 0;
+    try {
+        for (; i < group.m_Results.size(); ++i) {
+            job_result& result = group.m_Results[i];
+            const gpp::batch::job& job = *result.m_Job;
+            gpp::memory::job_tag tag(ST::format("{} -> {}", job.m_Source.filename(), job.m_Destination.filename()));
+            stopwatch timer;
+
+            if (job.m_Type == gpp::batch::job_type::e_merge) {
+                flush();
+                gpp::merger merger(job.m_MergeSources, job.m_Destination);
+                result.m_Load = timer.lap();
+                merger.process();
+                result.m_Patch = timer.lap();
+                merger.save_damage(job.m_Source, job.m_Destination);
+                result.m_Save = timer.lap();
+                result.m_Status = job_status::e_ok;
+                continue;
+            }
+
+            auto mode = job.m_Lazy ? gpp::load_mode::e_lazy : gpp::load_mode::e_full;
+            if (patcher && job.m_Destination != lastDestination)
+                flush();
+            if (patcher)
+                patcher->load_source(job.m_Source, mode);
+            else
+                patcher = std::make_unique<gpp::patcher>(job.m_Source, job.m_Destination, mode);
+            result.m_Load = timer.lap();
+
+            if (job.m_Colliders)
+                patcher->process_collision();
+            if (job.m_Drawables)
+                patcher->process_drawables();
+            result.m_Patch = timer.lap();
+
+            lastSource = job.m_Source;
+            lastDestination = job.m_Destination;
+            unsaved.push_back(&result);
+        }
+        flush();
+    } catch (const std::exception& ex) {
+        // Anything patched but not saved is lost along with the job that failed. The
+        // destination is in an unknown state, so don't bother with the rest of the group.
+        gpp::log::error("Batch job failed: {}", ex.what());
+        for (size_t j = 0; j < group.m_Results.size(); ++j) {
+            job_result& result = group.m_Results[j];
+            if (result.m_Status != job_status::e_pending)
+                continue;
+            result.m_Status = j <= i ? job_status::e_failed : job_status::e_skipped;
+            if (j <= i)
+                result.m_Error = ex.what();
+        }
+    }
+}
+
+size_t gpp::batch::run(const manifest& manifest, size_t threads)
+{
+    stopwatch wallTimer;
+
+    std::vector<job_group> groups;
+    {
+        std::map<std::filesystem::path, size_t> groupIdx;
+        for (const auto& job : manifest.m_Jobs) {
+            std::filesystem::path key = group_key(job.m_Destination);
+            auto [it, inserted] = groupIdx.try_emplace(key, groups.size());
+            if (inserted)
+                groups.push_back({ key, {} });
+            groups[it->second].m_Results.push_back({ &job });
+        }
+    }
+
+    // Biggest groups first so a long tail doesn't end up on one thread at the end.
+    std::stable_sort(groups.begin(), groups.end(),
+        [](const job_group& lhs, const job_group& rhs) {
+            return lhs.m_Results.size() > rhs.m_Results.size();
+        }
+    );
+
+    if (threads == 0)
+        threads = manifest.m_Threads;
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    threads = std::clamp(threads, (size_t)1, groups.size());
+
+    log::debug("Running {} jobs for {} Ages on {} threads...",
+                   manifest.m_Jobs.size(), groups.size(), threads);
+
+    std::atomic<size_t> nextGroup = 0;
+    auto worker = [&groups, &nextGroup]() {
+        for (size_t i = nextGroup++; i < groups.size(); i = nextGroup++)
+            run_group(groups[i]);
+    };
+    {
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; ++i)
+            pool.emplace_back(worker);
+        worker();
+        for (auto& thread : pool)
+            thread.join();
+    }
+
+    double wallTime = wallTimer.lap();
+    double totalLoad = 0.0, totalPatch = 0.0, totalSave = 0.0;
+    size_t numOK = 0, numFailed = 0, numSkipped = 0;
+
+    log::flush();
+    std::cout << std::endl << "Batch summary:" << std::endl;
+    std::cout << "  STATUS      LOAD     PATCH      SAVE  JOB" << std::endl;
+    for (const auto& group : groups) {
+        for (const auto& result : group.m_Results) {
+            std::cout << ST::format("  {<7} {>8.2f}s {>8.2f}s {>8.2f}s  {} -> {}",
+                                    status_name(result.m_Status), result.m_Load, result.m_Patch,
+                                    result.m_Save, result.m_Job->m_Source, result.m_Job->m_Destination)
+                      << std::endl;
+            if (!result.m_Error.empty())
+                std::cout << "          " << result.m_Error << std::endl;
+
+            totalLoad += result.m_Load;
+            totalPatch += result.m_Patch;
+            totalSave += result.m_Save;
+            switch (result.m_Status) {
+            case job_status::e_ok:
+                ++numOK;
+                break;
+            case job_status::e_failed:
+                ++numFailed;
+                break;
+            default:
+                ++numSkipped;
+                break;
+            }
+        }
+    }
+    std::cout << ST::format("  {} OK, {} failed, {} skipped", numOK, numFailed, numSkipped) << std::endl;
+    std::cout << ST::format("  Load {.2f}s, patch {.2f}s, save {.2f}s across {} threads; {.2f}s wall time",
+                            totalLoad, totalPatch, totalSave, threads, wallTime) << std::endl;
+
+    return numFailed + numSkipped;
+}
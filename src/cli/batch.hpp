@@ -0,0 +1,69 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_BATCH_H
+#define _GPP_BATCH_H
+
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+
+namespace gpp
+{
+    namespace batch
+    {
+        enum class job_type
+        {
+            e_patch,
+            e_merge,
+        };
+
+        struct job
+        {
+            job_type m_Type{ job_type::e_patch };
+            std::filesystem::path m_Source;
+            std::vector<std::filesystem::path> m_MergeSources;
+            std::filesystem::path m_Destination;
+            bool m_Colliders{ true };
+            bool m_Drawables{ true };
+            bool m_Lazy{ false };
+        };
+
+        struct manifest
+        {
+            std::vector<job> m_Jobs;
+            size_t m_Threads{ 0 };
+        };
+
+        /**
+         * Reads a JSON manifest of patch and merge jobs. Relative paths are resolved
+         * against the manifest's directory. A merge job's source may be a list of pages.
+         */
+        [[nodiscard]]
+        manifest load_manifest(const std::filesystem::path& path);
+
+        /**
+         * Runs all jobs in the manifest. Jobs sharing a destination run in order on one
+         * thread so the destination is only loaded and saved once; everything else runs
+         * in parallel.
+         * \returns The number of jobs that did not succeed.
+         */
+        [[nodiscard]]
+        size_t run(const manifest& manifest, size_t threads = 0);
+    };
+};
+
+#endif
@@ -15,66 +15,17 @@
  */
 
 #include "log2stdio.hpp"
-#include "errors.hpp"
+#include "log.hpp"
 
 #include <iostream>
-#include <memory>
 
-#include <Debug/plDebug.h>
-#include <Stream/hsStream.h>
+#include <string_theory/iostream>
 
 // ===========================================================================
 
-namespace gpp
-{
-    class log2stdio_stream : public hsStream
-    {
-    public:
-        log2stdio_stream()
-        {
-            plDebug::Init(plDebug::kDLAll, this);
-        }
-
-        log2stdio_stream(const log2stdio_stream&) = delete;
-        log2stdio_stream(log2stdio_stream&&) = delete;
-
-        ~log2stdio_stream()
-        {
-            plDebug::Init(plDebug::kDLNone);
-        }
-
-        [[noreturn]]
-        uint32_t size() const override { error::raise("log2stdio_stream::size()"); }
-
-        uint32_t pos() const override { return std::cout.tellp(); }
-        bool eof() const override { return std::cout.eof(); }
-        void seek(uint32_t pos) override { std::cout.seekp(pos); }
-        void skip(int32_t count) override { std::cout.seekp(std::cout.tellp() + (std::streampos)count); }
-
-        [[noreturn]]
-        void fastForward() override { error::raise("log2stdio_stream::fastForward()"); }
-
-        void rewind() override { std::cout.seekp(0); }
-        void flush() override { std::cout.flush(); }
-
-        [[noreturn]]
-        size_t read(size_t size, void* buf) override { error::raise("log2stdio_stream::read()"); }
-
-        size_t write(size_t size, const void* buf) override
-        {
-            std::streampos pos = std::cout.tellp();
-            std::cout.write(reinterpret_cast<const char*>(buf), size);
-            return std::cout.tellp() - pos;
-        }
-
-    };
-};
-
-// ===========================================================================
-
-static std::unique_ptr<gpp::log2stdio_stream> s_StdioStream;
-
 void gpp::log::init_stdio()
 {
-    s_StdioStream = std::make_unique<decltype(s_StdioStream)::element_type>();
+    log::init(plDebug::kDLAll, [](const ST::string& lines) {
+        std::cout << lines << std::flush;
+    });
 }
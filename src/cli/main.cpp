@@ -15,15 +15,32 @@
  */
 
 #include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <optional>
 #include <vector>
 
+#include "batch.hpp"
 #include <buildinfo.hpp>
+#include <delta.hpp>
 #include <errors.hpp>
+#include <events.hpp>
+#include <memory.hpp>
+#include <log.hpp>
 #include "log2stdio.hpp"
 #include <patcher.hpp>
+#include <progress.hpp>
+#include "server.hpp"
+#include <shard.hpp>
+#include <stats.hpp>
+#include <trace.hpp>
+#include "watch.hpp"
 
 #include <cxxopts.hpp>
+#include <nlohmann/json.hpp>
+#include <string_theory/format>
 #include <string_theory/iostream>
 
 #include <Debug/plDebug.h>
@@ -36,11 +53,13 @@ constexpr int kReturnOK = 0;
 constexpr int kReturnOptionsError = 1;
 constexpr int kReturnPatcherError = 2;
 constexpr int kReturnGenericError = 3;
+constexpr int kReturnCancelled = 4;
 
 // ===========================================================================
 
 static plKey request_key(const plKey& srcKey, const std::vector<plKey>& keys)
 {
+    gpp::log::flush();
     std::cout << std::endl;
     std::cout << "We were unable to map the key [" << plFactory::ClassName(srcKey->getType())
               << "] '" << srcKey->getName() << "' to a key in the destination page. Please "
@@ -76,23 +95,159 @@ static plKey request_key(const plKey& srcKey, const std::vector<plKey>& keys)
 
 // ===========================================================================
 
+// Global so that the signal handler never sees it go away.
+static std::shared_ptr<gpp::progress> s_Progress = std::make_shared<gpp::progress>();
+
+static void handle_sigint(int)
+{
+    // Ask nicely the first time. If that isn't fast enough, the second one is fatal.
+    s_Progress->cancel();
+    std::signal(SIGINT, SIG_DFL);
+}
+
+// ===========================================================================
+
+class event_log
+{
+public:
+    event_log() = delete;
+    event_log(const event_log&) = delete;
+    event_log(event_log&&) = delete;
+
+    event_log(const std::filesystem::path& path) { gpp::events::open(path); }
+    ~event_log() { gpp::events::close(); }
+};
+
+// ===========================================================================
+
+class stats_report
+{
+    bool m_Print;
+    std::filesystem::path m_JsonPath;
+
+    void print() const
+    {
+        gpp::log::flush();
+        std::cout << std::endl << gpp::stats::report();
+        std::cout << "Memory:" << std::endl;
+        for (const auto& i : gpp::memory::phases()) {
+            ST::string label = i.m_Job.empty() ? i.m_Phase : ST::format("{}: {}", i.m_Job, i.m_Phase);
+            std::cout << ST::format("  {<40} {>9.1f} MiB resident {>9.1f} MiB change", label,
+                                    i.m_Resident / 1048576.0, i.m_Delta / 1048576.0) << std::endl;
+        }
+        std::cout << ST::format("  {<40} {>9.1f} MiB", "peak (whole process)",
+                                gpp::memory::peak_resident_size() / 1048576.0) << std::endl;
+        std::cout << std::flush;
+    }
+
+    void write_json() const
+    {
+        nlohmann::json root;
+        for (size_t i = 0; i < (size_t)gpp::stats::counter::e_num_counters; ++i) {
+            auto which = (gpp::stats::counter)i;
+            root["counters"][gpp::stats::counter_name(which)] = gpp::stats::get(which);
+        }
+        root["bytes_written"] = nlohmann::json::object();
+        for (const auto& [page, size] : gpp::stats::page_bytes())
+            root["bytes_written"][page.c_str()] = size;
+
+        root["phases"] = nlohmann::json::array();
+        for (const auto& i : gpp::memory::phases()) {
+            root["phases"].push_back({
+                { "job", i.m_Job.c_str() },
+                { "phase", i.m_Phase.c_str() },
+                { "resident", i.m_Resident },
+                { "delta", i.m_Delta },
+            });
+        }
+        root["peak_resident"] = gpp::memory::peak_resident_size();
+
+        root["registries"] = nlohmann::json::object();
+        for (const auto& [file, pages] : gpp::memory::registries()) {
+            auto& registry = root["registries"][file.u8string()];
+            registry = nlohmann::json::object();
+            for (const auto& page : pages) {
+                auto& classes = registry[page.m_Page.c_str()];
+                for (const auto& [name, size] : page.m_Classes)
+                    classes[name.c_str()] = size;
+            }
+        }
+
+        std::ofstream stream(m_JsonPath, std::ios::out | std::ios::trunc);
+        if (!stream) {
+            std::cerr << "Unable to write stats to '" << m_JsonPath.u8string() << "'" << std::endl;
+            return;
+        }
+        stream << root.dump(4) << std::endl;
+    }
+
+public:
+    stats_report() = delete;
+    stats_report(const stats_report&) = delete;
+    stats_report(stats_report&&) = delete;
+
+    stats_report(bool print, std::filesystem::path jsonPath)
+        : m_Print(print), m_JsonPath(std::move(jsonPath))
+    {
+        gpp::stats::reset();
+        gpp::memory::reset();
+        gpp::memory::set_enabled(true);
+    }
+
+    ~stats_report()
+    {
+        if (m_Print)
+            print();
+        if (!m_JsonPath.empty())
+            write_json();
+    }
+};
+
+// ===========================================================================
+
 int main(int argc, char** argv)
 {
     std::cout << gpp::build_info() << std::endl;
     gpp::log::init_stdio();
 
+    // `gppcli apply <delta> <destination>` streams a delta from --delta into existing pages.
+    bool applyMode = argc > 1 && strcmp(argv[1], "apply") == 0;
+    if (applyMode) {
+        argv[1] = argv[0];
+        --argc;
+        ++argv;
+    }
+
     cxxopts::Options options("gppcli", "monkey patching utility for Plasma data files");
     options.add_options()
-        ("source", "age or prp file to take objects from", cxxopts::value<std::filesystem::path>())
+        ("source", "age or prp file to take objects from (or the delta file to apply)", cxxopts::value<std::filesystem::path>())
         ("destination", "age or prp file to patch objects into", cxxopts::value<std::filesystem::path>())
 
+        ("batch", "run all of the jobs in a JSON manifest", cxxopts::value<std::filesystem::path>())
+        ("clients", "with --connect, send the request from this many clients at once", cxxopts::value<size_t>()->default_value("1"))
+        ("connect", "send the request to a patch server listening on this socket", cxxopts::value<std::filesystem::path>())
+        ("dry-run", "print what would be patched without changing anything", cxxopts::value<bool>()->default_value("false"))
+        ("delta", "save changed objects to a delta file instead of rewriting pages", cxxopts::value<std::filesystem::path>())
+        ("events", "write a JSON record of every object patched and page saved to a file, one per line", cxxopts::value<std::filesystem::path>())
         ("h,help", "show help", cxxopts::value<bool>()->default_value("false"))
+        ("j,jobs", "number of threads to run batch jobs or sharded pages on", cxxopts::value<size_t>()->default_value("0"))
+        ("incremental", "only patch objects that changed since the last run", cxxopts::value<bool>()->default_value("false"))
+        ("lazy", "only deserialize the objects that need patching", cxxopts::value<bool>()->default_value("false"))
         ("no-colliders", "don't patch collision", cxxopts::value<bool>()->default_value("false"))
         ("no-drawables", "don't patch drawables", cxxopts::value<bool>()->default_value("false"))
+        ("request", "what to ask the patch server to do (patch, merge, ping, shutdown)", cxxopts::value<std::string>()->default_value("patch"))
+        ("plan", "apply the edits in a plan saved by --save-plan instead of working them out again", cxxopts::value<std::filesystem::path>())
         ("q,quiet", "silence output", cxxopts::value<bool>()->default_value("false"))
+        ("save-plan", "save the edits that will be made to a file", cxxopts::value<std::filesystem::path>())
+        ("serve", "run a patch server listening on this socket", cxxopts::value<std::filesystem::path>())
+        ("sharded", "patch each page of an age separately and in parallel", cxxopts::value<bool>()->default_value("false"))
+        ("stats", "print a summary of what the patcher did when it finishes", cxxopts::value<bool>()->default_value("false"))
+        ("stats-json", "save the --stats summary and a memory breakdown of each page to a JSON file", cxxopts::value<std::filesystem::path>())
+        ("trace", "record how long each step takes to a Chrome trace file", cxxopts::value<std::filesystem::path>())
+        ("watch", "keep running and repatch source pages whenever they change", cxxopts::value<bool>()->default_value("false"))
     ;
     options.parse_positional({"source", "destination"});
-    options.positional_help("<source age/PRP> <destination age/PRP>");
+    options.positional_help("[apply] <source age/PRP or delta> <destination age/PRP>");
 
     try {
         auto results = options.parse(argc, argv);
@@ -101,9 +256,52 @@ int main(int argc, char** argv)
             return kReturnOK;
         }
         if (results["quiet"].as<bool>())
-            plDebug::Init(plDebug::kDLNone);
+            gpp::log::set_level(plDebug::kDLNone);
+
+        // Written out when this goes out of scope, so failed runs still leave a trace behind.
+        std::optional<gpp::trace::session> trace;
+        if (results.count("trace"))
+            trace.emplace(results["trace"].as<std::filesystem::path>());
+        std::optional<event_log> events;
+        if (results.count("events"))
+            events.emplace(results["events"].as<std::filesystem::path>());
+        std::optional<stats_report> stats;
+        if (results["stats"].as<bool>() || results.count("stats-json")) {
+            stats.emplace(results["stats"].as<bool>(),
+                          results.count("stats-json") ? results["stats-json"].as<std::filesystem::path>() : std::filesystem::path());
+        }
+
+        if (results.count("batch")) {
+            auto manifest = gpp::batch::load_manifest(results["batch"].as<std::filesystem::path>());
+            size_t failures = gpp::batch::run(manifest, results["jobs"].as<size_t>());
+            return failures == 0 ? kReturnOK : kReturnPatcherError;
+        }
+
+        if (results.count("serve")) {
+            gpp::ipc::serve(results["serve"].as<std::filesystem::path>());
+            return kReturnOK;
+        }
 
         std::filesystem::path source, destination;
+        if (results.count("connect")) {
+            if (results.count("source"))
+                source = results["source"].as<decltype(source)>();
+            if (results.count("destination"))
+                destination = results["destination"].as<decltype(destination)>();
+            size_t clients = results["clients"].as<size_t>();
+            if (clients > 1) {
+                for (const auto& reply : gpp::ipc::send_concurrently(results["connect"].as<std::filesystem::path>(),
+                                                                     results["request"].as<std::string>(),
+                                                                     source, destination, clients))
+                    std::cout << reply << std::endl;
+                return kReturnOK;
+            }
+            std::cout << gpp::ipc::send(results["connect"].as<std::filesystem::path>(),
+                                        results["request"].as<std::string>(),
+                                        source, destination) << std::endl;
+            return kReturnOK;
+        }
+
         try {
             source = results["source"].as<decltype(source)>();
             destination = results["destination"].as<decltype(destination)>();
@@ -112,27 +310,91 @@ int main(int argc, char** argv)
             return kReturnOptionsError;
         }
 
-        gpp::patcher patcher(source, destination);
+        if (applyMode) {
+            gpp::apply_delta(source, destination);
+            return kReturnOK;
+        }
+
+        if (results["sharded"].as<bool>()) {
+            gpp::shard_options shardOptions;
+            shardOptions.m_Colliders = !results["no-colliders"].as<bool>();
+            shardOptions.m_Drawables = !results["no-drawables"].as<bool>();
+            shardOptions.m_Mode = results["lazy"].as<bool>() ? gpp::load_mode::e_lazy : gpp::load_mode::e_full;
+            shardOptions.m_Threads = results["jobs"].as<size_t>();
+            size_t failures = gpp::patch_sharded(source, destination, shardOptions);
+            return failures == 0 ? kReturnOK : kReturnPatcherError;
+        }
+
+        s_Progress->set_callback([](const gpp::progress::status& status) {
+            gpp::log::debug("  -> {}: {}/{} ({.0f}/s)", status.m_Phase, status.m_Done,
+                            status.m_Total, status.m_Rate);
+        });
+        std::signal(SIGINT, handle_sigint);
+
+        gpp::patcher patcher(source, destination,
+                             results["lazy"].as<bool>() ? gpp::load_mode::e_lazy : gpp::load_mode::e_full);
         patcher.set_map_func(request_key);
-        if (!results["no-colliders"].as<bool>())
-            patcher.process_collision();
-        if (!results["no-drawables"].as<bool>())
-            patcher.process_drawables();
-        patcher.save_damage(source, destination);
+        patcher.set_progress(s_Progress);
+        if (results["incremental"].as<bool>())
+            patcher.load_fingerprints(gpp::fingerprint_cache::default_path(destination));
+
+        gpp::edit_plan plan;
+        if (results.count("plan"))
+            plan = patcher.load_plan(results["plan"].as<std::filesystem::path>());
+        else
+            plan = patcher.plan(!results["no-colliders"].as<bool>(), !results["no-drawables"].as<bool>());
+        if (results.count("save-plan"))
+            plan.save(results["save-plan"].as<std::filesystem::path>());
+        if (results["dry-run"].as<bool>()) {
+            gpp::log::flush();
+            std::cout << plan.describe() << std::flush;
+            return kReturnOK;
+        }
+        patcher.apply(plan);
+
+        if (!patcher.has_damage()) {
+            gpp::log::flush();
+            if (results["incremental"].as<bool>())
+                std::cout << "Nothing has changed since the last run." << std::endl;
+            else
+                std::cout << "Nothing to do, the destination is already up to date." << std::endl;
+        } else if (results.count("delta")) {
+            patcher.save_delta(results["delta"].as<std::filesystem::path>());
+        } else {
+            patcher.save_damage(source, destination);
+        }
+        if (results["incremental"].as<bool>())
+            patcher.save_fingerprints(gpp::fingerprint_cache::default_path(destination));
+        if (results["watch"].as<bool>()) {
+            gpp::watch_options watchOptions;
+            watchOptions.m_Colliders = !results["no-colliders"].as<bool>();
+            watchOptions.m_Drawables = !results["no-drawables"].as<bool>();
+            watchOptions.m_Lazy = results["lazy"].as<bool>();
+            watchOptions.m_Progress = s_Progress;
+            gpp::watch(patcher, source, destination, watchOptions);
+        }
     } catch (const cxxopts::OptionParseException& ex) {
+        gpp::log::flush();
         std::cerr << "Fatal Error! Could not process arguments:" << std::endl;
         std::cerr << ex.what() << std::endl;;
         return kReturnOptionsError;
     } catch (const cxxopts::OptionSpecException& ex) {
+        gpp::log::flush();
         std::cerr << "Fatal Error! Stupid programmer error with the fucking options, dammit:" << std::endl;
         std::cerr << ex.what() << std::endl;;
         return kReturnOptionsError;
+    } catch (const gpp::cancelled&) {
+        gpp::log::flush();
+        std::cerr << "Cancelled. Nothing was saved." << std::endl;
+        return kReturnCancelled;
     } catch (const gpp::error& ex) {
+        gpp::log::flush();
         std::cerr << "Fatal Error! Could not patch:" << std::endl;
         std::cerr << ex.what() << std::endl;;
         return kReturnPatcherError;
 #if !defined(_DEBUG) || defined(NDEBUG)
     } catch (const std::exception& ex) {
+        gpp::log::flush();
         std::cerr << "Fatal Error! Unhandled exception:" << std::endl;
         std::cerr << ex.what() << std::endl;;
         return kReturnGenericError;
@@ -0,0 +1,534 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "server.hpp"
+#include <errors.hpp>
+#include <hash.hpp>
+#include <log.hpp>
+#include <patcher.hpp>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+
+#ifndef _WIN32
+#   include <sys/socket.h>
+#   include <sys/un.h>
+#   include <unistd.h>
+#endif
+
+// ===========================================================================
+
+namespace
+{
+    constexpr uint32_t kMaxFrameSize = 16 * 1024 * 1024;
+
+    using steady_clock = std::chrono::steady_clock;
+
+    double elapsed_ms(steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(steady_clock::now() - start).count();
+    }
+
+    /**
+     * Identifies the state of an age or page on disk. An age's pages are separate files,
+     * so they all have to be included.
+     */
+    gpp::hash_t registry_stamp(const std::filesystem::path& path)
+    {
+        gpp::hasher hasher;
+        auto add_file = [&hasher](const std::filesystem::path& file) {
+            std::error_code ec;
+            hasher.update(ST::string::from_path(file));
+            hasher.update((uint64_t)std::filesystem::file_size(file, ec));
+            hasher.update((int64_t)std::filesystem::last_write_time(file, ec).time_since_epoch().count());
+        };
+
+        add_file(path);
+        if (ST::string::from_path(path.extension()).compare_i(".age") == 0) {
+            ST::string prefix = ST::format("{}_", path.stem());
+            std::error_code ec;
+            std::map<std::filesystem::path, bool> pages;
+            for (const auto& entry : std::filesystem::directory_iterator(path.parent_path(), ec)) {
+                ST::string name = ST::string::from_path(entry.path().filename());
+                if (name.starts_with(prefix, ST::case_insensitive) &&
+                    ST::string::from_path(entry.path().extension()).compare_i(".prp") == 0)
+                    pages[entry.path()] = true;
+            }
+            // directory_iterator has no defined order, so sort before hashing.
+            for (const auto& [page, _] : pages)
+                add_file(page);
+        }
+        return hasher.digest();
+    }
+
+    // =======================================================================
+
+    class registry_cache
+    {
+        struct entry
+        {
+            gpp::hash_t m_Stamp;
+            std::shared_ptr<plResManager> m_Mgr;
+            std::shared_ptr<gpp::object_index> m_Index;
+            std::vector<std::shared_ptr<plResManager>> m_Lenders;
+        };
+
+        // A registry loaded lazily is no good to somebody who wants it fully loaded,
+        // so the mode is part of the key.
+        using key_t = std::tuple<std::filesystem::path, gpp::load_mode>;
+        std::map<key_t, entry> m_Entries;
+
+    public:
+        std::tuple<std::shared_ptr<plResManager>, std::shared_ptr<gpp::object_index>, bool>
+        get(const std::filesystem::path& path, gpp::load_mode mode)
+        {
+            gpp::hash_t stamp = registry_stamp(path);
+            key_t key{ path, mode };
+            auto it = m_Entries.find(key);
+            if (it != m_Entries.end()) {
+                if (it->second.m_Stamp == stamp)
+                    return std::make_tuple(it->second.m_Mgr, it->second.m_Index, true);
+                gpp::log::debug("  -> '{}' changed on disk, reloading it", path);
+                m_Entries.erase(it);
+            }
+
+            auto [mgr, index] = gpp::patcher_base::load(path, mode);
+            m_Entries[key] = { stamp, mgr, index, {} };
+            return std::make_tuple(mgr, index, false);
+        }
+
+        /** The registry at this path was just saved, so it matches what is on disk again. */
+        void restamp(const std::filesystem::path& path)
+        {
+            gpp::hash_t stamp = registry_stamp(path);
+            for (auto& [key, value] : m_Entries) {
+                if (std::get<0>(key) == path)
+                    value.m_Stamp = stamp;
+            }
+        }
+
+        /**
+         * Objects from other registries were moved into the one at this path, so those
+         * registries have to live as long as it does.
+         */
+        void lend(const std::filesystem::path& path, const std::vector<std::shared_ptr<plResManager>>& lenders)
+        {
+            for (auto& [key, value] : m_Entries) {
+                if (std::get<0>(key) == path)
+                    value.m_Lenders.insert(value.m_Lenders.end(), lenders.begin(), lenders.end());
+            }
+        }
+
+        void evict(const std::filesystem::path& path)
+        {
+            for (auto it = m_Entries.begin(); it != m_Entries.end(); ) {
+                if (std::get<0>(it->first) == path)
+                    it = m_Entries.erase(it);
+                else
+                    ++it;
+            }
+        }
+
+        /** Evicts everything loaded from a directory. */
+        void evict_directory(const std::filesystem::path& dir)
+        {
+            for (auto it = m_Entries.begin(); it != m_Entries.end(); ) {
+                if (std::get<0>(it->first).parent_path() == dir)
+                    it = m_Entries.erase(it);
+                else
+                    ++it;
+            }
+        }
+    };
+
+    // =======================================================================
+
+#ifndef _WIN32
+    bool read_all(int fd, void* buf, size_t size)
+    {
+        auto* ptr = reinterpret_cast<char*>(buf);
+        while (size > 0) {
+            ssize_t result = ::read(fd, ptr, size);
+            if (result <= 0)
+                return false;
+            ptr += result;
+            size -= result;
+        }
+        return true;
+    }
+
+    bool write_all(int fd, const void* buf, size_t size)
+    {
+        auto* ptr = reinterpret_cast<const char*>(buf);
+        while (size > 0) {
+            ssize_t result = ::send(fd, ptr, size, MSG_NOSIGNAL);
+            if (result <= 0)
+                return false;
+            ptr += result;
+            size -= result;
+        }
+        return true;
+    }
+
+    /** Frames are a little endian 32-bit length followed by that many bytes of JSON. */
+    bool read_frame(int fd, std::string& frame)
+    {
+        uint8_t header[4];
+        if (!read_all(fd, header, sizeof(header)))
+            return false;
+        uint32_t size = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+        if (size > kMaxFrameSize)
+            return false;
+        frame.resize(size);
+        return read_all(fd, frame.data(), size);
+    }
+
+    bool write_frame(int fd, const std::string& frame)
+    {
+        uint32_t size = (uint32_t)frame.size();
+        uint8_t header[4] = { (uint8_t)size, (uint8_t)(size >> 8), (uint8_t)(size >> 16), (uint8_t)(size >> 24) };
+        return write_all(fd, header, sizeof(header)) && write_all(fd, frame.data(), frame.size());
+    }
+
+    sockaddr_un make_address(const std::filesystem::path& socketPath)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::string path = socketPath.string();
+        if (path.size() >= sizeof(addr.sun_path))
+            gpp::error::raise("Socket path '{}' is too long", socketPath);
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        return addr;
+    }
+
+    // =======================================================================
+
+    struct request
+    {
+        int m_Client;
+        nlohmann::json m_Body;
+        steady_clock::time_point m_Received;
+    };
+
+    class server
+    {
+        int m_Socket;
+        registry_cache m_Cache;
+        std::deque<request> m_Queue;
+        std::mutex m_QueueLock;
+        std::condition_variable m_QueueCV;
+        std::atomic<bool> m_Stopping;
+        size_t m_Readers;
+        std::mutex m_ReadersLock;
+        std::condition_variable m_ReadersCV;
+
+    private:
+        nlohmann::json patch(const nlohmann::json& body)
+        {
+            std::filesystem::path source = std::filesystem::u8path(body.at("source").get<std::string>());
+            std::filesystem::path dest = std::filesystem::u8path(body.at("destination").get<std::string>());
+            auto mode = body.value("lazy", false) ? gpp::load_mode::e_lazy : gpp::load_mode::e_full;
+            nlohmann::json reply;
+
+            auto start = steady_clock::now();
+            auto [srcMgr, srcIndex, srcCached] = m_Cache.get(source, mode);
+            auto [dstMgr, dstIndex, dstCached] = m_Cache.get(dest, mode);
+            reply["cached_source"] = srcCached;
+            reply["cached_destination"] = dstCached;
+            reply["load_ms"] = elapsed_ms(start);
+
+            // Patching moves objects out of the source and rewires others, so it's never
+            // fit to be used again. The destination may now own some of its objects, though.
+            try {
+                gpp::patcher patcher(srcMgr, srcIndex, dstMgr, dstIndex);
+                start = steady_clock::now();
+                if (body.value("colliders", true))
+                    patcher.process_collision();
+                if (body.value("drawables", true))
+                    patcher.process_drawables();
+                reply["patch_ms"] = elapsed_ms(start);
+
+                start = steady_clock::now();
+                if (patcher.has_damage())
+                    patcher.save_damage(source, dest);
+                reply["save_ms"] = elapsed_ms(start);
+                m_Cache.lend(dest, patcher.lenders());
+            } catch (...) {
+                // Whatever happened, the destination in memory no longer matches the disk.
+                m_Cache.evict(source);
+                m_Cache.evict(dest);
+                throw;
+            }
+            m_Cache.evict(source);
+            m_Cache.restamp(dest);
+            return reply;
+        }
+
+        nlohmann::json merge(const nlohmann::json& body)
+        {
+            std::filesystem::path source = std::filesystem::u8path(body.at("source").get<std::string>());
+            std::filesystem::path dest = std::filesystem::u8path(body.at("destination").get<std::string>());
+            nlohmann::json reply;
+
+            // The merger mangles its registry beyond reuse, and it may rewrite any page in the
+            // Age, so it always loads fresh and anything cached from that Age must go.
+            m_Cache.evict_directory(dest.parent_path());
+
+            auto start = steady_clock::now();
+            gpp::merger merger(source, dest);
+            reply["load_ms"] = elapsed_ms(start);
+
+            start = steady_clock::now();
+            merger.process();
+            reply["patch_ms"] = elapsed_ms(start);
+
+            start = steady_clock::now();
+            merger.save_damage(source, dest);
+            reply["save_ms"] = elapsed_ms(start);
+            return reply;
+        }
+
+        nlohmann::json handle(const request& req)
+        {
+            nlohmann::json reply;
+            try {
+                std::string op = req.m_Body.at("op").get<std::string>();
+                if (op == "patch") {
+                    reply = patch(req.m_Body);
+                } else if (op == "merge") {
+                    reply = merge(req.m_Body);
+                } else if (op == "ping") {
+                    reply = nlohmann::json::object();
+                } else if (op == "shutdown") {
+                    m_Stopping = true;
+                    ::shutdown(m_Socket, SHUT_RDWR);
+                    reply = nlohmann::json::object();
+                } else {
+                    gpp::error::raise("Unknown request '{}'", op);
+                }
+                reply["ok"] = true;
+            } catch (const std::exception& ex) {
+                reply["ok"] = false;
+                reply["error"] = ex.what();
+            }
+            return reply;
+        }
+
+        void work()
+        {
+            while (true) {
+                request req;
+                {
+                    std::unique_lock<std::mutex> lock(m_QueueLock);
+                    m_QueueCV.wait(lock, [this]() { return !m_Queue.empty(); });
+                    req = std::move(m_Queue.front());
+                    m_Queue.pop_front();
+                }
+
+                // A client of -1 is the signal from the acceptor that it has stopped.
+                if (req.m_Client == -1)
+                    break;
+
+                double queued = elapsed_ms(req.m_Received);
+                nlohmann::json reply = handle(req);
+                reply["queued_ms"] = queued;
+                reply["total_ms"] = elapsed_ms(req.m_Received);
+                gpp::log::debug("Request '{}' finished in {} ms",
+                               req.m_Body.value("op", std::string()), reply["total_ms"].get<double>());
+
+                (void)write_frame(req.m_Client, reply.dump());
+                ::close(req.m_Client);
+            }
+        }
+
+        void enqueue(request req)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_QueueLock);
+                m_Queue.push_back(std::move(req));
+            }
+            m_QueueCV.notify_one();
+        }
+
+        /** Runs on its own thread so that a slow client can't hold up anyone else. */
+        void receive(request req)
+        {
+            std::string frame;
+            if (!read_frame(req.m_Client, frame)) {
+                ::close(req.m_Client);
+            } else {
+                try {
+                    req.m_Body = nlohmann::json::parse(frame);
+                    enqueue(std::move(req));
+                } catch (const nlohmann::json::exception& ex) {
+                    nlohmann::json reply = { { "ok", false }, { "error", ex.what() } };
+                    (void)write_frame(req.m_Client, reply.dump());
+                    ::close(req.m_Client);
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_ReadersLock);
+                --m_Readers;
+            }
+            m_ReadersCV.notify_all();
+        }
+
+    public:
+        server(const std::filesystem::path& socketPath)
+            : m_Socket(-1), m_Stopping(false), m_Readers()
+        {
+            sockaddr_un addr = make_address(socketPath);
+            m_Socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (m_Socket == -1)
+                gpp::error::raise("Unable to create a socket: {}", strerror(errno));
+
+            // A stale socket from a server that crashed would make bind() fail.
+            ::unlink(addr.sun_path);
+            if (::bind(m_Socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+                ::listen(m_Socket, SOMAXCONN) != 0) {
+                ::close(m_Socket);
+                gpp::error::raise("Unable to listen on '{}': {}", socketPath, strerror(errno));
+            }
+        }
+
+        server(const server&) = delete;
+        server(server&&) = delete;
+
+        ~server()
+        {
+            ::close(m_Socket);
+        }
+
+        void run()
+        {
+            // Registries aren't thread safe, so requests are handled one at a time by the
+            // worker while this thread keeps accepting and queueing new clients.
+            std::thread worker(&server::work, this);
+
+            while (true) {
+                int client = ::accept(m_Socket, nullptr, nullptr);
+                if (client == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    break;
+                }
+
+                timeval timeout{ 5, 0 };
+                setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+                {
+                    std::lock_guard<std::mutex> lock(m_ReadersLock);
+                    ++m_Readers;
+                }
+                std::thread(&server::receive, this, request{ client, {}, steady_clock::now() }).detach();
+            }
+
+            // Let anybody still sending a request finish before the worker is told to stop.
+            {
+                std::unique_lock<std::mutex> lock(m_ReadersLock);
+                m_ReadersCV.wait(lock, [this]() { return m_Readers == 0; });
+            }
+            enqueue({ -1, {}, steady_clock::now() });
+            worker.join();
+            if (!m_Stopping)
+                gpp::error::raise("Unable to accept connections: {}", strerror(errno));
+        }
+    };
+#endif
+};
+
+// ===========================================================================
+
+void gpp::ipc::serve(const std::filesystem::path& socketPath)
+{
+#ifdef _WIN32
+    error::raise("The patch server is not supported on Windows.");
+#else
+    server myServer(socketPath);
+    log::debug("Listening on '{}'...", socketPath);
+    myServer.run();
+    ::unlink(socketPath.c_str());
+#endif
+}
+
+std::string gpp::ipc::send(const std::filesystem::path& socketPath, const std::string& op,
+                           const std::filesystem::path& source, const std::filesystem::path& dest)
+{
+#ifdef _WIN32
+    error::raise("The patch server is not supported on Windows.");
+#else
+    nlohmann::json body = { { "op", op } };
+    if (!source.empty())
+        body["source"] = std::filesystem::absolute(source).u8string();
+    if (!dest.empty())
+        body["destination"] = std::filesystem::absolute(dest).u8string();
+
+    sockaddr_un addr = make_address(socketPath);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        error::raise("Unable to create a socket: {}", strerror(errno));
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        ::close(fd);
+        error::raise("Unable to connect to '{}': {}", socketPath, strerror(errno));
+    }
+
+    std::string reply;
+    bool ok = write_frame(fd, body.dump()) && read_frame(fd, reply);
+    ::close(fd);
+    if (!ok)
+        error::raise("The server at '{}' hung up without replying", socketPath);
+
+    nlohmann::json result = nlohmann::json::parse(reply, nullptr, false);
+    if (result.is_discarded())
+        error::raise("The server at '{}' sent garbage", socketPath);
+    if (!result.value("ok", false))
+        error::raise("The server could not {}: {}", op, result.value("error", std::string("unknown error")));
+    return reply;
+#endif
+}
+
+std::vector<std::string> gpp::ipc::send_concurrently(const std::filesystem::path& socketPath, const std::string& op,
+                                                     const std::filesystem::path& source,
+                                                     const std::filesystem::path& dest, size_t clients)
+{
+    std::vector<std::string> replies(clients);
+    std::vector<std::thread> pool;
+    for (size_t i = 0; i < clients; ++i) {
+        pool.emplace_back([&, i]() {
+            try {
+                replies[i] = send(socketPath, op, source, dest);
+            } catch (const std::exception& ex) {
+                replies[i] = nlohmann::json({ { "ok", false }, { "error", ex.what() } }).dump();
+            }
+        });
+    }
+    for (auto& thread : pool)
+        thread.join();
+    return replies;
+}
@@ -0,0 +1,57 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_SERVER_H
+#define _GPP_SERVER_H
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace gpp
+{
+    namespace ipc
+    {
+        /**
+         * Listens on a Unix domain socket for framed JSON patch and merge requests, keeping
+         * the registries it loads in memory for as long as their files are unchanged.
+         * Returns once a client sends a shutdown request.
+         */
+        void serve(const std::filesystem::path& socketPath);
+
+        /**
+         * Sends one request to a running server and waits for the reply.
+         * \param op One of "patch", "merge", "ping", or "shutdown".
+         * \returns The JSON reply, which includes the server's timings.
+         * \throws gpp::error if the server was unable to handle the request.
+         */
+        [[nodiscard]]
+        std::string send(const std::filesystem::path& socketPath, const std::string& op,
+                         const std::filesystem::path& source = {},
+                         const std::filesystem::path& dest = {});
+
+        /**
+         * Stands in for several exporter instances at once to exercise a server's queue.
+         * \returns Each client's reply, or the error it got, in the order they were started.
+         */
+        [[nodiscard]]
+        std::vector<std::string> send_concurrently(const std::filesystem::path& socketPath, const std::string& op,
+                                                   const std::filesystem::path& source,
+                                                   const std::filesystem::path& dest, size_t clients);
+    };
+};
+
+#endif
@@ -0,0 +1,258 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "watch.hpp"
+#include <errors.hpp>
+#include <log.hpp>
+#include <patcher.hpp>
+#include <progress.hpp>
+
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <string_theory/iostream>
+#include <string_theory/string>
+
+#ifdef __linux__
+#   include <poll.h>
+#   include <sys/inotify.h>
+#   include <unistd.h>
+#endif
+
+// ===========================================================================
+
+namespace
+{
+    bool is_page(const std::filesystem::path& path)
+    {
+        return ST::string::from_path(path.extension()).compare_i(".prp") == 0;
+    }
+
+    std::filesystem::path normalize(const std::filesystem::path& path)
+    {
+        std::error_code ec;
+        std::filesystem::path result = std::filesystem::weakly_canonical(path, ec);
+        return ec ? path.lexically_normal() : result;
+    }
+};
+
+// ===========================================================================
+
+gpp::directory_watcher::directory_watcher(const std::filesystem::path& dir)
+    : m_Directory(dir), m_Notify(-1)
+{
+    if (!std::filesystem::is_directory(dir))
+        error::raise("Cannot watch '{}' because it is not a directory.", dir);
+
+#ifdef __linux__
+    m_Notify = inotify_init1(IN_CLOEXEC);
+    if (m_Notify != -1 && inotify_add_watch(m_Notify, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        close(m_Notify);
+        m_Notify = -1;
+    }
+#endif
+    if (m_Notify == -1) {
+        log::debug("  -> inotify is unavailable, polling '{}' instead", dir);
+        (void)scan();
+    }
+}
+
+gpp::directory_watcher::~directory_watcher()
+{
+#ifdef __linux__
+    if (m_Notify != -1)
+        close(m_Notify);
+#endif
+}
+
+// ===========================================================================
+
+std::set<std::filesystem::path> gpp::directory_watcher::scan()
+{
+    std::set<std::filesystem::path> result;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(m_Directory, ec)) {
+        if (!entry.is_regular_file(ec) || !is_page(entry.path()))
+            continue;
+
+        auto mtime = entry.last_write_time(ec);
+        if (ec)
+            continue;
+        auto [it, inserted] = m_Times.try_emplace(entry.path(), mtime);
+        if (!inserted && it->second != mtime) {
+            it->second = mtime;
+            result.insert(entry.path());
+        }
+    }
+    return result;
+}
+
+std::set<std::filesystem::path> gpp::directory_watcher::wait_notify(std::chrono::milliseconds settle,
+                                                                    const progress* token)
+{
+    constexpr int kCancelInterval = 250;
+
+    std::set<std::filesystem::path> result;
+#ifdef __linux__
+    alignas(inotify_event) char buf[4096];
+    pollfd fd{ m_Notify, POLLIN, 0 };
+
+    // Block for the first event, waking up now and then to see if we should stop, then
+    // drain until things quiet down.
+    int timeout = token ? kCancelInterval : -1;
+    while (true) {
+        int ready = poll(&fd, 1, timeout);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready <= 0) {
+            if (!result.empty() || (token && token->is_cancelled()))
+                break;
+            continue;
+        }
+
+        ssize_t len = read(m_Notify, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+
+        for (char* ptr = buf; ptr < buf + len; ) {
+            const auto* event = reinterpret_cast<const inotify_event*>(ptr);
+            if (event->len > 0) {
+                std::filesystem::path file = m_Directory / event->name;
+                if (is_page(file))
+                    result.insert(std::move(file));
+            }
+            ptr += sizeof(inotify_event) + event->len;
+        }
+
+        if (!result.empty())
+            timeout = (int)settle.count();
+    }
+#endif
+    return result;
+}
+
+std::set<std::filesystem::path> gpp::directory_watcher::wait_poll(std::chrono::milliseconds settle,
+                                                                  const progress* token)
+{
+    constexpr auto kPollInterval = std::chrono::milliseconds(500);
+
+    std::set<std::filesystem::path> result;
+    while (result.empty()) {
+        std::this_thread::sleep_for(kPollInterval);
+        if (token && token->is_cancelled())
+            return result;
+        result = scan();
+    }
+
+    // Keep going until a scan comes back clean.
+    while (true) {
+        std::this_thread::sleep_for(settle);
+        auto more = scan();
+        if (more.empty())
+            break;
+        result.insert(more.begin(), more.end());
+    }
+    return result;
+}
+
+std::set<std::filesystem::path> gpp::directory_watcher::wait(std::chrono::milliseconds settle,
+                                                             const progress* token)
+{
+    if (m_Notify != -1)
+        return wait_notify(settle, token);
+    return wait_poll(settle, token);
+}
+
+// ===========================================================================
+
+void gpp::watch(patcher& patcher, const std::filesystem::path& source,
+                const std::filesystem::path& dest, const watch_options& options)
+{
+    // Patching an Age means any page next to it is fair game. Otherwise, just the one page.
+    bool singlePage = is_page(source);
+    std::filesystem::path wd = source.parent_path();
+    if (wd.empty())
+        wd = ".";
+    directory_watcher watcher(wd);
+
+    std::cout << ST::format("Watching '{}' for changes. Press Ctrl+C to stop.", wd) << std::endl;
+    load_mode mode = options.m_Lazy ? load_mode::e_lazy : load_mode::e_full;
+    patcher.clear_damage();
+
+    // Once Ctrl+C cancels the token, every later repatch would throw, so take it as the
+    // signal to stop watching instead.
+    auto stopped = [&options]() { return options.m_Progress && options.m_Progress->is_cancelled(); };
+    while (!stopped()) {
+        // The destination may live in the watched directory, in which case saving it
+        // would wake us right back up.
+        std::set<std::filesystem::path> outputs;
+        for (const auto& file : patcher.destination_files())
+            outputs.insert(normalize(file));
+
+        for (const auto& page : watcher.wait(std::chrono::milliseconds(250), options.m_Progress.get())) {
+            if (stopped())
+                break;
+            if (singlePage && page.filename() != source.filename())
+                continue;
+            if (outputs.find(normalize(page)) != outputs.end())
+                continue;
+
+            log::flush();
+            std::cout << ST::format("Repatching '{}'...", page.filename()) << std::endl;
+            auto start = std::chrono::steady_clock::now();
+            try {
+                patcher.load_source(page, mode);
+            } catch (const std::exception& ex) {
+                // Nothing has been done to the destination yet, so just wait for the next save.
+                log::flush();
+                std::cerr << ST::format("Unable to load '{}':", page.filename()) << std::endl;
+                std::cerr << ex.what() << std::endl;
+                continue;
+            }
+
+            try {
+                if (options.m_Colliders)
+                    patcher.process_collision();
+                if (options.m_Drawables)
+                    patcher.process_drawables();
+                if (patcher.has_damage())
+                    patcher.save_damage(page, dest);
+                patcher.clear_damage();
+            } catch (const cancelled&) {
+                // We're about to stop, so there's no point in reloading the destination.
+                break;
+            } catch (const std::exception& ex) {
+                log::flush();
+                std::cerr << ST::format("Unable to repatch '{}':", page.filename()) << std::endl;
+                std::cerr << ex.what() << std::endl;
+
+                // The resident destination is half patched and can't be trusted, so start
+                // over from what's on disk. If even that fails, there's nothing left to do.
+                patcher.load_destination(dest, mode);
+                continue;
+            }
+
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            log::flush();
+            std::cout << ST::format("... done in {.2f}s", elapsed.count()) << std::endl;
+        }
+    }
+
+    log::flush();
+    std::cout << "Stopped watching." << std::endl;
+}
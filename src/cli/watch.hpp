@@ -0,0 +1,83 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_WATCH_H
+#define _GPP_WATCH_H
+
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <set>
+
+namespace gpp
+{
+    class patcher;
+    class progress;
+
+    /**
+     * Waits for PRP files in a directory to be written. Uses inotify where available and
+     * falls back to polling modification times everywhere else.
+     */
+    class directory_watcher
+    {
+        std::filesystem::path m_Directory;
+        std::map<std::filesystem::path, std::filesystem::file_time_type> m_Times;
+        int m_Notify;
+
+    private:
+        std::set<std::filesystem::path> scan();
+        std::set<std::filesystem::path> wait_notify(std::chrono::milliseconds settle, const progress* token);
+        std::set<std::filesystem::path> wait_poll(std::chrono::milliseconds settle, const progress* token);
+
+    public:
+        directory_watcher() = delete;
+        directory_watcher(const directory_watcher&) = delete;
+        directory_watcher(directory_watcher&&) = delete;
+
+        directory_watcher(const std::filesystem::path& dir);
+        ~directory_watcher();
+
+    public:
+        /**
+         * Blocks until at least one PRP changes and no more changes arrive for the
+         * settle time, which keeps us from reading pages the exporter is still writing.
+         * Returns nothing if \a token is cancelled while waiting.
+         */
+        [[nodiscard]]
+        std::set<std::filesystem::path> wait(std::chrono::milliseconds settle = std::chrono::milliseconds(250),
+                                             const progress* token = nullptr);
+    };
+
+    struct watch_options
+    {
+        bool m_Colliders{ true };
+        bool m_Drawables{ true };
+        bool m_Lazy{ false };
+
+        /** Cancelling this token, e.g. from a SIGINT handler, stops watching. */
+        std::shared_ptr<progress> m_Progress;
+    };
+
+    /**
+     * Keeps the destination resident in the patcher and re-patches each source page as
+     * soon as it is rewritten. Returns once the options' progress token is cancelled.
+     */
+    void watch(patcher& patcher, const std::filesystem::path& source,
+               const std::filesystem::path& dest, const watch_options& options);
+};
+
+#endif
@@ -14,14 +14,13 @@
  * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <algorithm>
-
 #include <QtWidgets>
 
 #include <PRP/KeyedObject/plKey.h>
 #include <ResManager/plFactory.h>
 
 #include "key_finder.hpp"
+#include "key_model.hpp"
 
 // ===========================================================================
 
@@ -29,7 +28,7 @@ gpp::key_finder::key_finder(QWidget* parent)
     : m_Layout(new QVBoxLayout(this)), m_Text(new QLabel("What do you see?", this)),
       m_Form(new QFormLayout(this)), m_Search(new QLineEdit(this)),
       m_SearchCompleter(new QCompleter(this)), m_KeyList(new QListView(this)),
-      m_List(new QStringListModel(this)), m_ActiveReq(), QDialog(parent)
+      m_List(new key_model(this)), m_ActiveReq(), QDialog(parent)
 {
     setWindowTitle("Select Key");
 
@@ -72,21 +71,9 @@ gpp::key_finder::~key_finder()
 void gpp::key_finder::handle_KeyRequest(gpp::key_request* req)
 {
     m_ActiveReq = req;
-    m_QStrs.reserve(req->m_Haystack.size());
-    std::for_each(req->m_Haystack.begin(), req->m_Haystack.end(),
-                  [this](const plKey& i) {
-                      ST::utf16_buffer buf = i->getName().to_utf16();
-                      m_QStrs.emplace_back(QString::fromUtf16(buf.data(), buf.size()));
-                  }
-    );
-    std::sort(m_QStrs.begin(), m_QStrs.end(),
-              [](const QString& s1, const QString& s2) {
-                  return s1.compare(s2, Qt::CaseInsensitive) < 1;
-              }
-    );
+    m_List->set_index(req->m_Haystack);
 
     m_Search->setText(QString());
-    handle_SearchUpdate(QString());
     m_Search->setFocus(Qt::PopupFocusReason);
 
     const char* pClass = plFactory::ClassName(req->m_Needle->getType());
@@ -102,14 +89,7 @@ void gpp::key_finder::handle_KeyRequest(gpp::key_request* req)
 
 void gpp::key_finder::handle_SearchUpdate(const QString& needle)
 {
-    QStringList strList;
-    std::for_each(m_QStrs.begin(), m_QStrs.end(),
-                  [&needle, &strList](const QString& i) {
-                      if (i.startsWith(needle, Qt::CaseInsensitive))
-                          strList.append(i);
-                  }
-    );
-    m_List->setStringList(strList);
+    m_List->filter(needle);
 }
 
 void gpp::key_finder::handle_KeyActivated(const QModelIndex& index)
@@ -126,24 +106,15 @@ void gpp::key_finder::handle_KeyActivated(const QModelIndex& index)
 void gpp::key_finder::handle_Accept()
 {
     if (m_ActiveReq) {
-        QString qName = m_List->data(m_KeyList->currentIndex()).toString();
-        static_assert(sizeof(QChar) == sizeof(char16_t), "QString is not utf-16!!!");
-        ST::string name = ST::string::from_utf16(reinterpret_cast<const char16_t*>(qName.data()),
-                                                 qName.size(), ST::assume_valid);
-
-        auto it = std::find_if(m_ActiveReq->m_Haystack.begin(), m_ActiveReq->m_Haystack.end(),
-                               [&name](const plKey& i) {
-                                   return i->getName() == name;
-                               }
-        );
-        if (it == m_ActiveReq->m_Haystack.end()) {
+        plKey key = m_List->key(m_KeyList->currentIndex());
+        if (!key.Exists()) {
             QMessageBox::critical(this, "Error", "Mapping selection into the key haystack failed.\n"
                                                  "Contact a h4xx0r to fix this problem.",
                                   QMessageBox::Ok, QMessageBox::NoButton);
             return;
         }
 
-        m_PickedKey = *it;
+        m_PickedKey = std::move(key);
         m_ActiveReq->m_Signal->notify_one();
         reset_KeyRequest();
     }
@@ -157,11 +128,15 @@ void gpp::key_finder::handle_Decline()
     }
 }
 
+void gpp::key_finder::cancel_KeyRequest()
+{
+    handle_Decline();
+}
+
 void gpp::key_finder::reset_KeyRequest()
 {
     hide();
     m_Accept->setEnabled(false);
     m_ActiveReq = nullptr;
-    m_QStrs.clear();
-    m_List->setStringList(QStringList());
+    m_List->clear();
 }
@@ -19,6 +19,7 @@
 
 #include <QDialog>
 
+#include <memory>
 #include <tuple>
 #include <vector>
 
@@ -30,24 +31,26 @@ class QFormLayout;
 class QLabel;
 class QLineEdit;
 class QListView;
-class QStringListModel;
 class QVBoxLayout;
 class QWaitCondition;
 
 namespace gpp
 {
+    class key_index;
+    class key_model;
+
     class key_request : public QObject
     {
         Q_OBJECT
 
     public:
         const plKey& m_Needle;
-        const std::vector<plKey>& m_Haystack;
+        std::shared_ptr<const key_index> m_Haystack;
         QWaitCondition* m_Signal;
 
-        key_request(const plKey& needle, const std::vector<plKey>& haystack,
+        key_request(const plKey& needle, std::shared_ptr<const key_index> haystack,
                     QWaitCondition* signal)
-            : m_Needle(needle), m_Haystack(haystack), m_Signal(signal)
+            : m_Needle(needle), m_Haystack(std::move(haystack)), m_Signal(signal)
         { }
     };
 
@@ -62,18 +65,20 @@ namespace gpp
         QLineEdit* m_Search;
         QCompleter* m_SearchCompleter;
         QListView* m_KeyList;
-        QStringListModel* m_List;
+        key_model* m_List;
         QCommandLinkButton* m_Accept;
         QCommandLinkButton* m_Decline;
 
         key_request* m_ActiveReq;
-        std::vector<QString> m_QStrs;
         plKey m_PickedKey;
 
 
     public slots:
         void handle_KeyRequest(key_request*);
 
+        /** Declines the request being shown, if any, so the patcher stops waiting on it. */
+        void cancel_KeyRequest();
+
     private slots:
         void handle_SearchUpdate(const QString&);
         void handle_KeyActivated(const QModelIndex& index);
@@ -0,0 +1,192 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include <PRP/KeyedObject/plKey.h>
+
+#include "key_model.hpp"
+
+// ===========================================================================
+
+namespace
+{
+    QString to_qstring(const ST::string& str)
+    {
+        ST::utf16_buffer buf = str.to_utf16();
+        return QString::fromUtf16(buf.data(), buf.size());
+    }
+};
+
+// ===========================================================================
+
+gpp::key_index::key_index(const std::vector<plKey>& haystack)
+    : m_Haystack(haystack)
+{
+    m_Entries.reserve(haystack.size());
+    for (const auto& key : haystack) {
+        QString name = to_qstring(key->getName());
+        QString folded = name.toCaseFolded();
+        m_Entries.push_back({ std::move(name), std::move(folded), key });
+    }
+    std::sort(m_Entries.begin(), m_Entries.end(),
+              [](const entry& lhs, const entry& rhs) {
+                  int cmp = lhs.m_Folded.compare(rhs.m_Folded);
+                  return cmp == 0 ? lhs.m_Name < rhs.m_Name : cmp < 0;
+              }
+    );
+}
+
+std::tuple<size_t, size_t> gpp::key_index::prefix_range(const QString& needle) const
+{
+    // Everything starting with the needle is contiguous in the sorted folded names.
+    auto begin = std::lower_bound(m_Entries.begin(), m_Entries.end(), needle,
+                                  [](const entry& lhs, const QString& rhs) {
+                                      return lhs.m_Folded < rhs;
+                                  }
+    );
+    auto end = std::find_if(begin, m_Entries.end(),
+                            [&needle](const entry& i) {
+                                return !i.m_Folded.startsWith(needle);
+                            }
+    );
+    return std::make_tuple(begin - m_Entries.begin(), end - m_Entries.begin());
+}
+
+// ===========================================================================
+
+std::shared_ptr<const gpp::key_index> gpp::key_index_cache::get(const std::vector<plKey>& haystack)
+{
+    if (haystack.empty())
+        return std::make_shared<key_index>();
+
+    // Comparing the keys themselves is cheap next to rebuilding, and catches any
+    // keys that were added to the destination since the index was built.
+    auto id = std::make_tuple(haystack.front()->getLocation(), haystack.front()->getType());
+    auto it = m_Indices.find(id);
+    if (it != m_Indices.end() && it->second->matches(haystack))
+        return it->second;
+
+    auto index = std::make_shared<key_index>(haystack);
+    m_Indices[id] = index;
+    return index;
+}
+
+// ===========================================================================
+
+gpp::key_model::key_model(QObject* parent)
+    : QAbstractListModel(parent)
+{
+}
+
+// ===========================================================================
+
+void gpp::key_model::set_index(std::shared_ptr<const key_index> index)
+{
+    beginResetModel();
+    m_Index = std::move(index);
+    m_Needle.clear();
+    m_Rows.resize(m_Index ? m_Index->size() : 0);
+    for (size_t i = 0; i < m_Rows.size(); ++i)
+        m_Rows[i] = i;
+    endResetModel();
+}
+
+void gpp::key_model::clear()
+{
+    beginResetModel();
+    m_Index.reset();
+    m_Rows.clear();
+    m_Needle.clear();
+    endResetModel();
+}
+
+// ===========================================================================
+
+void gpp::key_model::filter(const QString& needle)
+{
+    QString folded = needle.toCaseFolded();
+    if (!m_Index || folded == m_Needle)
+        return;
+
+    const auto& entries = m_Index->entries();
+    std::vector<size_t> rows;
+    if (folded.isEmpty()) {
+        rows.resize(entries.size());
+        for (size_t i = 0; i < rows.size(); ++i)
+            rows[i] = i;
+    } else {
+        auto [begin, end] = m_Index->prefix_range(folded);
+        rows.reserve(end - begin);
+        for (size_t i = begin; i < end; ++i)
+            rows.push_back(i);
+
+        // Anything containing the new needle also contained the old one, so typing
+        // more characters only has to look at what is already in the list.
+        std::vector<size_t> matches;
+        auto find_matches = [&](size_t i) {
+            if ((i < begin || i >= end) && entries[i].m_Folded.contains(folded))
+                matches.push_back(i);
+        };
+        if (!m_Needle.isEmpty() && folded.startsWith(m_Needle)) {
+            std::for_each(m_Rows.begin(), m_Rows.end(), find_matches);
+            std::sort(matches.begin(), matches.end());
+        } else {
+            for (size_t i = 0; i < entries.size(); ++i)
+                find_matches(i);
+        }
+        rows.insert(rows.end(), matches.begin(), matches.end());
+    }
+
+    beginResetModel();
+    m_Rows = std::move(rows);
+    m_Needle = std::move(folded);
+    endResetModel();
+}
+
+plKey gpp::key_model::key(const QModelIndex& index) const
+{
+    if (!index.isValid() || index.row() >= rowCount())
+        return plKey();
+    return m_Index->entries()[m_Rows[index.row()]].m_Key;
+}
+
+// ===========================================================================
+
+int gpp::key_model::rowCount(const QModelIndex& parent) const
+{
+    if (parent.isValid())
+        return 0;
+    return static_cast<int>(m_Rows.size());
+}
+
+QVariant gpp::key_model::data(const QModelIndex& index, int role) const
+{
+    if (!index.isValid() || index.row() >= rowCount())
+        return QVariant();
+
+    const auto& i = m_Index->entries()[m_Rows[index.row()]];
+    switch (role) {
+    case Qt::DisplayRole:
+    case Qt::EditRole:
+        return i.m_Name;
+    case Qt::ToolTipRole:
+        // Names aren't unique across pages, so show where the key lives.
+        return to_qstring(i.m_Key->getLocation().toString());
+    default:
+        return QVariant();
+    }
+}
@@ -0,0 +1,109 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_GUI_KEY_MODEL_H
+#define _GPP_GUI_KEY_MODEL_H
+
+#include <QAbstractListModel>
+#include <QString>
+
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include <PRP/KeyedObject/plKey.h>
+
+namespace gpp
+{
+    /**
+     * Case folded, sorted names for a key haystack. Building one is the expensive part
+     * of showing the key finder, so they are immutable and may be built on any thread.
+     */
+    class key_index
+    {
+    public:
+        struct entry
+        {
+            QString m_Name;
+            QString m_Folded;
+            plKey m_Key;
+        };
+
+    private:
+        std::vector<plKey> m_Haystack;
+        std::vector<entry> m_Entries;
+
+    public:
+        key_index() = default;
+        explicit key_index(const std::vector<plKey>& haystack);
+
+    public:
+        const std::vector<entry>& entries() const { return m_Entries; }
+        size_t size() const { return m_Entries.size(); }
+
+        /** Half-open range of the entries whose folded names start with \a needle. */
+        std::tuple<size_t, size_t> prefix_range(const QString& needle) const;
+
+        /** Whether this index was built from exactly these keys. */
+        bool matches(const std::vector<plKey>& haystack) const { return m_Haystack == haystack; }
+    };
+
+    /**
+     * Keeps the indices built during a patch session. They are keyed by the location and
+     * class of the haystack and rebuilt whenever that haystack's keys change.
+     */
+    class key_index_cache
+    {
+        std::map<std::tuple<plLocation, uint16_t>, std::shared_ptr<const key_index>> m_Indices;
+
+    public:
+        std::shared_ptr<const key_index> get(const std::vector<plKey>& haystack);
+        void clear() { m_Indices.clear(); }
+    };
+
+    /**
+     * List model over a key index that stays fast with very large haystacks.
+     * Prefix matches come from a binary search and are listed first, followed
+     * by any other substring matches.
+     */
+    class key_model : public QAbstractListModel
+    {
+        Q_OBJECT
+
+        std::shared_ptr<const key_index> m_Index;
+        std::vector<size_t> m_Rows;
+        QString m_Needle;
+
+    public:
+        explicit key_model(QObject* parent=nullptr);
+
+    public:
+        void set_index(std::shared_ptr<const key_index> index);
+        void clear();
+
+        /** Shows only the keys whose names contain \a needle, ignoring case. */
+        void filter(const QString& needle);
+
+        plKey key(const QModelIndex& index) const;
+
+    public:
+        int rowCount(const QModelIndex& parent=QModelIndex()) const override;
+        QVariant data(const QModelIndex& index, int role=Qt::DisplayRole) const override;
+    };
+};
+
+#endif
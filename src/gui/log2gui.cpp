@@ -15,77 +15,58 @@
  */
 
 #include "log2gui.hpp"
-#include "errors.hpp"
+#include "log.hpp"
 
-#include <Debug/plDebug.h>
-#include <Stream/hsStream.h>
+#include <mutex>
 
 #include <QObject>
-#include <QTextEdit>
+#include <QString>
+#include <QTimer>
 
 // ===========================================================================
 
+constexpr int kDeliveryInterval = 50;
+
 namespace gpp
 {
-    class log2gui_stream : public log2gui, public hsStream
+    class log2gui_sink : public log2gui
     {
-        ST::string_stream m_Stream;
+        std::mutex m_Lock;
+        QString m_Pending;
+        QTimer* m_Timer;
 
     public:
-        log2gui_stream()
-            : log2gui()
+        log2gui_sink()
+            : log2gui(), m_Timer(new QTimer(this))
         {
-            plDebug::Init(plDebug::kDLAll, this);
+            // The drain thread only stashes lines. The timer lives on the GUI thread and hands
+            // them over at a fixed rate, so a chatty run can't flood the event loop.
+            log::init(plDebug::kDLAll, [this](const ST::string& lines) {
+                std::lock_guard<std::mutex> lock(m_Lock);
+                m_Pending.append(QString::fromUtf8(lines.c_str(), lines.size()));
+            });
+
+            connect(m_Timer, &QTimer::timeout, this, &log2gui_sink::deliver);
+            m_Timer->start(kDeliveryInterval);
         }
 
-        log2gui_stream(const log2gui_stream&) = delete;
-        log2gui_stream(log2gui_stream&&) = delete;
+        log2gui_sink(const log2gui_sink&) = delete;
+        log2gui_sink(log2gui_sink&&) = delete;
 
-        ~log2gui_stream()
+        ~log2gui_sink()
         {
-            plDebug::Init(plDebug::kDLNone);
+            log::shutdown();
         }
 
-        [[noreturn]]
-        uint32_t size() const override { error::raise("log2gui_stream::size()"); }
-
-        [[noreturn]]
-        uint32_t pos() const override { error::raise("log2gui_stream::position()"); }
-
-        [[noreturn]]
-        bool eof() const override { error::raise("log2gui_stream::eof()"); }
-
-        [[noreturn]]
-        void seek(uint32_t pos) override { error::raise("log2gui_stream::seek()"); }
-
-        [[noreturn]]
-        void skip(int32_t count) override { error::raise("log2gui_stream::skip()"); }
-
-        [[noreturn]]
-        void fastForward() override { error::raise("log2gui_stream::fastForward()"); }
-
-        [[noreturn]]
-        void rewind() override { error::raise("log2gui_stream::rewind()"); }
-
-        void flush() override
-        {
-            // ensure no trailing newline
-            bool nl = m_Stream.raw_buffer()[m_Stream.size() - 1] == '\n';
-
-            // assumes blocking connection...
-            QString str = QString::fromUtf8(m_Stream.raw_buffer(), m_Stream.size());
-                                            //nl ? m_Stream.size() - 1 : m_Stream.size());
-            m_Stream.truncate();
-            emit append(str);
-        }
-
-        [[noreturn]]
-        size_t read(size_t size, void* buf) override { error::raise("log2gui_stream::read()"); }
-
-        size_t write(size_t size, const void* buf) override
+        void deliver() override
         {
-            m_Stream.append(reinterpret_cast<const char*>(buf), size);
-            return size;
+            QString lines;
+            {
+                std::lock_guard<std::mutex> lock(m_Lock);
+                lines.swap(m_Pending);
+            }
+            if (!lines.isEmpty())
+                emit append(lines);
         }
     };
 };
@@ -94,5 +75,5 @@ namespace gpp
 
 std::unique_ptr<gpp::log2gui> gpp::log2gui::create()
 {
-    return std::make_unique<gpp::log2gui_stream>();
+    return std::make_unique<gpp::log2gui_sink>();
 }
@@ -20,8 +20,6 @@
 #include <memory>
 #include <QObject>
 
-class QTextEdit;
-
 namespace gpp
 {
     class log2gui : public QObject
@@ -39,6 +37,9 @@ namespace gpp
     public:
         virtual ~log2gui() = default;
 
+        /** Emits anything that is waiting for the next tick right now. */
+        virtual void deliver() = 0;
+
     public:
         static std::unique_ptr<log2gui> create();
     };
@@ -20,12 +20,22 @@
 
 #include <Debug/plDebug.h>
 
+#include <optional>
+
 #include "main.hpp"
 #include "key_finder.hpp"
+#include "key_model.hpp"
 #include "buildinfo.hpp"
 #include "errors.hpp"
+#include "log.hpp"
 #include "log2gui.hpp"
 #include "patcher.hpp"
+#include "progress.hpp"
+#include "trace.hpp"
+
+// ===========================================================================
+
+constexpr int kMaxLogLines = 50000;
 
 // ===========================================================================
 
@@ -33,7 +43,8 @@ gpp::main_window::main_window(QWidget* parent)
     : m_Layout(new QVBoxLayout(this)),
       m_Form(new QFormLayout(this)),
       m_KeyFinderDialog(new key_finder(this)),
-      m_LogEdit(new QTextEdit(this)),
+      m_CloseRequested(false),
+      m_LogEdit(new QPlainTextEdit(this)),
       m_Log2Gui(log2gui::create()),
       QMainWindow(parent)
 {
@@ -55,9 +66,21 @@ gpp::main_window::main_window(QWidget* parent)
                                          this);
     connect(m_MergeBtn, &QCommandLinkButton::released, this, &main_window::handle_MergeBtnPush);
     m_Layout->addWidget(m_MergeBtn);
+
+    {
+        auto hlayout = new QHBoxLayout();
+        m_ProgressBar = new QProgressBar(this);
+        m_ProgressBar->setTextVisible(true);
+        m_ProgressBar->setFormat(QString());
+        hlayout->addWidget(m_ProgressBar);
+        m_CancelBtn = new QPushButton("Cancel", this);
+        m_CancelBtn->setDisabled(true);
+        connect(m_CancelBtn, &QPushButton::released, this, &main_window::handle_CancelBtnPush);
+        hlayout->addWidget(m_CancelBtn);
+        m_Layout->addLayout(hlayout);
+    }
     m_Layout->addSpacing(20);
 
-    m_LogEdit->setAcceptRichText(true);
     {
         QFont f("Cascadia Code");
         f.setStyleHint(QFont::Monospace);
@@ -66,6 +89,15 @@ gpp::main_window::main_window(QWidget* parent)
     }
     m_LogEdit->setReadOnly(true);
 
+    // Verbose runs can log millions of lines, so only keep the tail around.
+    m_LogEdit->setMaximumBlockCount(kMaxLogLines);
+
+    QMenu* toolsMenu = menuBar()->addMenu("&Tools");
+    m_TraceAction = toolsMenu->addAction("Record &Trace...");
+    m_TraceAction->setCheckable(true);
+    m_TraceAction->setStatusTip("Save how long each step of the next patch or merge takes.");
+    connect(m_TraceAction, &QAction::toggled, this, &main_window::handle_TraceToggled);
+
     clear_log();
     m_Layout->addWidget(m_LogEdit);
 
@@ -79,6 +111,7 @@ gpp::main_window::main_window(QWidget* parent)
     connect(&m_Patcher, &decltype(m_Patcher)::finished, this, &main_window::handle_PatchFinished);
     connect(this, &main_window::on_KeyRequest, m_KeyFinderDialog, &key_finder::handle_KeyRequest);
     connect(m_Log2Gui.get(), &log2gui::append, this, &main_window::handle_LogMsg);
+    connect(this, &main_window::on_Progress, this, &main_window::handle_Progress);
 
     // what the Qt? so crazy...
     auto dummy = new QWidget(this);
@@ -135,10 +168,15 @@ gpp::main_window::~main_window()
 
 void gpp::main_window::closeEvent(QCloseEvent* event)
 {
-    if (m_Patcher.isRunning())
+    // Don't pull the rug out from under the patcher -- ask it to stop, then close once it has.
+    if (m_Patcher.isRunning()) {
+        m_CloseRequested = true;
+        if (m_Progress)
+            m_Progress->cancel();
         event->ignore();
-    else
+    } else {
         QMainWindow::closeEvent(event);
+    }
 }
 
 // ===========================================================================
@@ -185,23 +223,25 @@ IConvertQStr(const QString& path)
 
 class ColorHax
 {
-    QTextEdit* m_Widget;
-    QColor m_OldColor;
+    QPlainTextEdit* m_Widget;
+    QTextCharFormat m_OldFormat;
 
 public:
     ColorHax() = delete;
     ColorHax(const ColorHax&) = delete;
     ColorHax(ColorHax&&) = delete;
 
-    ColorHax(QTextEdit* widget, const QColor& desired)
-        : m_Widget(widget), m_OldColor(widget->textColor())
+    ColorHax(QPlainTextEdit* widget, const QColor& desired)
+        : m_Widget(widget), m_OldFormat(widget->currentCharFormat())
     {
-        m_Widget->setTextColor(desired);
+        QTextCharFormat format = m_OldFormat;
+        format.setForeground(desired);
+        m_Widget->setCurrentCharFormat(format);
     }
 
     ~ColorHax()
     {
-        m_Widget->setTextColor(m_OldColor);
+        m_Widget->setCurrentCharFormat(m_OldFormat);
     }
 };
 
@@ -215,17 +255,28 @@ void gpp::main_window::handle_PatchStart()
     m_DstBtn->setDisabled(true);
     m_PatchBtn->setDisabled(true);
     m_MergeBtn->setDisabled(true);
+    m_CancelBtn->setDisabled(false);
 }
 
 void gpp::main_window::handle_PatchFinished()
 {
     // If there was an error, log it and complain here.
     auto [error, detail] = m_Patcher.result();
+
+    // Anything still batched up belongs above the error.
+    m_Log2Gui->deliver();
+    bool cancelled = m_Progress && m_Progress->is_cancelled();
     if (!error.isEmpty()) {
+        m_LogEdit->moveCursor(QTextCursor::End);
         ColorHax _(m_LogEdit, QColor::fromRgba(qRgb(255, 0, 0)));
         m_LogEdit->insertPlainText(QString("\nFatal Error: %1\n%2\n").arg(error, detail));
-        QMessageBox::critical(this, error, detail, QMessageBox::Ok, QMessageBox::NoButton);
+        if (!cancelled)
+            QMessageBox::critical(this, error, detail, QMessageBox::Ok, QMessageBox::NoButton);
     }
+    m_Progress.reset();
+    m_ProgressBar->reset();
+    m_ProgressBar->setFormat(QString());
+    m_CancelBtn->setDisabled(true);
 
     m_SrcPath->setDisabled(false);
     m_SrcBtn->setDisabled(false);
@@ -233,97 +284,203 @@ void gpp::main_window::handle_PatchFinished()
     m_DstBtn->setDisabled(false);
     m_PatchBtn->setDisabled(false);
     m_MergeBtn->setDisabled(false);
+
+    if (m_CloseRequested)
+        close();
 }
 
 // ===========================================================================
 
 std::tuple<QString, QString> gpp::main_window::patch(const std::filesystem::path& src,
-                                                     const std::filesystem::path& dst)
+                                                     const std::filesystem::path& dst,
+                                                     const std::filesystem::path& tracePath)
 {
+    std::optional<trace::session> session;
+    if (!tracePath.empty())
+        session.emplace(tracePath);
+
     try {
         patcher patcher(src, dst);
-        patcher.set_map_func([this](const plKey& needle, const std::vector<plKey>& haystack) {
+
+        // The same haystack tends to come up over and over, so only index each one once.
+        // That happens here on the worker thread so the dialog can show up right away.
+        auto indices = std::make_shared<key_index_cache>();
+        patcher.set_map_func([this, indices, token = m_Progress](const plKey& needle, const std::vector<plKey>& haystack) {
+            // Nobody is going to answer once the patch has been cancelled.
+            if (token && token->is_cancelled())
+                return plKey();
+
+            auto index = indices->get(haystack);
             QWaitCondition wait;
             QMutex mut;
             mut.lock();
 
             // We must block for the answer from the key request dialog once we dispatch
             // the singal -- otherwise the memory goes away and anarchy rules the earth.
-            key_request req(needle, haystack, &wait);
+            key_request req(needle, std::move(index), &wait);
             emit on_KeyRequest(&req);
             wait.wait(&mut);
             return m_KeyFinderDialog->steal_key();
         });
+        patcher.set_progress(m_Progress);
         patcher.process_collision();
         patcher.process_drawables();
-        patcher.save_damage(src, dst);
+        if (patcher.has_damage())
+            patcher.save_damage(src, dst);
+        else
+            log::warning("Nothing to do, the destination is already up to date.");
+    } catch (const cancelled&) {
+        log::flush();
+        return std::make_tuple("Cancelled", "Nothing was saved.");
     } catch (const error& ex) {
+        log::flush();
         return std::make_tuple("Patch Failed", ex.what());
 #if !defined(_DEBUG) || defined(NDEBUG)
     } catch (const std::exception& ex) {
+        log::flush();
         return std::make_tuple("Unhandled Exception", ex.what());
 #endif
     }
 
+    // Make sure the log reaches the window before the finished signal does.
+    log::flush();
     return std::make_tuple(QString(), QString());
 }
 
 std::tuple<QString, QString> gpp::main_window::merge(const std::filesystem::path& src,
-                                                     const std::filesystem::path& dst)
+                                                     const std::filesystem::path& dst,
+                                                     const std::filesystem::path& tracePath)
 {
+    std::optional<trace::session> session;
+    if (!tracePath.empty())
+        session.emplace(tracePath);
+
     try {
         merger patcher(src, dst);
+        patcher.set_progress(m_Progress);
         patcher.process();
         patcher.save_damage(src, dst);
+    } catch (const cancelled&) {
+        log::flush();
+        return std::make_tuple("Cancelled", "Nothing was saved.");
     } catch (const error& ex) {
+        log::flush();
         return std::make_tuple("Merge Failed", ex.what());
 #if !defined(_DEBUG) || defined(NDEBUG)
     } catch (const std::exception& ex) {
+        log::flush();
         return std::make_tuple("Unhandled Exception", ex.what());
 #endif
     }
 
+    // Make sure the log reaches the window before the finished signal does.
+    log::flush();
     return std::make_tuple(QString(), QString());
 }
 
+void gpp::main_window::reset_progress()
+{
+    // The callback fires on the patcher thread, so bounce it through a queued signal.
+    m_Progress = std::make_shared<progress>();
+    m_Progress->set_callback([this](const progress::status& status) {
+        emit on_Progress(QString::fromUtf8(status.m_Phase.c_str(), status.m_Phase.size()),
+                         status.m_Done, status.m_Total, status.m_Rate);
+    });
+}
+
 void gpp::main_window::handle_ConvertBtnPush()
 {
     clear_log();
+    reset_progress();
 
     auto src = IConvertQStr(m_SrcPath->text());
     auto dst = IConvertQStr(m_DstPath->text());
     // Flip to 0 for debugging
 #if 1 // !defined(_DEBUG) || defined(NDEBUG)
-    auto fut = QtConcurrent::run(this, &main_window::patch, src, dst);
+    auto fut = QtConcurrent::run(this, &main_window::patch, src, dst, take_trace_path());
     m_Patcher.setFuture(fut);
 #else
-    patch(src, dst);
+    patch(src, dst, take_trace_path());
 #endif
 }
 
 void gpp::main_window::handle_MergeBtnPush()
 {
     clear_log();
+    reset_progress();
 
     auto src = IConvertQStr(m_SrcPath->text());
     auto dst = IConvertQStr(m_DstPath->text());
 
     // Flip to 0 for debugging
 #if 1 // !defined(_DEBUG) || defined(NDEBUG)
-    auto fut = QtConcurrent::run(this, &main_window::merge, src, dst);
+    auto fut = QtConcurrent::run(this, &main_window::merge, src, dst, take_trace_path());
     m_Patcher.setFuture(fut);
 #else
-    merge(src, dst);
+    merge(src, dst, take_trace_path());
 #endif
 }
 
+std::filesystem::path gpp::main_window::take_trace_path()
+{
+    std::filesystem::path result = std::move(m_TracePath);
+    m_TracePath.clear();
+    if (!result.empty()) {
+        QSignalBlocker _(m_TraceAction);
+        m_TraceAction->setChecked(false);
+    }
+    return result;
+}
+
+void gpp::main_window::handle_TraceToggled(bool checked)
+{
+    if (!checked) {
+        m_TracePath.clear();
+        return;
+    }
+
+    QString path = QFileDialog::getSaveFileName(this,
+                                                "Save Trace",
+                                                QString(),
+                                                "Chrome trace files (*.json)");
+    if (path.isNull()) {
+        // Nowhere to put it, so don't leave the action looking enabled.
+        QSignalBlocker _(m_TraceAction);
+        m_TraceAction->setChecked(false);
+        return;
+    }
+    m_TracePath = IConvertQStr(path);
+}
+
+void gpp::main_window::handle_CancelBtnPush()
+{
+    if (m_Progress) {
+        m_CancelBtn->setDisabled(true);
+        m_Progress->cancel();
+
+        // The patcher may be blocked waiting for the user to pick a key.
+        m_KeyFinderDialog->cancel_KeyRequest();
+    }
+}
+
+void gpp::main_window::handle_Progress(const QString& phase, qulonglong done, qulonglong total, double rate)
+{
+    // QProgressBar only does ints, so scale everything to per-mille.
+    if (total == 0) {
+        m_ProgressBar->setRange(0, 0);
+    } else {
+        m_ProgressBar->setRange(0, 1000);
+        m_ProgressBar->setValue(static_cast<int>(std::min<qulonglong>(done, total) * 1000 / total));
+    }
+    m_ProgressBar->setFormat(QString("%1: %2/%3 (%4/s)").arg(phase).arg(done).arg(total).arg(rate, 0, 'f', 1));
+}
 
 void gpp::main_window::handle_LogMsg(const QString& msg)
 {
+    // Messages arrive in batches, so this only happens a few times a second.
+    m_LogEdit->moveCursor(QTextCursor::End);
     m_LogEdit->insertPlainText(msg);
-    auto cursor = m_LogEdit->textCursor();
-    cursor.movePosition(QTextCursor::End);
-    m_LogEdit->setTextCursor(cursor);
+    m_LogEdit->ensureCursorVisible();
 }
 
 // ===========================================================================
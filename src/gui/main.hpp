@@ -25,13 +25,15 @@
 #include <memory>
 #include <tuple>
 
+class QAction;
 class QCommandLinkButton;
 class QCompleter;
 class QFileSystemModel;
 class QFormLayout;
 class QLineEdit;
+class QPlainTextEdit;
+class QProgressBar;
 class QPushButton;
-class QTextEdit;
 class QVBoxLayout;
 
 namespace gpp
@@ -39,6 +41,7 @@ namespace gpp
     class key_finder;
     class key_request;
     class log2gui;
+    class progress;
 
     class main_window : public QMainWindow
     {
@@ -64,31 +67,49 @@ namespace gpp
         QFutureWatcher<std::tuple<QString, QString>> m_Patcher;
         key_finder* m_KeyFinderDialog;
 
-        QTextEdit* m_LogEdit;
+        QProgressBar* m_ProgressBar;
+        QPushButton* m_CancelBtn;
+        std::shared_ptr<progress> m_Progress;
+        bool m_CloseRequested;
+
+        QPlainTextEdit* m_LogEdit;
         std::unique_ptr<log2gui> m_Log2Gui;
 
+        QAction* m_TraceAction;
+        std::filesystem::path m_TracePath;
+
     private:
         void create_path_widgets(const QString& label,
                                  QLineEdit*& path, QPushButton*& btn, QSignalMapper*& mapper,
                                  QCompleter*& completer, QFileSystemModel*& model);
         void clear_log();
+        void reset_progress();
+
+        /** The trace requested for the next run. Traces are one-shot, so this clears it. */
+        std::filesystem::path take_trace_path();
 
         std::tuple<QString, QString> patch(const std::filesystem::path& src,
-                                           const std::filesystem::path& dst);
+                                           const std::filesystem::path& dst,
+                                           const std::filesystem::path& tracePath);
         std::tuple<QString, QString> merge(const std::filesystem::path& src,
-                                           const std::filesystem::path& dst);
+                                           const std::filesystem::path& dst,
+                                           const std::filesystem::path& tracePath);
 
     private slots:
         void handle_PathBtn(QWidget* widget);
         void handle_ConvertBtnPush();
         void handle_MergeBtnPush();
+        void handle_TraceToggled(bool checked);
+        void handle_CancelBtnPush();
 
         void handle_PatchStart();
         void handle_PatchFinished();
         void handle_LogMsg(const QString& msg);
+        void handle_Progress(const QString& phase, qulonglong done, qulonglong total, double rate);
 
     signals:
         void on_KeyRequest(key_request*);
+        void on_Progress(const QString& phase, qulonglong done, qulonglong total, double rate);
 
     protected:
         void closeEvent(QCloseEvent* event) override;
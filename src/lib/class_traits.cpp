@@ -0,0 +1,41 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "class_traits.hpp"
+#include "object_index.hpp"
+
+// ===========================================================================
+
+void gpp::object_dispatch::operator ()(const plKey& key)
+{
+    // Stubs don't convert to anything, so deserialize them before they poison the table.
+    hsKeyedObject* obj = object_index::resolve(key);
+    if (!obj)
+        return;
+
+    auto it = m_Table.find(key->getType());
+    if (it == m_Table.end()) {
+        std::vector<size_t> visitors;
+        for (size_t i = 0; i < m_Visitors.size(); ++i) {
+            if (m_Visitors[i].m_Index == key->getType() || m_Visitors[i].m_Accepts(obj))
+                visitors.push_back(i);
+        }
+        it = m_Table.emplace(key->getType(), std::move(visitors)).first;
+    }
+
+    for (size_t i : it->second)
+        m_Visitors[i].m_Func(obj);
+}
@@ -0,0 +1,114 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_CLASS_TRAITS_H
+#define _GPP_CLASS_TRAITS_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include <PRP/KeyedObject/hsKeyedObject.h>
+#include <ResManager/pdUnifiedTypeMap.h>
+
+class hsGMaterial;
+class pfGUIDialogMod;
+class plClusterGroup;
+class plCubicEnvironmap;
+class plDrawableSpans;
+class plDrawInterface;
+class plGenericPhysical;
+class plLayerInterface;
+class plLightInfo;
+class plMipmap;
+class plOccluder;
+class plSceneNode;
+class plSceneObject;
+class plSimulationInterface;
+class plWinAudible;
+
+namespace gpp
+{
+    /**
+     * Maps a Plasma class to its class index at compile time. Only the classes gpp
+     * works with are registered, so using any other class is a compile error.
+     */
+    template<typename T>
+    struct class_traits;
+
+#define GPP_CLASS_TRAITS(type, idx) \
+    template<> \
+    struct class_traits<type> \
+    { \
+        static constexpr uint16_t index = idx; \
+    }
+
+    GPP_CLASS_TRAITS(hsGMaterial, kGMaterial);
+    GPP_CLASS_TRAITS(pfGUIDialogMod, kGUIDialogMod);
+    GPP_CLASS_TRAITS(plClusterGroup, kClusterGroup);
+    GPP_CLASS_TRAITS(plCubicEnvironmap, kCubicEnvironmap);
+    GPP_CLASS_TRAITS(plDrawableSpans, kDrawableSpans);
+    GPP_CLASS_TRAITS(plDrawInterface, kDrawInterface);
+    GPP_CLASS_TRAITS(plGenericPhysical, kGenericPhysical);
+    GPP_CLASS_TRAITS(plLayerInterface, kLayerInterface);
+    GPP_CLASS_TRAITS(plLightInfo, kLightInfo);
+    GPP_CLASS_TRAITS(plMipmap, kMipmap);
+    GPP_CLASS_TRAITS(plOccluder, kOccluder);
+    GPP_CLASS_TRAITS(plSceneNode, kSceneNode);
+    GPP_CLASS_TRAITS(plSceneObject, kSceneObject);
+    GPP_CLASS_TRAITS(plSimulationInterface, kSimulationInterface);
+    GPP_CLASS_TRAITS(plWinAudible, kWinAudible);
+
+#undef GPP_CLASS_TRAITS
+
+    /**
+     * Runs typed visitors over keys, dispatching on the key's class index. Which visitors
+     * accept a class is worked out from the first object of that class and remembered,
+     * so every other key is just a table lookup instead of a Convert() per visitor.
+     */
+    class object_dispatch
+    {
+        struct visitor
+        {
+            uint16_t m_Index;
+            std::function<bool(hsKeyedObject*)> m_Accepts;
+            std::function<void(hsKeyedObject*)> m_Func;
+        };
+
+        std::vector<visitor> m_Visitors;
+        std::map<uint16_t, std::vector<size_t>> m_Table;
+
+    public:
+        /** Adds a visitor for objects of class T or anything derived from it. */
+        template<typename T, typename Pr>
+        object_dispatch& on(Pr func)
+        {
+            m_Visitors.push_back({
+                class_traits<T>::index,
+                [](hsKeyedObject* obj) { return T::Convert(obj, false) != nullptr; },
+                [func = std::move(func)](hsKeyedObject* obj) { func(T::Convert(obj)); }
+            });
+            m_Table.clear();
+            return *this;
+        }
+
+        /** Calls every visitor that accepts the key's object. */
+        void operator ()(const plKey& key);
+    };
+};
+
+#endif
@@ -0,0 +1,356 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "delta.hpp"
+#include "errors.hpp"
+#include "log.hpp"
+#include "mapped_file.hpp"
+#include "object_index.hpp"
+
+#include <cstring>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include <PRP/KeyedObject/hsKeyedObject.h>
+#include <PRP/plCreatable.h>
+#include <ResManager/pdUnifiedTypeMap.h>
+#include <ResManager/plFactory.h>
+#include <ResManager/plResManager.h>
+#include <Stream/hsRAMStream.h>
+#include <Stream/hsStream.h>
+
+// ===========================================================================
+
+namespace
+{
+    constexpr char kDeltaMagic[] = { 'G', 'P', 'P', 'D', 'E', 'L', 'T', 'A' };
+    constexpr uint32_t kDeltaVersion = 1;
+
+    struct record
+    {
+        gpp::delta_op m_Op;
+        plKey m_Key;
+        plLocation m_Location;
+        hsRAMStream m_Data;
+
+        record(gpp::delta_op op, plKey key, plLocation loc, PlasmaVer ver)
+            : m_Op(op), m_Key(std::move(key)), m_Location(std::move(loc)), m_Data(ver)
+        { }
+    };
+
+    struct delta_record
+    {
+        gpp::delta_op m_Op;
+        plLocation m_Location;
+        uint16_t m_Type;
+        ST::string m_Name;
+        std::vector<uint8_t> m_Data;
+    };
+
+    // Safe strings are encoded differently depending on the Plasma version, and we
+    // need to read the page name before we know what that is.
+    void write_string(hsStream* S, const ST::string& str)
+    {
+        S->writeShort(str.size());
+        S->write(str.size(), str.c_str());
+    }
+
+    [[nodiscard]]
+    ST::string read_string(hsStream* S)
+    {
+        ST::char_buffer buf;
+        buf.allocate(S->readShort());
+        S->read(buf.size(), buf.data());
+        return ST::string::from_utf8(buf.data(), buf.size());
+    }
+
+    void write_record(hsStream* S, const record& rec)
+    {
+        S->writeByte((uint8_t)rec.m_Op);
+        rec.m_Location.write(S);
+        S->writeShort(rec.m_Key->getType());
+        write_string(S, rec.m_Key->getName());
+        S->writeInt(rec.m_Data.size());
+        if (rec.m_Data.size() != 0)
+            S->write(rec.m_Data.size(), rec.m_Data.data());
+    }
+
+    [[nodiscard]]
+    plKey find_key(plResManager* mgr, const plLocation& loc, uint16_t type, const ST::string& name)
+    {
+        for (const auto& key : mgr->getKeys(loc, type)) {
+            if (key->getName() == name)
+                return key;
+        }
+        return plKey();
+    }
+
+    /** Attaches a raw serialized object to its key without parsing the object. */
+    void attach_stub(plResManager* mgr, const std::vector<uint8_t>& buf)
+    {
+        if (buf.size() <= sizeof(uint16_t))
+            gpp::error::raise("Truncated object in delta");
+
+        uint16_t fileType = (uint16_t)buf[0] | ((uint16_t)buf[1] << 8);
+        uint16_t type = pdUnifiedTypeMap::PlasmaToMapped(fileType, mgr->getVer());
+        size_t length = buf.size() - sizeof(uint16_t);
+
+        // The object begins with its own Uoid, so use that to find (or create) the key.
+        hsRAMStream S(mgr->getVer());
+        S.copyFrom(buf.data() + sizeof(uint16_t), length);
+        plKey key = mgr->readUoid(&S);
+        if (!key.Exists() || key->getType() != type)
+            gpp::error::raise("Delta object has a bogus key");
+
+        S.rewind();
+        auto* data = new plCreatableStub(type, length);
+        data->read(&S, mgr);
+        auto* stub = new hsKeyedObjectStub();
+        stub->setStub(data);
+        stub->setKey(key);
+
+        hsKeyedObject* obj = key->getObj();
+        key->setObj(nullptr);
+        delete obj;
+        key->setObj(stub);
+    }
+};
+
+// ===========================================================================
+
+size_t gpp::write_delta(const std::filesystem::path& deltaPath, plResManager* mgr,
+                        const object_index& index, const std::set<plKey>& dirty)
+{
+    log::debug("Writing delta to '{}'...", deltaPath);
+
+    std::vector<std::tuple<plPageInfo*, std::vector<std::unique_ptr<record>>>> pages;
+    size_t numRecords = 0;
+    for (const auto& loc : mgr->getLocations()) {
+        plPageInfo* page = mgr->FindPage(loc);
+        if (!page)
+            continue;
+
+        std::vector<std::unique_ptr<record>> records;
+        std::set<plKey> current;
+        std::unique_ptr<mapped_file> view;
+        for (auto type : mgr->getTypes(loc)) {
+            for (const auto& key : mgr->getKeys(loc, type)) {
+                current.insert(key);
+
+                const object_index::entry* myEntry = index.find(key);
+                bool added = !myEntry || myEntry->m_Location != loc;
+                if (!added && dirty.find(key) == dirty.end())
+                    continue;
+                if (!key.isLoaded())
+                    continue;
+
+                auto rec = std::make_unique<record>(added ? delta_op::e_add : delta_op::e_replace,
+                                                    key, loc, mgr->getVer());
+                mgr->WriteCreatable(&rec->m_Data, key->getObj());
+
+                // Something may have poked at the object without actually changing it.
+                if (!added) {
+                    if (!view)
+                        view = std::make_unique<mapped_file>(myEntry->m_File);
+                    if (myEntry->m_Offset + myEntry->m_Size <= view->size() &&
+                        myEntry->m_Size == rec->m_Data.size() &&
+                        memcmp(view->data() + myEntry->m_Offset, rec->m_Data.data(), myEntry->m_Size) == 0)
+                        continue;
+                }
+                records.push_back(std::move(rec));
+            }
+        }
+
+        if (const auto* keyring = index.keyring(loc)) {
+            for (const auto& [type, keys] : *keyring) {
+                for (const auto& key : keys) {
+                    if (current.find(key) == current.end())
+                        records.push_back(std::make_unique<record>(delta_op::e_remove, key, loc, mgr->getVer()));
+                }
+            }
+        }
+
+        numRecords += records.size();
+        pages.emplace_back(page, std::move(records));
+    }
+
+    // Adding or removing keys renumbers a page, so every page that refers to it has to be
+    // rewritten too, even if none of its own objects changed. Those pages go into the delta
+    // without any records so that applying it reencodes them.
+    std::set<plLocation> changedPages = index.changed_pages();
+    size_t numReferrers = 0;
+    for (auto it = pages.begin(); it != pages.end();) {
+        const auto& [page, records] = *it;
+        if (!records.empty()) {
+            ++it;
+        } else if (index.page_refers_to(page->getLocation(), changedPages)) {
+            ++numReferrers;
+            ++it;
+        } else {
+            it = pages.erase(it);
+        }
+    }
+    if (numReferrers != 0)
+        log::debug("  -> Including {} unchanged pages that refer to changed pages", numReferrers);
+
+    hsFileStream S(mgr->getVer());
+    if (!S.open(ST::string::from_path(deltaPath), fmCreate))
+        error::raise("Unable to open '{}' for writing", deltaPath);
+    S.write(sizeof(kDeltaMagic), kDeltaMagic);
+    S.writeInt(kDeltaVersion);
+    S.writeInt(pages.size());
+    for (const auto& [page, records] : pages) {
+        write_string(&S, page->getFilename(mgr->getVer()));
+        page->getLocation().write(&S);
+        S.writeInt(records.size());
+        for (const auto& rec : records)
+            write_record(&S, *rec);
+    }
+
+    log::debug("  -> Wrote {} objects in {} pages ({} bytes)", numRecords, pages.size(), S.size());
+    return numRecords;
+}
+
+// ===========================================================================
+
+size_t gpp::apply_delta(const std::filesystem::path& deltaPath, const std::filesystem::path& dest)
+{
+    log::debug("Applying delta '{}' to '{}'...", deltaPath, dest);
+
+    hsFileStream S;
+    if (!S.open(ST::string::from_path(deltaPath), fmRead))
+        error::raise("Unable to open '{}' for reading", deltaPath);
+
+    char magic[sizeof(kDeltaMagic)];
+    S.read(sizeof(magic), magic);
+    if (memcmp(magic, kDeltaMagic, sizeof(magic)) != 0)
+        error::raise("'{}' is not a GPP delta", deltaPath);
+    uint32_t version = S.readInt();
+    if (version != kDeltaVersion)
+        error::raise("'{}' is an unsupported delta version ({})", deltaPath, version);
+
+    // The destination may be either one PRP or an entire Age. Either way, the pages
+    // named in the delta are siblings of it.
+    std::filesystem::path wd = dest.parent_path();
+    bool singlePage = ST::string::from_path(dest.extension()).compare_i(".prp") == 0;
+
+    // Stub mode: objects only need to be understood if the object IDs they were encoded
+    // with are going to change. All of the pages go into one registry so that references
+    // between them can be resolved when that happens.
+    plResManager mgr;
+    object_index index(&mgr, load_mode::e_lazy);
+    std::vector<std::tuple<plPageInfo*, std::filesystem::path, std::vector<delta_record>>> pages;
+    uint32_t numPages = S.readInt();
+    for (uint32_t i = 0; i < numPages; ++i) {
+        ST::string pageFn = read_string(&S);
+        std::filesystem::path pagePath = wd / pageFn.to_path();
+        if (singlePage && pagePath.filename() != dest.filename())
+            error::raise("Delta contains '{}', which is not '{}'", pageFn, dest.filename());
+        if (!std::filesystem::is_regular_file(pagePath))
+            error::raise("Delta page '{}' does not exist", pagePath);
+
+        plPageInfo* page = mgr.ReadPage(ST::string::from_path(pagePath), true);
+        index.add_page(page->getLocation(), pagePath);
+        S.setVer(mgr.getVer());
+
+        plLocation loc;
+        loc.read(&S);
+        if (loc != page->getLocation())
+            error::raise("Delta location for '{}' does not match the page on disk", pageFn);
+
+        std::vector<delta_record> records(S.readInt());
+        for (auto& rec : records) {
+            rec.m_Op = (delta_op)S.readByte();
+            rec.m_Location.read(&S);
+            rec.m_Type = S.readShort();
+            rec.m_Name = read_string(&S);
+            rec.m_Data.resize(S.readInt());
+            if (!rec.m_Data.empty())
+                S.read(rec.m_Data.size(), rec.m_Data.data());
+        }
+        pages.emplace_back(page, std::move(pagePath), std::move(records));
+    }
+
+    size_t numApplied = 0;
+    for (const auto& [page, pagePath, records] : pages) {
+        ST::string pageFn = ST::string::from_path(pagePath.filename());
+        for (const auto& rec : records) {
+            switch (rec.m_Op) {
+            case delta_op::e_remove:
+            {
+                plKey key = find_key(&mgr, rec.m_Location, rec.m_Type, rec.m_Name);
+                if (!key.Exists())
+                    error::raise("Delta removes [{}] '{}', which is not in '{}'",
+                                 plFactory::ClassName(rec.m_Type), rec.m_Name, pageFn);
+                mgr.DelObject(key);
+            }
+            break;
+            case delta_op::e_replace:
+                if (!find_key(&mgr, rec.m_Location, rec.m_Type, rec.m_Name).Exists())
+                    error::raise("Delta replaces [{}] '{}', which is not in '{}'",
+                                 plFactory::ClassName(rec.m_Type), rec.m_Name, pageFn);
+                attach_stub(&mgr, rec.m_Data);
+                break;
+            case delta_op::e_add:
+                attach_stub(&mgr, rec.m_Data);
+                break;
+            default:
+                error::raise("Bad delta operation {}", (int)rec.m_Op);
+                break;
+            }
+            ++numApplied;
+        }
+    }
+
+    // Adding or removing keys renumbers the page, which invalidates the uoids in every stub
+    // on it or pointing into it -- including the ones that came from the delta itself.
+    std::set<plLocation> changedPages = index.changed_pages();
+    size_t numStale = index.materialize_stale(changedPages);
+    log::debug("  -> Reencoding {} objects in or referring to {} changed pages",
+                   numStale, changedPages.size());
+
+    // The delta only carries the pages that refer to the ones it changes. If libHSPlasma
+    // renumbers any other page while writing, pages that aren't in the delta would be left
+    // with stale references, so encode everything before touching the disk.
+    std::vector<std::unique_ptr<hsRAMStream>> streams;
+    for (const auto& [page, pagePath, records] : pages) {
+        auto pageStream = std::make_unique<hsRAMStream>(mgr.getVer());
+        mgr.WritePage(pageStream.get(), page);
+        if (index.revert_passthrough(page->getLocation())) {
+            pageStream = std::make_unique<hsRAMStream>(mgr.getVer());
+            mgr.WritePage(pageStream.get(), page);
+        }
+        streams.push_back(std::move(pageStream));
+    }
+    for (const auto& loc : index.changed_pages()) {
+        if (changedPages.find(loc) == changedPages.end())
+            error::raise("Writing '{}' changed its object IDs, so pages outside the delta would refer to "
+                         "the wrong objects. Save the whole Age instead of a delta.",
+                         mgr.FindPage(loc)->getFilename(mgr.getVer()));
+    }
+
+    for (size_t i = 0; i < pages.size(); ++i) {
+        const auto& [page, pagePath, records] = pages[i];
+        log::debug("  -> Writing '{}' ({} objects)", pagePath, records.size());
+        hsFileStream file(mgr.getVer());
+        if (!file.open(ST::string::from_path(pagePath), fmCreate))
+            error::raise("Unable to open '{}' for writing", pagePath);
+        file.write(streams[i]->size(), streams[i]->data());
+    }
+
+    return numApplied;
+}
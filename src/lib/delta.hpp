@@ -0,0 +1,55 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_DELTA_H
+#define _GPP_DELTA_H
+
+#include <cstdint>
+#include <filesystem>
+#include <set>
+
+#include <ResManager/plResManager.h>
+
+namespace gpp
+{
+    class object_index;
+
+    enum class delta_op : uint8_t
+    {
+        e_add = 0,
+        e_remove = 1,
+        e_replace = 2,
+    };
+
+    /**
+     * Writes every object that was added, removed, or changed in the registry since its
+     * pages were read from disk. Pages that refer to a page whose keys were added or removed
+     * are included as well, so that applying the delta rewrites their references.
+     * \returns The number of objects recorded in the delta.
+     */
+    size_t write_delta(const std::filesystem::path& deltaPath, plResManager* mgr,
+                       const object_index& index, const std::set<plKey>& dirty);
+
+    /**
+     * Applies a delta to the pages of an existing Age or PRP.
+     * Only the pages named in the delta are read, and their objects are only parsed if
+     * the delta adds or removes keys that they refer to.
+     * \returns The number of objects applied.
+     */
+    size_t apply_delta(const std::filesystem::path& deltaPath, const std::filesystem::path& dest);
+};
+
+#endif
@@ -0,0 +1,246 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "events.hpp"
+#include "errors.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+#include <string_theory/format>
+
+#include <PRP/KeyedObject/plKey.h>
+#include <ResManager/plFactory.h>
+
+// ===========================================================================
+
+namespace
+{
+    constexpr size_t kBufferSize = 1024 * 1024;
+
+    /**
+     * Records are serialized straight into one preallocated buffer instead of being built
+     * up as JSON objects, and the buffer only goes to disk when it fills up.
+     */
+    class event_stream
+    {
+        std::ofstream m_Stream;
+        std::unique_ptr<char[]> m_Buffer;
+        size_t m_Used;
+        uint64_t m_Sequence;
+        std::chrono::steady_clock::time_point m_Epoch;
+
+        void append(const char* str, size_t size)
+        {
+            if (m_Used + size > kBufferSize)
+                flush();
+            if (size > kBufferSize) {
+                m_Stream.write(str, size);
+                return;
+            }
+            std::memcpy(m_Buffer.get() + m_Used, str, size);
+            m_Used += size;
+        }
+
+        void append_char(char ch)
+        {
+            if (m_Used == kBufferSize)
+                flush();
+            m_Buffer[m_Used++] = ch;
+        }
+
+        void append_uint(uint64_t value)
+        {
+            char digits[20];
+            size_t count = 0;
+            do {
+                digits[count++] = '0' + (value % 10);
+                value /= 10;
+            } while (value != 0);
+            while (count != 0)
+                append_char(digits[--count]);
+        }
+
+        void append_string(const char* str, size_t size)
+        {
+            append_char('"');
+            for (size_t i = 0; i < size; ++i) {
+                char ch = str[i];
+                if (ch == '"' || ch == '\\') {
+                    append_char('\\');
+                    append_char(ch);
+                } else if ((unsigned char)ch < 0x20) {
+                    static const char kHex[] = "0123456789abcdef";
+                    append("\\u00", 4);
+                    append_char(kHex[(ch >> 4) & 0xF]);
+                    append_char(kHex[ch & 0xF]);
+                } else {
+                    append_char(ch);
+                }
+            }
+            append_char('"');
+        }
+
+        void append_string(const char* str) { append_string(str, std::strlen(str)); }
+        void append_string(const ST::string& str) { append_string(str.c_str(), str.size()); }
+
+    public:
+        event_stream(const std::filesystem::path& path)
+            : m_Stream(path, std::ios::out | std::ios::binary | std::ios::trunc),
+              m_Buffer(new char[kBufferSize]), m_Used(), m_Sequence(),
+              m_Epoch(std::chrono::steady_clock::now())
+        {
+            if (!m_Stream)
+                gpp::error::raise("Unable to open '{}' for writing", path);
+        }
+
+        event_stream(const event_stream&) = delete;
+        event_stream(event_stream&&) = delete;
+
+        ~event_stream() { flush(); }
+
+        void flush()
+        {
+            m_Stream.write(m_Buffer.get(), m_Used);
+            m_Stream.flush();
+            m_Used = 0;
+        }
+
+        void begin(const char* event)
+        {
+            auto elapsed = std::chrono::steady_clock::now() - m_Epoch;
+            append("{\"seq\":", 7);
+            append_uint(m_Sequence++);
+            append(",\"time\":", 8);
+            append_uint(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+            append(",\"event\":", 9);
+            append_string(event);
+        }
+
+        template<typename _ValueT>
+        void field(const char* name, const _ValueT& value)
+        {
+            append_char(',');
+            append_string(name);
+            append_char(':');
+            append_string(value);
+        }
+
+        void field(const char* name, uint64_t value)
+        {
+            append_char(',');
+            append_string(name);
+            append_char(':');
+            append_uint(value);
+        }
+
+        void field(const char* name, bool value)
+        {
+            append_char(',');
+            append_string(name);
+            if (value)
+                append(":true", 5);
+            else
+                append(":false", 6);
+        }
+
+        void key(const char* name, const plKey& key)
+        {
+            append_char(',');
+            append_string(name);
+            if (!key.Exists()) {
+                append(":null", 5);
+                return;
+            }
+            append(":{\"name\":", 9);
+            append_string(key->getName());
+            append(",\"class\":", 9);
+            append_string(plFactory::ClassName(key->getType()));
+            append(",\"location\":", 12);
+            append_string(key->getLocation().toString());
+            append_char('}');
+        }
+
+        void end()
+        {
+            append("}\n", 2);
+        }
+    };
+
+    std::mutex s_Lock;
+    std::unique_ptr<event_stream> s_Stream;
+};
+
+std::atomic<bool> gpp::events::detail::s_Enabled = false;
+
+// ===========================================================================
+
+void gpp::events::open(const std::filesystem::path& path)
+{
+    auto stream = std::make_unique<event_stream>(path);
+
+    std::lock_guard<std::mutex> lock(s_Lock);
+    s_Stream = std::move(stream);
+    detail::s_Enabled = true;
+}
+
+void gpp::events::close()
+{
+    std::lock_guard<std::mutex> lock(s_Lock);
+    detail::s_Enabled = false;
+    s_Stream.reset();
+}
+
+// ===========================================================================
+
+void gpp::events::object(const char* event, const plKey& source, const plKey& destination)
+{
+    if (!enabled())
+        return;
+
+    std::lock_guard<std::mutex> lock(s_Lock);
+    if (!s_Stream)
+        return;
+    s_Stream->begin(event);
+    s_Stream->key("source", source);
+    s_Stream->key("destination", destination);
+    s_Stream->end();
+}
+
+void gpp::events::remap(const plKey& source, const plKey& destination)
+{
+    object("remap", source, destination);
+}
+
+void gpp::events::page_saved(const ST::string& page, const std::filesystem::path& path,
+                             bool written, size_t size)
+{
+    if (!enabled())
+        return;
+
+    std::lock_guard<std::mutex> lock(s_Lock);
+    if (!s_Stream)
+        return;
+    s_Stream->begin("save_page");
+    s_Stream->field("page", page);
+    s_Stream->field("path", ST::string::from_path(path));
+    s_Stream->field("written", written);
+    s_Stream->field("size", (uint64_t)size);
+    s_Stream->end();
+}
@@ -0,0 +1,62 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_EVENTS_H
+#define _GPP_EVENTS_H
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+
+#include <string_theory/string>
+
+class plKey;
+
+namespace gpp
+{
+    /**
+     * Machine readable record of what a run did, written as one JSON object per line.
+     * Every record has "seq", "time" (microseconds since the stream was opened) and
+     * "event" fields, followed by event specific fields.
+     */
+    namespace events
+    {
+        namespace detail
+        {
+            extern std::atomic<bool> s_Enabled;
+        };
+
+        /** Starts writing events to a file, replacing anything that is already there. */
+        void open(const std::filesystem::path& path);
+
+        /** Writes out anything that is still buffered and stops recording. */
+        void close();
+
+        [[nodiscard]]
+        inline bool enabled() { return detail::s_Enabled.load(std::memory_order_relaxed); }
+
+        /** Something happened to an object, eg "delete_physical" or "replace_spans". */
+        void object(const char* event, const plKey& source, const plKey& destination);
+
+        /** A source key was mapped to a differently named destination key. */
+        void remap(const plKey& source, const plKey& destination);
+
+        void page_saved(const ST::string& page, const std::filesystem::path& path,
+                        bool written, size_t size);
+    };
+};
+
+#endif
@@ -0,0 +1,395 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fingerprint.hpp"
+#include "errors.hpp"
+#include "log.hpp"
+#include "object_index.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <string_theory/format>
+#include <string_theory/iostream>
+
+#include <PRP/Geometry/plDrawableSpans.h>
+#include <PRP/Geometry/plGBufferGroup.h>
+#include <PRP/Geometry/plIcicle.h>
+#include <PRP/Object/plDrawInterface.h>
+#include <PRP/Object/plSceneObject.h>
+#include <PRP/Object/plSimulationInterface.h>
+#include <PRP/Physics/plGenericPhysical.h>
+#include <PRP/Surface/plCubicEnvironmap.h>
+#include <PRP/Surface/plMipmap.h>
+#include <ResManager/plFactory.h>
+#include <ResManager/plResManager.h>
+#include <Stream/hsRAMStream.h>
+
+// ===========================================================================
+
+namespace
+{
+    void hash_creatable(gpp::hasher& hash, plResManager* mgr, const plKey& key)
+    {
+        if (!key.isLoaded()) {
+            hash.update(0);
+            return;
+        }
+
+        hsRAMStream S(mgr->getVer());
+        mgr->WriteCreatable(&S, gpp::object_index::resolve(key));
+        hash.update(S.data(), S.size());
+    }
+
+    void hash_icicle(gpp::hasher& hash, const plDrawableSpans* dspan, const plIcicle* span)
+    {
+        // Transforms, bounds, flags, etc.
+        hsRAMStream S;
+        const_cast<plIcicle*>(span)->write(&S);
+        hash.update(S.data(), S.size());
+
+        const plKey& material = dspan->getMaterials().at(span->getMaterialIdx());
+        hash.update(material.Exists() ? material->getName() : ST::string());
+
+        const plGBufferGroup* group = dspan->getBuffer(span->getGroupIdx());
+        size_t stride = group->getStride();
+        hash.update(group->getVertBufferStorage(span->getVBufferIdx()) + (span->getVStartIdx() * stride),
+                    span->getVLength() * stride);
+        hash.update(group->getIdxBufferStorage(span->getIBufferIdx()) + span->getIStartIdx(),
+                    span->getILength() * sizeof(unsigned short));
+    }
+
+    void hash_key_name(gpp::hasher& hash, const plKey& key)
+    {
+        hash.update(key.Exists() ? key->getName() : ST::string());
+    }
+
+    void hash_vector(gpp::hasher& hash, const hsVector3& vec)
+    {
+        hash.update(vec.X);
+        hash.update(vec.Y);
+        hash.update(vec.Z);
+    }
+
+    void hash_icicle_contents(gpp::hasher& hash, const plDrawableSpans* dspan, const plIcicle* span)
+    {
+        // The transforms and bounds are only ever copied as a whole, so their serialized
+        // form is good enough to compare.
+        hsRAMStream S;
+        hsMatrix44 localToWorld = span->getLocalToWorld();
+        hsMatrix44 worldToLocal = span->getWorldToLocal();
+        hsBounds3Ext localBounds = span->getLocalBounds();
+        hsBounds3Ext worldBounds = span->getWorldBounds();
+        localToWorld.write(&S);
+        worldToLocal.write(&S);
+        localBounds.write(&S);
+        worldBounds.write(&S);
+        hash.update(S.data(), S.size());
+
+        hash.update(span->getProps());
+        hash.update(span->getNumMatrices());
+        hash.update(span->getBaseMatrix());
+        hash.update(span->getLocalUVWChans());
+        hash.update(span->getMaxBoneIdx());
+        hash.update(span->getPenBoneIdx());
+        hash.update(span->getMinDist());
+        hash.update(span->getMaxDist());
+        hash.update(span->getWaterHeight());
+
+        hash_key_name(hash, dspan->getMaterials().at(span->getMaterialIdx()));
+        hash_key_name(hash, span->getFogEnvironment());
+        for (const auto& light : span->getPermaLights())
+            hash_key_name(hash, light);
+        for (const auto& light : span->getPermaProjs())
+            hash_key_name(hash, light);
+
+        const plGBufferGroup* group = dspan->getBuffer(span->getGroupIdx());
+        size_t stride = group->getStride();
+        hash.update(group->getFormat());
+        hash.update(group->getVertBufferStorage(span->getVBufferIdx()) + (span->getVStartIdx() * stride),
+                    span->getVLength() * stride);
+
+        // Indices point into the whole vertex buffer, so make them relative to the span.
+        const unsigned short* indices = group->getIdxBufferStorage(span->getIBufferIdx()) + span->getIStartIdx();
+        for (size_t i = 0; i < span->getILength(); ++i)
+            hash.update((unsigned short)(indices[i] - span->getVStartIdx()));
+    }
+
+    void hash_mipmap(gpp::hasher& hash, const plMipmap* mipmap)
+    {
+        hash.update(mipmap->getBPP());
+        hash.update(mipmap->getSpace());
+        hash.update(mipmap->getFlags());
+        hash.update(mipmap->getCompressionType());
+        hash.update(mipmap->getDXCompression());
+        hash.update(mipmap->getDXBlockSize());
+        hash.update(mipmap->getARGBType());
+        hash.update(mipmap->getWidth());
+        hash.update(mipmap->getHeight());
+        hash.update(mipmap->getNumLevels());
+        hash.update(mipmap->getImageData(), mipmap->getTotalSize());
+    }
+
+    bool same_mipmap(const plMipmap* lhs, const plMipmap* rhs)
+    {
+        return lhs->getBPP() == rhs->getBPP() &&
+               lhs->getSpace() == rhs->getSpace() &&
+               lhs->getFlags() == rhs->getFlags() &&
+               lhs->getCompressionType() == rhs->getCompressionType() &&
+               lhs->getDXCompression() == rhs->getDXCompression() &&
+               lhs->getDXBlockSize() == rhs->getDXBlockSize() &&
+               lhs->getARGBType() == rhs->getARGBType() &&
+               lhs->getWidth() == rhs->getWidth() &&
+               lhs->getHeight() == rhs->getHeight() &&
+               lhs->getNumLevels() == rhs->getNumLevels() &&
+               lhs->getTotalSize() == rhs->getTotalSize() &&
+               memcmp(lhs->getImageData(), rhs->getImageData(), lhs->getTotalSize()) == 0;
+    }
+};
+
+// ===========================================================================
+
+gpp::hash_t gpp::fingerprint_drawable(const plDrawInterface* diface)
+{
+    hasher hash;
+    for (size_t i = 0; i < diface->getNumDrawables(); ++i) {
+        const plDrawableSpans* dspan = plDrawableSpans::Convert(object_index::resolve(diface->getDrawable(i)), false);
+        int dii = diface->getDrawableKey(i);
+        if (!dspan) {
+            hash.update(dii);
+            continue;
+        }
+
+        hash.update(dspan->getRenderLevel());
+        hash.update(dspan->getCriteria());
+        hash.update(dspan->getProps());
+        hash.update(dii);
+
+        // Particle systems don't have any DISpans.
+        if (dii == -1)
+            continue;
+
+        const auto& diindex = dspan->getDIIndex(dii);
+        hash.update(diindex.fFlags);
+        for (auto spanIdx : diindex.fIndices) {
+            if (diindex.fFlags & plDISpanIndex::kMatrixOnly) {
+                hash.update(spanIdx);
+                continue;
+            }
+
+            const plIcicle* span = static_cast<const plIcicle*>(dspan->getSpan(spanIdx));
+            hash_icicle(hash, dspan, span);
+        }
+    }
+    return hash.digest();
+}
+
+gpp::hash_t gpp::fingerprint_geometry(const plDrawInterface* diface)
+{
+    hasher hash;
+    hash.update(diface->getNumDrawables());
+    for (size_t i = 0; i < diface->getNumDrawables(); ++i) {
+        const plDrawableSpans* dspan = plDrawableSpans::Convert(object_index::resolve(diface->getDrawable(i)), false);
+        if (!dspan)
+            return 0;
+
+        int dii = diface->getDrawableKey(i);
+        hash.update(dspan->getRenderLevel());
+        hash.update(dspan->getCriteria());
+        hash.update(dspan->getProps());
+        hash.update(dii == -1);
+
+        // Particle systems don't have any DISpans.
+        if (dii == -1)
+            continue;
+
+        const auto& diindex = dspan->getDIIndex(dii);
+        if (diindex.fFlags & plDISpanIndex::kMatrixOnly)
+            return 0;
+        hash.update(diindex.fFlags);
+        hash.update(diindex.fIndices.size());
+        for (auto spanIdx : diindex.fIndices)
+            hash_icicle_contents(hash, dspan, static_cast<const plIcicle*>(dspan->getSpan(spanIdx)));
+    }
+    return hash.digest();
+}
+
+gpp::hash_t gpp::fingerprint_physical(const plGenericPhysical* phys)
+{
+    hasher hash;
+    hash.update(phys->getMass());
+    hash.update(phys->getMemberGroup());
+    hash.update(phys->getCollideGroup());
+    hash.update(phys->getBoundsType());
+    hash_vector(hash, phys->getDimensions());
+    hash_vector(hash, phys->getOffset());
+    hash.update(phys->getRadius());
+    hash.update(phys->getLength());
+
+    const auto& indices = phys->getIndices();
+    hash.update(indices.size());
+    hash.update(indices.data(), indices.size() * sizeof(indices[0]));
+
+    const auto& verts = phys->getVerts();
+    hash.update(verts.size());
+    for (const auto& vert : verts)
+        hash_vector(hash, vert);
+    return hash.digest();
+}
+
+gpp::hash_t gpp::fingerprint_scene_object(plResManager* mgr, const plSceneObject* so)
+{
+    hasher hash;
+    hash_creatable(hash, mgr, so->getKey());
+
+    if (so->getSimInterface().isLoaded()) {
+        auto simIface = plSimulationInterface::Convert(object_index::resolve(so->getSimInterface()));
+        hash_creatable(hash, mgr, so->getSimInterface());
+        hash_creatable(hash, mgr, simIface->getPhysical());
+    }
+
+    if (so->getDrawInterface().isLoaded()) {
+        auto diface = plDrawInterface::Convert(object_index::resolve(so->getDrawInterface()));
+        hash_creatable(hash, mgr, so->getDrawInterface());
+        hash.update(fingerprint_drawable(diface));
+    }
+
+    return hash.digest();
+}
+
+// ===========================================================================
+
+ST::string gpp::fingerprint_cache::make_name(const plKey& key)
+{
+    return ST::format("{}:{}:{}", key->getLocation().toString(), key->getType(), key->getName());
+}
+
+std::filesystem::path gpp::fingerprint_cache::default_path(const std::filesystem::path& dest)
+{
+    std::filesystem::path result = dest;
+    result += ".gpphash";
+    return result;
+}
+
+void gpp::fingerprint_cache::load(const std::filesystem::path& path)
+{
+    m_Previous.clear();
+    if (!std::filesystem::is_regular_file(path)) {
+        log::debug("  -> No fingerprints from a previous run at '{}'", path);
+        return;
+    }
+
+    // One object per line: hash, then the name from make_name(), which may contain spaces.
+    std::ifstream stream(path);
+    std::string line;
+    while (std::getline(stream, line)) {
+        // A cache that was cut short or scribbled on can't be trusted, but it's only an
+        // optimization, so just start over instead of failing the run.
+        size_t sep = line.find(' ');
+        size_t end = 0;
+        hash_t hash = 0;
+        try {
+            if (sep != std::string::npos)
+                hash = std::stoull(line.substr(0, sep), &end, 16);
+        } catch (const std::logic_error&) {
+            end = 0;
+        }
+        if (sep == std::string::npos || end != sep) {
+            log::warning("  -> Fingerprint cache '{}' is corrupt, discarding it", path);
+            m_Previous.clear();
+            return;
+        }
+        m_Previous[ST::string::from_std_string(line.substr(sep + 1))] = hash;
+    }
+    log::debug("  -> Loaded {} fingerprints from '{}'", m_Previous.size(), path);
+}
+
+void gpp::fingerprint_cache::save(const std::filesystem::path& path) const
+{
+    std::ofstream stream(path, std::ios::out | std::ios::trunc);
+    if (!stream)
+        error::raise("Unable to open '{}' for writing", path);
+
+    // Objects we didn't look at this time around keep their old fingerprints.
+    std::map<ST::string, hash_t> merged = m_Previous;
+    for (const auto& [name, hash] : m_Current)
+        merged[name] = hash;
+    for (const auto& [name, hash] : merged)
+        stream << ST::format("{016X}", hash) << ' ' << name << '\n';
+}
+
+bool gpp::fingerprint_cache::matches(const plKey& key, hash_t hash) const
+{
+    auto it = m_Previous.find(make_name(key));
+    return it != m_Previous.end() && it->second == hash;
+}
+
+void gpp::fingerprint_cache::record(const plKey& key, hash_t hash)
+{
+    m_Current[make_name(key)] = hash;
+}
+
+// ===========================================================================
+
+gpp::hash_t gpp::fingerprint_texture(const plBitmap* texture)
+{
+    hasher hash;
+    hash.update(const_cast<plBitmap*>(texture)->ClassIndex());
+    if (auto cubemap = plCubicEnvironmap::Convert(const_cast<plBitmap*>(texture), false)) {
+        for (size_t i = 0; i < plCubicEnvironmap::kNumFaces; ++i)
+            hash_mipmap(hash, cubemap->getFace(i));
+    } else if (auto mipmap = plMipmap::Convert(const_cast<plBitmap*>(texture), false)) {
+        hash_mipmap(hash, mipmap);
+    } else {
+        error::raise("Don't know how to fingerprint a [{}]",
+                     plFactory::ClassName(const_cast<plBitmap*>(texture)->ClassIndex()));
+    }
+    return hash.digest();
+}
+
+bool gpp::same_texture(const plBitmap* lhs, const plBitmap* rhs)
+{
+    auto* myLhs = const_cast<plBitmap*>(lhs);
+    auto* myRhs = const_cast<plBitmap*>(rhs);
+    if (myLhs->ClassIndex() != myRhs->ClassIndex())
+        return false;
+
+    if (auto lhsCubemap = plCubicEnvironmap::Convert(myLhs, false)) {
+        auto rhsCubemap = plCubicEnvironmap::Convert(myRhs);
+        for (size_t i = 0; i < plCubicEnvironmap::kNumFaces; ++i) {
+            if (!same_mipmap(lhsCubemap->getFace(i), rhsCubemap->getFace(i)))
+                return false;
+        }
+        return true;
+    } else if (auto lhsMipmap = plMipmap::Convert(myLhs, false)) {
+        return same_mipmap(lhsMipmap, plMipmap::Convert(myRhs));
+    }
+    return false;
+}
+
+size_t gpp::texture_payload_size(const plBitmap* texture)
+{
+    if (auto cubemap = plCubicEnvironmap::Convert(const_cast<plBitmap*>(texture), false)) {
+        size_t size = 0;
+        for (size_t i = 0; i < plCubicEnvironmap::kNumFaces; ++i)
+            size += cubemap->getFace(i)->getTotalSize();
+        return size;
+    } else if (auto mipmap = plMipmap::Convert(const_cast<plBitmap*>(texture), false)) {
+        return mipmap->getTotalSize();
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_FINGERPRINT_H
+#define _GPP_FINGERPRINT_H
+
+#include "hash.hpp"
+
+#include <filesystem>
+#include <map>
+
+#include <ResManager/plResManager.h>
+
+class plBitmap;
+class plDrawInterface;
+class plGenericPhysical;
+class plSceneObject;
+
+namespace gpp
+{
+    /**
+     * Hashes a SceneObject along with its collision and the geometry it draws. This is
+     * everything that the patcher would copy out of the object.
+     */
+    [[nodiscard]]
+    hash_t fingerprint_scene_object(plResManager* mgr, const plSceneObject* so);
+
+    /** Hashes the geometry and material names used by a DrawInterface. */
+    [[nodiscard]]
+    hash_t fingerprint_drawable(const plDrawInterface* diface);
+
+    /**
+     * Like fingerprint_drawable(), but leaves out where the geometry lives in its DSpans,
+     * so a source and destination object can be compared with each other.
+     * \returns Zero if the drawable has bone animated spans or is missing a DSpan,
+     *          which can't be compared.
+     */
+    [[nodiscard]]
+    hash_t fingerprint_geometry(const plDrawInterface* diface);
+
+    /** Hashes everything the patcher copies from one physical to another. */
+    [[nodiscard]]
+    hash_t fingerprint_physical(const plGenericPhysical* phys);
+
+    /**
+     * Hashes a texture's format, dimensions, and every mip level, ignoring its name, so
+     * identical textures hash the same no matter where they came from.
+     */
+    [[nodiscard]]
+    hash_t fingerprint_texture(const plBitmap* texture);
+
+    /** Compares everything fingerprint_texture() hashes, byte for byte. */
+    [[nodiscard]]
+    bool same_texture(const plBitmap* lhs, const plBitmap* rhs);
+
+    /** The size of the texture's image data, including all faces and mip levels. */
+    [[nodiscard]]
+    size_t texture_payload_size(const plBitmap* texture);
+
+    /**
+     * Per-object fingerprints of the source registry from a previous patch run.
+     */
+    class fingerprint_cache
+    {
+        std::map<ST::string, hash_t> m_Previous;
+        std::map<ST::string, hash_t> m_Current;
+
+    private:
+        [[nodiscard]]
+        static ST::string make_name(const plKey& key);
+
+    public:
+        fingerprint_cache() = default;
+        fingerprint_cache(const fingerprint_cache&) = delete;
+        fingerprint_cache(fingerprint_cache&&) = default;
+        ~fingerprint_cache() = default;
+
+    public:
+        void load(const std::filesystem::path& path);
+        void save(const std::filesystem::path& path) const;
+
+        /** Checks if an object had the same fingerprint at the end of the previous run. */
+        [[nodiscard]]
+        bool matches(const plKey& key, hash_t hash) const;
+
+        /** Records the fingerprint of an object once the run has finished with it. */
+        void record(const plKey& key, hash_t hash);
+
+        /** Path of the fingerprint cache that accompanies a patch destination. */
+        [[nodiscard]]
+        static std::filesystem::path default_path(const std::filesystem::path& dest);
+    };
+};
+
+#endif
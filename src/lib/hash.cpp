@@ -0,0 +1,68 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hash.hpp"
+#include "errors.hpp"
+#include "mapped_file.hpp"
+
+#include <string_theory/string>
+#include <xxhash.h>
+
+// ===========================================================================
+
+gpp::hash_t gpp::hash_buffer(const void* buf, size_t size)
+{
+    return XXH3_64bits(buf, size);
+}
+
+gpp::hash_t gpp::hash_file(const std::filesystem::path& path)
+{
+    mapped_file view(path);
+    return hash_buffer(view.data(), view.size());
+}
+
+// ===========================================================================
+
+gpp::hasher::hasher()
+    : m_State(XXH3_createState())
+{
+    if (!m_State)
+        error::raise("Unable to allocate hash state");
+    XXH3_64bits_reset(static_cast<XXH3_state_t*>(m_State));
+}
+
+gpp::hasher::~hasher()
+{
+    XXH3_freeState(static_cast<XXH3_state_t*>(m_State));
+}
+
+gpp::hasher& gpp::hasher::update(const void* buf, size_t size)
+{
+    XXH3_64bits_update(static_cast<XXH3_state_t*>(m_State), buf, size);
+    return *this;
+}
+
+gpp::hasher& gpp::hasher::update(const ST::string& str)
+{
+    // Include the size so that adjacent strings can't alias each other.
+    update(str.size());
+    return update(str.c_str(), str.size());
+}
+
+gpp::hash_t gpp::hasher::digest() const
+{
+    return XXH3_64bits_digest(static_cast<XXH3_state_t*>(m_State));
+}
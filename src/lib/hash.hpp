@@ -0,0 +1,71 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_HASH_H
+#define _GPP_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <type_traits>
+
+namespace ST
+{
+    class string;
+};
+
+namespace gpp
+{
+    using hash_t = uint64_t;
+
+    /** Fast, non-cryptographic hash of a buffer. */
+    [[nodiscard]]
+    hash_t hash_buffer(const void* buf, size_t size);
+
+    /** Hashes the entire contents of a file. */
+    [[nodiscard]]
+    hash_t hash_file(const std::filesystem::path& path);
+
+    /**
+     * Incremental version of hash_buffer() for when the data isn't contiguous.
+     */
+    class hasher
+    {
+        void* m_State;
+
+    public:
+        hasher();
+        hasher(const hasher&) = delete;
+        hasher(hasher&&) = delete;
+        ~hasher();
+
+    public:
+        hasher& update(const void* buf, size_t size);
+        hasher& update(const ST::string& str);
+
+        template<typename T>
+        std::enable_if_t<std::is_arithmetic_v<T> || std::is_enum_v<T>, hasher&>
+        update(T value)
+        {
+            return update(&value, sizeof(value));
+        }
+
+        [[nodiscard]]
+        hash_t digest() const;
+    };
+};
+
+#endif
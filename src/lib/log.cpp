@@ -0,0 +1,343 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "log.hpp"
+#include "errors.hpp"
+
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <string_theory/string_stream>
+
+#include <Stream/hsStream.h>
+
+// ===========================================================================
+
+namespace
+{
+    /**
+     * Bounded multi-producer, single-consumer queue. Each slot carries a sequence number
+     * that tells producers and the consumer whose turn it is, so nobody takes a lock.
+     */
+    class line_ring
+    {
+        struct slot
+        {
+            std::atomic<size_t> m_Sequence;
+            ST::string m_Line;
+        };
+
+        std::unique_ptr<slot[]> m_Slots;
+        size_t m_Mask;
+        alignas(64) std::atomic<size_t> m_Tail;
+        alignas(64) size_t m_Head;
+
+    public:
+        line_ring(size_t capacity)
+            : m_Slots(new slot[capacity]), m_Mask(capacity - 1), m_Tail(0), m_Head(0)
+        {
+            for (size_t i = 0; i < capacity; ++i)
+                m_Slots[i].m_Sequence.store(i, std::memory_order_relaxed);
+        }
+
+        bool try_push(ST::string& line)
+        {
+            size_t pos = m_Tail.load(std::memory_order_relaxed);
+            slot* mySlot;
+            while (true) {
+                mySlot = &m_Slots[pos & m_Mask];
+                size_t seq = mySlot->m_Sequence.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if (diff == 0) {
+                    if (m_Tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = m_Tail.load(std::memory_order_relaxed);
+                }
+            }
+
+            mySlot->m_Line = std::move(line);
+            mySlot->m_Sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        /** Only ever called from the drain thread. */
+        bool try_pop(ST::string& line)
+        {
+            slot* mySlot = &m_Slots[m_Head & m_Mask];
+            if (mySlot->m_Sequence.load(std::memory_order_acquire) != m_Head + 1)
+                return false;
+
+            line = std::move(mySlot->m_Line);
+            mySlot->m_Line = ST::string();
+            mySlot->m_Sequence.store(m_Head + m_Mask + 1, std::memory_order_release);
+            ++m_Head;
+            return true;
+        }
+    };
+
+    /** Installed as plDebug's stream so everything that uses plDebug is asynchronous too. */
+    class ring_stream : public hsStream
+    {
+    public:
+        [[noreturn]]
+        uint32_t size() const override { gpp::error::raise("ring_stream::size()"); }
+
+        [[noreturn]]
+        uint32_t pos() const override { gpp::error::raise("ring_stream::pos()"); }
+
+        [[noreturn]]
+        bool eof() const override { gpp::error::raise("ring_stream::eof()"); }
+
+        [[noreturn]]
+        void seek(uint32_t pos) override { gpp::error::raise("ring_stream::seek()"); }
+
+        [[noreturn]]
+        void skip(int32_t count) override { gpp::error::raise("ring_stream::skip()"); }
+
+        [[noreturn]]
+        void fastForward() override { gpp::error::raise("ring_stream::fastForward()"); }
+
+        [[noreturn]]
+        void rewind() override { gpp::error::raise("ring_stream::rewind()"); }
+
+        void flush() override;
+
+        [[noreturn]]
+        size_t read(size_t size, void* buf) override { gpp::error::raise("ring_stream::read()"); }
+
+        size_t write(size_t size, const void* buf) override;
+    };
+
+    // Holds the pieces of a line until plDebug finishes it, so that lines from different
+    // threads never get spliced together.
+    thread_local ST::string_stream s_PartialLine;
+
+    constexpr size_t kRingCapacity = 8192;
+
+    class drain
+    {
+        line_ring m_Ring;
+        gpp::log::sink_func m_Sink;
+        std::thread m_Thread;
+        std::atomic<bool> m_Running;
+
+        std::mutex m_Lock;
+        std::condition_variable m_Wake;
+        std::condition_variable m_Drained;
+        std::atomic<size_t> m_Pushed;
+        size_t m_Popped;
+        std::atomic<size_t> m_Dropped;
+
+        void run()
+        {
+            std::vector<ST::string> lines;
+            while (true) {
+                bool running = m_Running.load(std::memory_order_acquire);
+
+                // Hand the sink everything that is ready at once so a burst of lines only
+                // costs one write to the console or one signal to the GUI.
+                ST::string_stream batch;
+                size_t count = 0;
+                ST::string line;
+                while (m_Ring.try_pop(line)) {
+                    batch << line << '\n';
+                    ++count;
+                }
+                if (size_t dropped = m_Dropped.exchange(0); dropped != 0)
+                    batch << "(" << dropped << " lines were dropped while the log was full)\n";
+                if (count != 0 && m_Sink)
+                    m_Sink(batch.to_string());
+
+                {
+                    std::unique_lock<std::mutex> lock(m_Lock);
+                    m_Popped += count;
+                    m_Drained.notify_all();
+                    if (!running && m_Popped == m_Pushed.load(std::memory_order_acquire))
+                        break;
+                    if (count == 0)
+                        m_Wake.wait_for(lock, std::chrono::milliseconds(10));
+                }
+            }
+        }
+
+    public:
+        drain(gpp::log::sink_func sink)
+            : m_Ring(kRingCapacity), m_Sink(std::move(sink)), m_Running(true),
+              m_Pushed(0), m_Popped(0), m_Dropped(0)
+        {
+            m_Thread = std::thread(&drain::run, this);
+        }
+
+        drain(const drain&) = delete;
+        drain(drain&&) = delete;
+
+        ~drain()
+        {
+            m_Running.store(false, std::memory_order_release);
+            m_Wake.notify_one();
+            m_Thread.join();
+        }
+
+        void push(ST::string line)
+        {
+            if (!m_Ring.try_push(line)) {
+                // The sink can't wait for itself to make room, so anything it logs while
+                // the ring is full is lost.
+                if (std::this_thread::get_id() == m_Thread.get_id()) {
+                    m_Dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+
+                // Everybody else sleeps until the drain thread has popped something. It
+                // only updates m_Popped under the lock, so holding it from the check to the
+                // wait means the wakeup can't be missed.
+                std::unique_lock<std::mutex> lock(m_Lock);
+                while (true) {
+                    size_t popped = m_Popped;
+                    if (m_Ring.try_push(line))
+                        break;
+                    m_Wake.notify_one();
+                    m_Drained.wait(lock, [this, popped] { return m_Popped != popped; });
+                }
+            }
+            m_Pushed.fetch_add(1, std::memory_order_release);
+            m_Wake.notify_one();
+        }
+
+        void flush()
+        {
+            if (std::this_thread::get_id() == m_Thread.get_id())
+                return;
+
+            size_t target = m_Pushed.load(std::memory_order_acquire);
+            std::unique_lock<std::mutex> lock(m_Lock);
+            m_Wake.notify_one();
+            m_Drained.wait(lock, [this, target] { return m_Popped >= target; });
+        }
+    };
+
+    ring_stream s_Stream;
+
+    // Writers announce themselves before looking at the drain so that shutdown() can wait
+    // for them to finish instead of making every write take a lock.
+    std::atomic<drain*> s_Drain = nullptr;
+    std::atomic<size_t> s_Writers = 0;
+
+    class drain_ref
+    {
+        drain* m_Drain;
+
+    public:
+        drain_ref()
+        {
+            s_Writers.fetch_add(1);
+            m_Drain = s_Drain.load();
+        }
+
+        drain_ref(const drain_ref&) = delete;
+        drain_ref(drain_ref&&) = delete;
+
+        ~drain_ref() { s_Writers.fetch_sub(1); }
+
+        drain* operator->() const { return m_Drain; }
+        explicit operator bool() const { return m_Drain != nullptr; }
+    };
+
+    // Stops the drain thread during static destruction if nobody else did.
+    struct drain_reaper
+    {
+        ~drain_reaper() { gpp::log::shutdown(); }
+    } s_Reaper;
+};
+
+std::atomic<int> gpp::log::detail::s_Level = plDebug::kDLNone;
+
+// ===========================================================================
+
+void ring_stream::flush()
+{
+    if (s_PartialLine.size() != 0) {
+        gpp::log::write_line(s_PartialLine.to_string());
+        s_PartialLine.truncate();
+    }
+}
+
+size_t ring_stream::write(size_t size, const void* buf)
+{
+    const char* begin = reinterpret_cast<const char*>(buf);
+    const char* end = begin + size;
+    for (const char* it = begin; it != end; ++it) {
+        if (*it == '\n') {
+            s_PartialLine.append(begin, it - begin);
+            gpp::log::write_line(s_PartialLine.to_string());
+            s_PartialLine.truncate();
+            begin = it + 1;
+        }
+    }
+    s_PartialLine.append(begin, end - begin);
+    return size;
+}
+
+// ===========================================================================
+
+void gpp::log::init(int level, sink_func sink)
+{
+    shutdown();
+    s_Drain = new drain(std::move(sink));
+    set_level(level);
+}
+
+void gpp::log::shutdown()
+{
+    drain* myDrain = s_Drain.exchange(nullptr);
+    if (!myDrain)
+        return;
+
+    detail::s_Level = plDebug::kDLNone;
+    plDebug::Init(plDebug::kDLNone);
+    while (s_Writers.load() != 0)
+        std::this_thread::yield();
+
+    // Joins the drain thread once it has emptied the ring.
+    delete myDrain;
+}
+
+void gpp::log::set_level(int level)
+{
+    detail::s_Level = level;
+    plDebug::Init(level, &s_Stream);
+}
+
+void gpp::log::flush()
+{
+    drain_ref myDrain;
+    if (myDrain)
+        myDrain->flush();
+}
+
+void gpp::log::write_line(ST::string line)
+{
+    drain_ref myDrain;
+    if (myDrain)
+        myDrain->push(std::move(line));
+}
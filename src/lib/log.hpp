@@ -0,0 +1,89 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_LOG_H
+#define _GPP_LOG_H
+
+#include <atomic>
+#include <functional>
+#include <utility>
+
+#include <string_theory/format>
+
+#include <Debug/plDebug.h>
+
+namespace gpp
+{
+    namespace log
+    {
+        /** Receives one or more complete lines of log output on the drain thread. */
+        using sink_func = std::function<void(const ST::string&)>;
+
+        namespace detail
+        {
+            extern std::atomic<int> s_Level;
+        };
+
+        /**
+         * Routes plDebug and gpp::log output through a ring buffer that a background
+         * thread drains into the sink, so logging never blocks on the console or the GUI.
+         */
+        void init(int level, sink_func sink);
+
+        /** Drains everything that has been logged and stops the drain thread. */
+        void shutdown();
+
+        /** Sets the plDebug::kDL* level without replacing the sink. */
+        void set_level(int level);
+
+        [[nodiscard]]
+        inline bool enabled(int level)
+        {
+            return detail::s_Level.load(std::memory_order_relaxed) >= level;
+        }
+
+        /** Blocks until everything logged so far has reached the sink. */
+        void flush();
+
+        void write_line(ST::string line);
+
+        // Nothing is formatted unless the level is enabled, but the arguments are still
+        // evaluated. Hot paths with expensive arguments should check enabled() first.
+
+        template<typename... _Args>
+        inline void error(const char* fmt, _Args&&... args)
+        {
+            if (enabled(plDebug::kDLError))
+                write_line(ST::format(fmt, std::forward<_Args>(args)...));
+        }
+
+        template<typename... _Args>
+        inline void warning(const char* fmt, _Args&&... args)
+        {
+            if (enabled(plDebug::kDLWarning))
+                write_line(ST::format(fmt, std::forward<_Args>(args)...));
+        }
+
+        template<typename... _Args>
+        inline void debug(const char* fmt, _Args&&... args)
+        {
+            if (enabled(plDebug::kDLDebug))
+                write_line(ST::format(fmt, std::forward<_Args>(args)...));
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,111 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mapped_file.hpp"
+#include "errors.hpp"
+
+#ifdef _WIN32
+#   define NOMINMAX
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+// ===========================================================================
+
+#ifdef _WIN32
+
+gpp::mapped_file::mapped_file(const std::filesystem::path& path)
+    : m_Data(), m_Size(), m_File(INVALID_HANDLE_VALUE), m_Mapping()
+{
+    m_File = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_File == INVALID_HANDLE_VALUE)
+        error::raise("Unable to open '{}' for mapping", path);
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_File, &size)) {
+        CloseHandle(m_File);
+        error::raise("Unable to get the size of '{}'", path);
+    }
+    m_Size = (size_t)size.QuadPart;
+
+    // Zero sized mappings are an error on Windows, so just leave the view null.
+    if (m_Size == 0)
+        return;
+
+    m_Mapping = CreateFileMappingW(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_Mapping) {
+        CloseHandle(m_File);
+        error::raise("Unable to map '{}'", path);
+    }
+    m_Data = (const uint8_t*)MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_Data) {
+        CloseHandle(m_Mapping);
+        CloseHandle(m_File);
+        error::raise("Unable to map a view of '{}'", path);
+    }
+}
+
+gpp::mapped_file::~mapped_file()
+{
+    if (m_Data)
+        UnmapViewOfFile(m_Data);
+    if (m_Mapping)
+        CloseHandle(m_Mapping);
+    if (m_File != INVALID_HANDLE_VALUE)
+        CloseHandle(m_File);
+}
+
+#else
+
+gpp::mapped_file::mapped_file(const std::filesystem::path& path)
+    : m_Data(), m_Size(), m_File(-1)
+{
+    m_File = ::open(path.c_str(), O_RDONLY);
+    if (m_File == -1)
+        error::raise("Unable to open '{}' for mapping", path);
+
+    struct stat info;
+    if (fstat(m_File, &info) != 0) {
+        ::close(m_File);
+        error::raise("Unable to get the size of '{}'", path);
+    }
+    m_Size = (size_t)info.st_size;
+    if (m_Size == 0)
+        return;
+
+    void* view = mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, m_File, 0);
+    if (view == MAP_FAILED) {
+        ::close(m_File);
+        error::raise("Unable to map '{}'", path);
+    }
+    m_Data = (const uint8_t*)view;
+}
+
+gpp::mapped_file::~mapped_file()
+{
+    if (m_Data)
+        munmap((void*)m_Data, m_Size);
+    if (m_File != -1)
+        ::close(m_File);
+}
+
+#endif
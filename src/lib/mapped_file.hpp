@@ -0,0 +1,57 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_MAPPED_FILE_H
+#define _GPP_MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+namespace gpp
+{
+    /**
+     * Read-only memory mapped view of an entire file.
+     */
+    class mapped_file
+    {
+        const uint8_t* m_Data;
+        size_t m_Size;
+#ifdef _WIN32
+        void* m_File;
+        void* m_Mapping;
+#else
+        int m_File;
+#endif
+
+    public:
+        mapped_file() = delete;
+        mapped_file(const mapped_file&) = delete;
+        mapped_file(mapped_file&&) = delete;
+
+        mapped_file(const std::filesystem::path& path);
+        ~mapped_file();
+
+    public:
+        [[nodiscard]]
+        const uint8_t* data() const { return m_Data; }
+
+        [[nodiscard]]
+        size_t size() const { return m_Size; }
+    };
+};
+
+#endif
@@ -0,0 +1,254 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "memory.hpp"
+#include "fingerprint.hpp"
+#include "log.hpp"
+
+#include <atomic>
+#include <mutex>
+
+#ifdef _WIN32
+#   define NOMINMAX
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#   include <psapi.h>
+#else
+#   include <sys/resource.h>
+#   include <unistd.h>
+#   include <fstream>
+#endif
+
+#include <string_theory/format>
+
+#include <PRP/Geometry/plDrawableSpans.h>
+#include <PRP/Geometry/plGBufferGroup.h>
+#include <PRP/KeyedObject/hsKeyedObject.h>
+#include <PRP/Physics/plGenericPhysical.h>
+#include <PRP/Surface/plMipmap.h>
+#include <ResManager/plFactory.h>
+#include <ResManager/plResManager.h>
+
+// ===========================================================================
+
+namespace
+{
+    std::atomic<bool> s_Enabled = false;
+    std::mutex s_Lock;
+    std::vector<gpp::memory::phase_sample> s_Phases;
+    std::map<std::filesystem::path, std::vector<gpp::memory::page_usage>> s_Registries;
+
+    // Phases are measured against the previous one on the same thread, so that batch jobs
+    // running side by side don't charge each other for everything they did.
+    thread_local ST::string s_Job;
+    thread_local bool s_HaveBaseline = false;
+    thread_local uint64_t s_Baseline = 0;
+
+    uint64_t estimate_geometry(const plDrawableSpans* dspan)
+    {
+        uint64_t size = 0;
+        for (size_t i = 0; i < dspan->getNumBufferGroups(); ++i) {
+            const plGBufferGroup* group = dspan->getBuffer(i);
+            for (size_t j = 0; j < group->getNumVertBuffers(); ++j)
+                size += group->getVertBufferSize(j);
+            for (size_t j = 0; j < group->getNumIdxBuffers(); ++j)
+                size += group->getIdxBufferCount(j) * sizeof(unsigned short);
+        }
+
+        // Unpacked spans keep their geometry here instead of in the buffer groups.
+        for (const plGeometrySpan* span : dspan->getSourceSpans()) {
+            size += span->getVertices().size() * sizeof(plGeometrySpan::TempVertex);
+            size += span->getIndices().size() * sizeof(unsigned short);
+        }
+        return size;
+    }
+
+    uint64_t estimate_physical(const plGenericPhysical* physical)
+    {
+        return physical->getVerts().size() * sizeof(hsVector3) +
+               physical->getIndices().size() * sizeof(uint32_t);
+    }
+
+    const char* classify(uint16_t type)
+    {
+        switch (type) {
+        case kMipmap:
+        case kCubicEnvironmap:
+            return "textures";
+        case kDrawableSpans:
+            return "geometry";
+        case kGenericPhysical:
+            return "physicals";
+        default:
+            return "other";
+        }
+    }
+
+    uint64_t estimate_object(const plKey& key)
+    {
+        hsKeyedObject* obj = key->getObj();
+        if (!obj || hsKeyedObjectStub::Convert(obj, false))
+            return key->getObjSize();
+
+        switch (key->getType()) {
+        case kMipmap:
+        case kCubicEnvironmap:
+            return gpp::texture_payload_size(plBitmap::Convert(obj));
+        case kDrawableSpans:
+            return estimate_geometry(plDrawableSpans::Convert(obj));
+        case kGenericPhysical:
+            return estimate_physical(plGenericPhysical::Convert(obj));
+        default:
+            return key->getObjSize();
+        }
+    }
+};
+
+// ===========================================================================
+
+void gpp::memory::set_enabled(bool enabled)
+{
+    s_Enabled = enabled;
+}
+
+bool gpp::memory::enabled()
+{
+    return s_Enabled;
+}
+
+// ===========================================================================
+
+#ifdef _WIN32
+
+uint64_t gpp::memory::resident_size()
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.WorkingSetSize;
+}
+
+uint64_t gpp::memory::peak_resident_size()
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+}
+
+#else
+
+uint64_t gpp::memory::resident_size()
+{
+    // Second field is the resident set in pages.
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size, resident;
+    if (!(statm >> size >> resident))
+        return 0;
+    return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+uint64_t gpp::memory::peak_resident_size()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+#endif
+
+// ===========================================================================
+
+void gpp::memory::mark_phase(const ST::string& phase)
+{
+    if (!enabled())
+        return;
+
+    uint64_t resident = resident_size();
+    int64_t delta = s_HaveBaseline ? (int64_t)resident - (int64_t)s_Baseline : 0;
+    s_Baseline = resident;
+    s_HaveBaseline = true;
+
+    phase_sample sample{ s_Job, phase, resident, delta };
+    log::debug("  -> Memory after {}: {} MiB resident, {} MiB change", phase,
+                   sample.m_Resident / (1024 * 1024), sample.m_Delta / (1024 * 1024));
+
+    std::lock_guard<std::mutex> lock(s_Lock);
+    s_Phases.push_back(std::move(sample));
+}
+
+gpp::memory::job_tag::job_tag(const ST::string& job)
+    : m_Previous(std::move(s_Job))
+{
+    s_Job = job;
+    if (enabled()) {
+        s_Baseline = resident_size();
+        s_HaveBaseline = true;
+    }
+}
+
+gpp::memory::job_tag::~job_tag()
+{
+    s_Job = std::move(m_Previous);
+}
+
+void gpp::memory::account_registry(const std::filesystem::path& file, plResManager* mgr)
+{
+    if (!enabled())
+        return;
+
+    std::vector<page_usage> pages;
+    for (const auto& loc : mgr->getLocations()) {
+        page_usage usage;
+        if (plPageInfo* page = mgr->FindPage(loc))
+            usage.m_Page = ST::format("{}_{}", page->getAge(), page->getPage());
+        else
+            usage.m_Page = loc.toString();
+        for (auto type : mgr->getTypes(loc)) {
+            uint64_t& bytes = usage.m_Classes[classify(type)];
+            for (const auto& key : mgr->getKeys(loc, type))
+                bytes += estimate_object(key);
+        }
+        pages.push_back(std::move(usage));
+    }
+
+    std::lock_guard<std::mutex> lock(s_Lock);
+    s_Registries[file] = std::move(pages);
+}
+
+void gpp::memory::reset()
+{
+    std::lock_guard<std::mutex> lock(s_Lock);
+    s_Phases.clear();
+    s_Registries.clear();
+}
+
+std::vector<gpp::memory::phase_sample> gpp::memory::phases()
+{
+    std::lock_guard<std::mutex> lock(s_Lock);
+    return s_Phases;
+}
+
+std::map<std::filesystem::path, std::vector<gpp::memory::page_usage>> gpp::memory::registries()
+{
+    std::lock_guard<std::mutex> lock(s_Lock);
+    return s_Registries;
+}
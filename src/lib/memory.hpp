@@ -0,0 +1,105 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_MEMORY_H
+#define _GPP_MEMORY_H
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <vector>
+
+#include <string_theory/string>
+
+class plResManager;
+
+namespace gpp
+{
+    namespace memory
+    {
+        /**
+         * The resident set size at the end of a phase and how much it changed since the
+         * previous phase on the same thread. The change includes whatever other threads
+         * were up to at the time, so tag each thread's work with a job_tag.
+         */
+        struct phase_sample
+        {
+            ST::string m_Job;
+            ST::string m_Phase;
+            uint64_t m_Resident;
+            int64_t m_Delta;
+        };
+
+        /**
+         * Estimated bytes held by one page, by class. Objects that are still stubs
+         * are counted at their size on disk.
+         */
+        struct page_usage
+        {
+            ST::string m_Page;
+            std::map<ST::string, uint64_t> m_Classes;
+        };
+
+        /**
+         * Accounting walks every object in a registry, so it only happens when
+         * somebody asked for it.
+         */
+        void set_enabled(bool enabled);
+
+        [[nodiscard]]
+        bool enabled();
+
+        [[nodiscard]]
+        uint64_t resident_size();
+
+        /** The high water mark of the resident set over the whole life of the process. */
+        [[nodiscard]]
+        uint64_t peak_resident_size();
+
+        /** Samples the resident set size at the end of a patching phase. */
+        void mark_phase(const ST::string& phase);
+
+        /**
+         * Tags the phases marked on this thread with the job doing the work, and starts
+         * measuring changes from the current resident set size.
+         */
+        class job_tag
+        {
+            ST::string m_Previous;
+
+        public:
+            job_tag() = delete;
+            job_tag(const job_tag&) = delete;
+            job_tag(job_tag&&) = delete;
+
+            job_tag(const ST::string& job);
+            ~job_tag();
+        };
+
+        /** Estimates the memory used by every page in a freshly loaded registry. */
+        void account_registry(const std::filesystem::path& file, plResManager* mgr);
+
+        void reset();
+
+        [[nodiscard]]
+        std::vector<phase_sample> phases();
+
+        [[nodiscard]]
+        std::map<std::filesystem::path, std::vector<page_usage>> registries();
+    };
+};
+
+#endif
@@ -15,12 +15,19 @@
  */
 
 #include "patcher.hpp"
+#include "class_traits.hpp"
 #include "errors.hpp"
+#include "fingerprint.hpp"
+#include "log.hpp"
+#include "memory.hpp"
+#include "reference_graph.hpp"
 #include "span_hacker.hpp"
 
-#include <type_traits>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
 
-#include <Debug/plDebug.h>
 #include <PRP/plSceneNode.h>
 #include <PRP/Audio/plAudible.h>
 #include <PRP/Geometry/plClusterGroup.h>
@@ -28,22 +35,102 @@
 #include <PRP/Geometry/plOccluder.h>
 #include <PRP/GUI/pfGUIDialogMod.h>
 #include <PRP/Light/plLightInfo.h>
+#include <PRP/Modifier/plImageLibMod.h>
+#include <PRP/Modifier/plPythonFileMod.h>
 #include <PRP/Object/plSceneObject.h>
 #include <PRP/Physics/plGenericPhysical.h>
+#include <PRP/Surface/plBitmap.h>
+#include <PRP/Surface/plLayerInterface.h>
+#include <ResManager/plFactory.h>
 #include <ResManager/plResManager.h>
 
 // ===========================================================================
 
+namespace
+{
+    /** Points an object's references to duplicate textures at the surviving copies. */
+    bool retarget_textures(hsKeyedObject* obj, const std::map<plKey, plKey>& duplicates)
+    {
+        auto survivor = [&duplicates](const plKey& key) {
+            auto it = duplicates.find(key);
+            return it != duplicates.end() ? it->second : key;
+        };
+
+        bool result = false;
+        if (auto layer = plLayerInterface::Convert(obj, false)) {
+            plKey texture = survivor(layer->getTexture());
+            if (texture != layer->getTexture()) {
+                layer->setTexture(texture);
+                result = true;
+            }
+        }
+        if (auto imageLib = plImageLibMod::Convert(obj, false)) {
+            std::vector<plKey> images = imageLib->getImages();
+            if (std::any_of(images.begin(), images.end(),
+                            [&survivor](const plKey& i) { return survivor(i) != i; })) {
+                imageLib->clearImages();
+                for (const auto& i : images)
+                    imageLib->addImage(survivor(i));
+                result = true;
+            }
+        }
+        if (auto pfm = plPythonFileMod::Convert(obj, false)) {
+            std::vector<plPythonParameter> params = pfm->getParameters();
+            bool changed = false;
+            for (auto& i : params) {
+                plKey key = survivor(i.fObjKey);
+                if (key != i.fObjKey) {
+                    i.fObjKey = key;
+                    changed = true;
+                }
+            }
+            if (changed) {
+                pfm->clearParameters();
+                for (const auto& i : params)
+                    pfm->addParameter(i);
+                result = true;
+            }
+        }
+        return result;
+    }
+};
+
+// ===========================================================================
+
 gpp::merger::merger(const std::filesystem::path& source, const std::filesystem::path& dest)
+    : merger(std::vector<std::filesystem::path>{ source }, dest)
+{ }
+
+gpp::merger::merger(const std::vector<std::filesystem::path>& sources, const std::filesystem::path& dest)
 {
-    sanity_check_paths(source, dest);
+    if (sources.empty())
+        error::raise("No source pages were given to merge.");
+    for (const auto& source : sources)
+        sanity_check_paths(source, dest);
+
     // For clarification, see process() about why the res managers are identical.
     m_Source = m_Destination = std::make_shared<plResManager>();
-    m_SourcePage = load_location(source, m_Source.get());
+    m_SourceIndex = m_DestinationIndex = std::make_shared<object_index>(m_Destination.get(),
+                                                                        load_mode::e_full);
+    for (const auto& source : sources) {
+        plLocation loc = load_location(source, m_Source.get());
+        if (is_source_page(loc))
+            gpp::error::raise("'{}' was given more than once", source);
+        m_SourcePages.push_back(loc);
+    }
     m_DestinationPage = load_location(dest, m_Destination.get());
-    if (m_SourcePage.getSeqPrefix() != m_DestinationPage.getSeqPrefix())
-        gpp::error::raise("The source and destination pages must belong to the same Age");
-    m_ParentPath = source.parent_path();
+    for (const auto& loc : m_SourcePages) {
+        if (loc == m_DestinationPage)
+            gpp::error::raise("Cannot merge '{}' into itself", dest);
+        if (loc.getSeqPrefix() != m_DestinationPage.getSeqPrefix())
+            gpp::error::raise("The source and destination pages must belong to the same Age");
+    }
+    m_ParentPath = sources.front().parent_path();
+}
+
+bool gpp::merger::is_source_page(const plLocation& loc) const
+{
+    return std::find(m_SourcePages.begin(), m_SourcePages.end(), loc) != m_SourcePages.end();
 }
 
 plLocation gpp::merger::load_location(const std::filesystem::path& file,
@@ -55,12 +142,13 @@ plLocation gpp::merger::load_location(const std::filesystem::path& file,
 
     plPageInfo* page;
 
-    plDebug::Debug("  -> Loading PRP");
+    log::debug("  -> Loading PRP");
     try {
         page = mgr->ReadPage(file);
     } catch (const hsException& ex) {
         gpp::error::raise("Unable to read page {}: {}", file, ex.what());
     }
+    m_DestinationIndex->add_page(page->getLocation(), file);
 
     return page->getLocation();
 }
@@ -70,17 +158,17 @@ void gpp::merger::load_age(const std::filesystem::path& wd, plResManager* mgr) c
     ST::string ageName = ST::format("{}.age", mgr->FindPage(m_DestinationPage)->getAge());
     std::filesystem::path ageFile = wd / ageName.to_path();
     if (!std::filesystem::is_regular_file(ageFile)) {
-        plDebug::Warning(" -> Hmm... We wanted the whole Age, but it can't be loaded.");
+        log::warning(" -> Hmm... We wanted the whole Age, but it can't be loaded.");
         return;
     }
 
-    plDebug::Debug("  -> Ah, whole Age is available. Load it as well!");
+    log::debug("  -> Ah, whole Age is available. Load it as well!");
 
     plAgeInfo age;
     age.readFromFile(ageFile);
     for (size_t i = 0; i < age.getNumPages(); ++i) {
         plLocation loc = age.getPageLoc(i, mgr->getVer());
-        if (loc == m_DestinationPage || loc == m_SourcePage)
+        if (loc == m_DestinationPage || is_source_page(loc))
             continue;
         std::filesystem::path prp = wd / age.getPageFilename(i, mgr->getVer()).to_path();
         if (std::filesystem::is_regular_file(prp))
@@ -88,7 +176,7 @@ void gpp::merger::load_age(const std::filesystem::path& wd, plResManager* mgr) c
     }
     for (size_t i = 0; i < age.getNumCommonPages(mgr->getVer()); ++i) {
         plLocation loc = age.getCommonPageLoc(i, mgr->getVer());
-        if (loc == m_DestinationPage || loc == m_SourcePage)
+        if (loc == m_DestinationPage || is_source_page(loc))
             continue;
         std::filesystem::path prp = wd / age.getCommonPageFilename(i, mgr->getVer()).to_path();
         if (std::filesystem::is_regular_file(prp))
@@ -98,49 +186,71 @@ void gpp::merger::load_age(const std::filesystem::path& wd, plResManager* mgr) c
 
 // ===========================================================================
 
-template<typename T, typename Pr>
-std::enable_if_t<std::is_base_of_v<hsKeyedObject, T>>
-visit_object(const plKey& key, Pr func)
-{
-    T* obj = T::Convert(key->getObj(), false);
-    if (obj) {
-        func(obj);
-    }
-}
-
 void gpp::merger::process()
 {
-    // Step 1: Merge geometry data into new file because DSpans are monoliths.
+    // Step 1: Merge geometry data into new file because DSpans are monoliths. Every source
+    //         goes through the same span_hacker so that each DSpan is only repacked once.
     {
         span_hacker geom(m_Source, m_Destination);
-        for (const auto& diKey : m_Source->getKeys(m_SourcePage, kDrawInterface))
-            geom.change_page(diKey, m_DestinationPage);
+        geom.set_touch_func([this](const plKey& obj) { touch(obj); });
+        geom.set_progress(m_Progress);
+
+        if (m_Progress) {
+            size_t total = 0;
+            for (const auto& sourcePage : m_SourcePages)
+                total += m_Source->getKeys(sourcePage, kDrawInterface).size();
+            begin_progress("Moving drawables", total);
+        }
+        for (const auto& sourcePage : m_SourcePages) {
+            for (const auto& diKey : m_Source->getKeys(sourcePage, kDrawInterface)) {
+                step_progress();
+                geom.change_page(diKey, m_DestinationPage);
+            }
+        }
     }
+    check_progress();
+    memory::mark_phase("merge_drawables");
 
     // Step 2: Delete the old drawable spans objects so they will not carry over
     //         into the new PRP file.
-    for (const auto& dsKey : m_Source->getKeys(m_SourcePage, kDrawableSpans))
-        m_Source->DelObject(dsKey);
+    for (const auto& sourcePage : m_SourcePages) {
+        for (const auto& dsKey : m_Source->getKeys(sourcePage, kDrawableSpans))
+            delete_object(dsKey);
+    }
 
     // Step 3: Many types contain back-references to the SceneNode. This is replaced,
-    //         so we must manually fix that up. But, instead of hardcoding everything...
+    //         so we must manually fix that up. Ask the reference graph who they are
+    //         instead of poking at every object in the page.
     plSceneNode* destNode = m_Destination->getSceneNode(m_DestinationPage);
-    for (auto type : m_Source->getTypes(m_SourcePage)) {
-        for (const auto& key : m_Source->getKeys(m_SourcePage, type)) {
-            visit_object<plWinAudible>(key, [&](auto* obj) { obj->setSceneNode(destNode->getKey()); });
-            visit_object<plClusterGroup>(key, [&](auto* obj) { obj->setSceneNode(destNode->getKey()); });
-            visit_object<plDrawableSpans>(key, [&](auto* obj) { obj->setSceneNode(destNode->getKey()); });
-            visit_object<plOccluder>(key, [&](auto* obj) { obj->setSceneNode(destNode->getKey()); });
-            visit_object<pfGUIDialogMod>(key, [&](auto* obj) { obj->setSceneNode(destNode->getKey()); });
-            visit_object<plLightInfo>(key, [&](auto* obj) { obj->setSceneNode(destNode->getKey()); });
-            visit_object<plSceneObject>(key, [&](auto* obj) { obj->setSceneNode(destNode->getKey()); });
-            visit_object<plGenericPhysical>(key, [&](auto* obj) { obj->setSceneNode(destNode->getKey()); });
+    std::vector<plKey> nodeReferrers;
+    {
+        const reference_graph& graph = get_reference_graph();
+        for (const auto& sourcePage : m_SourcePages) {
+            auto referrers = graph.referrers(m_Source->getSceneNode(sourcePage)->getKey());
+            nodeReferrers.insert(nodeReferrers.end(), referrers.begin(), referrers.end());
         }
     }
+    auto setSceneNode = [&](auto* obj) { obj->setSceneNode(destNode->getKey()); };
+    object_dispatch fixups;
+    fixups.on<plWinAudible>(setSceneNode)
+          .on<plClusterGroup>(setSceneNode)
+          .on<plDrawableSpans>(setSceneNode)
+          .on<plOccluder>(setSceneNode)
+          .on<pfGUIDialogMod>(setSceneNode)
+          .on<plLightInfo>(setSceneNode)
+          .on<plSceneObject>(setSceneNode)
+          .on<plGenericPhysical>(setSceneNode);
 
-    // Step 4: Merge the SceneNodes and delete the old one.
-    {
-        plSceneNode* srcNode = m_Source->getSceneNode(m_SourcePage);
+    begin_progress("Moving scene node references", nodeReferrers.size());
+    for (const auto& key : nodeReferrers) {
+        step_progress();
+        fixups(key);
+        touch(key);
+    }
+
+    // Step 4: Merge the SceneNodes and delete the old ones.
+    for (const auto& sourcePage : m_SourcePages) {
+        plSceneNode* srcNode = m_Source->getSceneNode(sourcePage);
         destNode->getSceneObjects().insert(
             destNode->getSceneObjects().cend(),
             srcNode->getSceneObjects().begin(),
@@ -151,26 +261,32 @@ void gpp::merger::process()
             srcNode->getPoolObjects().begin(),
             srcNode->getPoolObjects().end()
         );
-        m_Source->DelObject(srcNode->getKey());
+        delete_object(srcNode->getKey());
     }
+    touch(destNode->getKey());
+    memory::mark_phase("merge_scene_nodes");
 
     // Step 5: If there are any per-page Textures, resolve them into the Textures.prp
-    if (m_DestinationPage.getSeqPrefix() > 0)
+    if (m_DestinationPage.getSeqPrefix() > 0) {
         merge_textures();
+        memory::mark_phase("merge_textures");
+    }
 
-    // Safety: don't touch the source page. ChangeLocation() will definitely try
-    // to do this oh so very "helpfully"
-    m_Source->DelPage(m_SourcePage);
-    auto sourceIt = m_DirtyPages.find(m_SourcePage);
-    if (sourceIt != m_DirtyPages.end())
-        m_DirtyPages.erase(sourceIt);
+    for (const auto& sourcePage : m_SourcePages) {
+        // Safety: don't touch the source page. ChangeLocation() will definitely try
+        // to do this oh so very "helpfully"
+        m_Source->DelPage(sourcePage);
+        auto sourceIt = m_DirtyPages.find(sourcePage);
+        if (sourceIt != m_DirtyPages.end())
+            m_DirtyPages.erase(sourceIt);
 
-    // Mass move all remaining keys into the destination page, all should be OK.
-    // Limitation: you cannot move objects from one res manager to another,
-    // because HSPlasma will just throw an exception at you when you try
-    // to reset the object contained by a key. So, just change the location.
-    // Sad. I am sad.
-    m_Source->ChangeLocation(m_SourcePage, m_DestinationPage);
+        // Mass move all remaining keys into the destination page, all should be OK.
+        // Limitation: you cannot move objects from one res manager to another,
+        // because HSPlasma will just throw an exception at you when you try
+        // to reset the object contained by a key. So, just change the location.
+        // Sad. I am sad.
+        m_Source->ChangeLocation(sourcePage, m_DestinationPage);
+    }
 
     m_DirtyPages.insert(m_DestinationPage);
 }
@@ -180,28 +296,87 @@ void gpp::merger::merge_textures()
     constexpr uint16_t kTextureTypes[] = { kMipmap, kCubicEnvironmap };
 
     std::vector<plKey> textureKeys;
-    for (auto type : kTextureTypes) {
-        auto keys = m_Source->getKeys(m_SourcePage, type);
-        textureKeys.insert(textureKeys.end(), keys.cbegin(), keys.cend());
+    for (const auto& sourcePage : m_SourcePages) {
+        for (auto type : kTextureTypes) {
+            auto keys = m_Source->getKeys(sourcePage, type);
+            textureKeys.insert(textureKeys.end(), keys.cbegin(), keys.cend());
+        }
     }
 
     if (textureKeys.empty())
         return;
 
     // Try to load the whole Age so we can fool with the Textures PRP.
-    plDebug::Debug("  -> Hmm... Textures... Let's try merging those!");
+    log::debug("  -> Hmm... Textures... Let's try merging those!");
     load_age(m_ParentPath, m_Destination.get());
 
     plLocation texturesPage = m_DestinationPage;
     texturesPage.setFlags(plLocation::kBuiltIn);
     texturesPage.setPageNum(-1);
     if (!m_Destination->FindPage(texturesPage)) {
-        plDebug::Warning("  -> No textures page, not merging textures.");
+        log::warning("  -> No textures page, not merging textures.");
         return;
     }
 
+    // Index what's already in the Textures page before adding anything to it so that
+    // those keys are preferred when collapsing duplicates. The fingerprint only narrows
+    // down the candidates -- nothing is collapsed unless the pixels really are the same.
+    std::map<hash_t, std::vector<plKey>> canonical;
+    for (auto type : kTextureTypes) {
+        for (const auto& key : m_Destination->getKeys(texturesPage, type)) {
+            if (auto texture = plBitmap::Convert(key->getObj(), false))
+                canonical[fingerprint_texture(texture)].push_back(key);
+        }
+    }
+
+    std::map<plKey, plKey> duplicates;
+    size_t bytesSaved = 0;
     for (const auto& key : textureKeys) {
         m_Source->MoveKey(key, texturesPage);
         m_DirtyPages.insert(texturesPage);
+
+        auto texture = plBitmap::Convert(key->getObj(), false);
+        if (!texture)
+            continue;
+        auto& candidates = canonical[fingerprint_texture(texture)];
+        auto it = std::find_if(candidates.begin(), candidates.end(),
+            [texture](const plKey& candidate) {
+                return same_texture(texture, plBitmap::Convert(candidate->getObj()));
+            }
+        );
+        if (it == candidates.end()) {
+            candidates.push_back(key);
+        } else {
+            log::debug("  -> [{}] '{}' is a duplicate of '{}'",
+                           plFactory::ClassName(key->getType()), key->getName(), (*it)->getName());
+            duplicates[key] = *it;
+            bytesSaved += texture_payload_size(texture);
+        }
+    }
+
+    if (duplicates.empty())
+        return;
+
+    // Only the objects that actually refer to a duplicate need to be repointed. Touching
+    // them updates the graph, so gather them all up front.
+    std::set<plKey> referrers;
+    const reference_graph& graph = get_reference_graph();
+    for (const auto& [dup, _] : duplicates) {
+        auto keys = graph.referrers(dup);
+        referrers.insert(keys.begin(), keys.end());
+    }
+
+    size_t numRewritten = 0;
+    for (const auto& key : referrers) {
+        if (!retarget_textures(key->getObj(), duplicates))
+            continue;
+        touch(key);
+        m_DirtyPages.insert(key->getLocation());
+        ++numRewritten;
     }
+
+    for (const auto& [dup, _] : duplicates)
+        delete_object(dup);
+    log::debug("  -> Collapsed {} duplicate textures, saving {} bytes, and rewrote {} referrers",
+                   duplicates.size(), bytesSaved, numRewritten);
 }
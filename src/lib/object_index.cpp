@@ -0,0 +1,368 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "object_index.hpp"
+#include "errors.hpp"
+#include "log.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+
+#include <PRP/KeyedObject/hsKeyedObject.h>
+#include <PRP/plCreatable.h>
+#include <ResManager/pdUnifiedTypeMap.h>
+#include <ResManager/plFactory.h>
+#include <ResManager/plResManager.h>
+#include <Stream/hsRAMStream.h>
+
+// ===========================================================================
+
+namespace
+{
+    // The index that read each key, so that code holding only a key can still get at its
+    // object without looking inside indices that other threads are busy changing.
+    std::mutex s_OwnersLock;
+    std::map<plKey, gpp::object_index*> s_Owners;
+
+    using location_bytes = std::vector<std::vector<uint8_t>>;
+
+    [[nodiscard]]
+    location_bytes encode_locations(const std::set<plLocation>& locs, PlasmaVer ver)
+    {
+        location_bytes result;
+        for (const auto& i : locs) {
+            hsRAMStream S(ver);
+            i.write(&S);
+            result.emplace_back(S.data(), S.data() + S.size());
+        }
+        return result;
+    }
+
+    /**
+     * There's no telling which pages an object refers to without deserializing it, but
+     * every uoid contains its location, so an object whose bytes don't contain any of the
+     * encoded locations can't refer to them.
+     */
+    [[nodiscard]]
+    bool refers_to(const uint8_t* buf, size_t size, const location_bytes& locs)
+    {
+        const uint8_t* bufEnd = buf + size;
+        return std::any_of(locs.begin(), locs.end(),
+                           [buf, bufEnd](const std::vector<uint8_t>& needle) {
+                               return std::search(buf, bufEnd, needle.begin(), needle.end()) != bufEnd;
+                           });
+    }
+};
+
+// ===========================================================================
+
+gpp::object_index::object_index(plResManager* mgr, load_mode mode)
+    : m_Mgr(mgr), m_Mode(mode)
+{
+}
+
+gpp::object_index::~object_index()
+{
+    std::lock_guard<std::mutex> lock(s_OwnersLock);
+    for (const auto& [key, _] : m_Entries) {
+        auto it = s_Owners.find(key);
+        if (it != s_Owners.end() && it->second == this)
+            s_Owners.erase(it);
+    }
+}
+
+// ===========================================================================
+
+void gpp::object_index::add_page(const plLocation& loc, const std::filesystem::path& file)
+{
+    m_Pages[loc] = file;
+    auto& keyring = m_Keyrings[loc];
+    keyring.clear();
+    for (auto type : m_Mgr->getTypes(loc)) {
+        auto keys = m_Mgr->getKeys(loc, type);
+        for (const auto& key : keys)
+            m_Entries[key] = { file, loc, key->getFileOff(), key->getObjSize(), key->getID() };
+        keyring[type] = std::move(keys);
+        if (m_Mode == load_mode::e_lazy)
+            m_Pending.insert(type);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(s_OwnersLock);
+        for (const auto& [type, keys] : keyring) {
+            for (const auto& key : keys)
+                s_Owners[key] = this;
+        }
+    }
+}
+
+const gpp::object_index::entry* gpp::object_index::find(const plKey& key) const
+{
+    auto it = m_Entries.find(key);
+    if (it != m_Entries.end())
+        return &it->second;
+    return nullptr;
+}
+
+bool gpp::object_index::is_stub(const plKey& key)
+{
+    return key.Exists() && key.isLoaded() &&
+           hsKeyedObjectStub::Convert(key->getObj(), false) != nullptr;
+}
+
+hsKeyedObject* gpp::object_index::resolve(const plKey& key)
+{
+    if (!key.Exists() || !key.isLoaded())
+        return nullptr;
+    if (!is_stub(key))
+        return key->getObj();
+
+    object_index* owner = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(s_OwnersLock);
+        auto it = s_Owners.find(key);
+        if (it != s_Owners.end())
+            owner = it->second;
+    }
+    if (!owner)
+        error::raise("Object '{}' is a stub, but no index knows where it came from", key.toString());
+    return owner->get(key);
+}
+
+// ===========================================================================
+
+hsKeyedObject* gpp::object_index::get(const plKey& key)
+{
+    if (!key.Exists() || !key.isLoaded())
+        return nullptr;
+    if (auto* stub = hsKeyedObjectStub::Convert(key->getObj(), false))
+        materialize_stub(key, stub);
+    return key->getObj();
+}
+
+void gpp::object_index::materialize(uint16_t classType)
+{
+    if (m_Pending.erase(classType) == 0)
+        return;
+
+    size_t count = 0;
+    for (const auto& key : m_Mgr->getKeys(classType)) {
+        if (auto* stub = hsKeyedObjectStub::Convert(key->getObj(), false)) {
+            materialize_stub(key, stub);
+            ++count;
+        }
+    }
+
+    log::debug("  -> Materialized {} [{}] objects", count, plFactory::ClassName(classType));
+}
+
+void gpp::object_index::materialize_stub(const plKey& key, hsKeyedObjectStub* stub)
+{
+    // The stub holds everything after the class index, including the object's own
+    // key, so it can be fed straight back into a real object's read().
+    hsRAMStream S(m_Mgr->getVer());
+    S.copyFrom(stub->getStub()->getData(), stub->getStub()->getLength());
+
+    key->setObj(nullptr);
+    delete stub;
+
+    uint16_t classType = key->getType();
+    hsKeyedObject* obj = hsKeyedObject::Convert(plFactory::Create(classType), false);
+    if (!obj)
+        error::raise("Unable to create a [{}] to materialize '{}'",
+                     plFactory::ClassName(classType), key->getName());
+    try {
+        obj->read(&S, m_Mgr);
+    } catch (const hsException& ex) {
+        delete obj;
+        error::raise("Unable to materialize '{}': {}", key.toString(), ex.what());
+    }
+    key->setObj(obj);
+}
+
+// ===========================================================================
+
+std::set<plLocation> gpp::object_index::changed_pages() const
+{
+    std::set<plLocation> result;
+    for (const auto& [loc, keyring] : m_Keyrings) {
+        auto types = m_Mgr->getTypes(loc);
+        bool changed = types.size() != keyring.size();
+        for (auto it = types.begin(); !changed && it != types.end(); ++it) {
+            auto keysIt = keyring.find(*it);
+            if (keysIt == keyring.end() || keysIt->second != m_Mgr->getKeys(loc, *it)) {
+                changed = true;
+                break;
+            }
+            for (const auto& key : keysIt->second) {
+                if (key->getID() != m_Entries.at(key).m_ID) {
+                    changed = true;
+                    break;
+                }
+            }
+        }
+        if (changed)
+            result.insert(loc);
+    }
+    return result;
+}
+
+bool gpp::object_index::page_refers_to(const plLocation& loc, const std::set<plLocation>& locs) const
+{
+    auto keyringIt = m_Keyrings.find(loc);
+    auto pageIt = m_Pages.find(loc);
+    if (keyringIt == m_Keyrings.end() || pageIt == m_Pages.end())
+        return false;
+
+    // Every object contains its own location, so that can't count.
+    std::set<plLocation> others = locs;
+    others.erase(loc);
+    if (others.empty() || !std::filesystem::is_regular_file(pageIt->second))
+        return false;
+
+    location_bytes otherLocs = encode_locations(others, m_Mgr->getVer());
+    mapped_file view(pageIt->second);
+    for (const auto& [type, keys] : keyringIt->second) {
+        for (const auto& key : keys) {
+            const entry* myEntry = find(key);
+            if (!myEntry || myEntry->m_File != pageIt->second || myEntry->m_Offset + myEntry->m_Size > view.size())
+                continue;
+            if (refers_to(view.data() + myEntry->m_Offset, myEntry->m_Size, otherLocs))
+                return true;
+        }
+    }
+    return false;
+}
+
+size_t gpp::object_index::passthrough(const plLocation& loc, const std::set<plKey>& dirty,
+                                      const std::set<plLocation>& changedPages)
+{
+    // Uoids embedded in the original bytes are only valid if the keyring we write out
+    // matches the one we read in. If anything was added, removed, or moved on this page,
+    // the object IDs may shift, so everything has to be encoded from scratch.
+    auto keyringIt = m_Keyrings.find(loc);
+    if (keyringIt == m_Keyrings.end() || changedPages.find(loc) != changedPages.end())
+        return 0;
+
+    // The same goes for references into other pages.
+    location_bytes staleLocs = encode_locations(changedPages, m_Mgr->getVer());
+
+    std::unique_ptr<mapped_file> view;
+    size_t count = 0, crossPage = 0;
+    for (const auto& [type, keys] : keyringIt->second) {
+        for (const auto& key : keys) {
+            if (dirty.find(key) != dirty.end() || is_stub(key) || !key.isLoaded())
+                continue;
+
+            const entry* myEntry = find(key);
+            if (!myEntry || myEntry->m_Location != key->getLocation() || myEntry->m_Size <= sizeof(uint16_t))
+                continue;
+
+            // All the objects in a page came from the same file, so map it just once.
+            if (!view) {
+                if (!std::filesystem::is_regular_file(myEntry->m_File))
+                    return 0;
+                view = std::make_unique<mapped_file>(myEntry->m_File);
+            }
+            if (myEntry->m_Offset + myEntry->m_Size > view->size())
+                error::raise("Object '{}' is beyond the end of '{}'", key.toString(), myEntry->m_File);
+
+            const uint8_t* buf = view->data() + myEntry->m_Offset;
+            uint16_t fileType = (uint16_t)buf[0] | ((uint16_t)buf[1] << 8);
+            if (pdUnifiedTypeMap::PlasmaToMapped(fileType, m_Mgr->getVer()) != key->getType())
+                error::raise("Object '{}' does not match the bytes in '{}'", key.toString(), myEntry->m_File);
+
+            size_t length = myEntry->m_Size - sizeof(uint16_t);
+            if (refers_to(buf, myEntry->m_Size, staleLocs)) {
+                ++crossPage;
+                continue;
+            }
+            hsRAMStream S(m_Mgr->getVer());
+            S.copyFrom(buf + sizeof(uint16_t), length);
+            auto* data = new plCreatableStub(key->getType(), length);
+            data->read(&S, m_Mgr);
+
+            auto* stub = new hsKeyedObjectStub();
+            stub->setStub(data);
+            stub->setKey(key);
+
+            hsKeyedObject* obj = key->getObj();
+            key->setObj(nullptr);
+            delete obj;
+            key->setObj(stub);
+
+            m_Pending.insert(type);
+            ++count;
+        }
+    }
+
+    if (crossPage != 0)
+        log::debug("  -> {} objects refer to changed pages and will be reencoded", crossPage);
+    return count;
+}
+
+size_t gpp::object_index::materialize_stale(const std::set<plLocation>& changedPages)
+{
+    location_bytes staleLocs = encode_locations(changedPages, m_Mgr->getVer());
+    size_t count = 0;
+    for (const auto& loc : m_Mgr->getLocations()) {
+        bool pageChanged = changedPages.find(loc) != changedPages.end();
+        for (auto type : m_Mgr->getTypes(loc)) {
+            for (const auto& key : m_Mgr->getKeys(loc, type)) {
+                auto* stub = key.isLoaded() ? hsKeyedObjectStub::Convert(key->getObj(), false) : nullptr;
+                if (!stub)
+                    continue;
+                if (pageChanged || refers_to(stub->getStub()->getData(), stub->getStub()->getLength(), staleLocs)) {
+                    materialize_stub(key, stub);
+                    ++count;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+bool gpp::object_index::revert_passthrough(const plLocation& loc)
+{
+    auto keyringIt = m_Keyrings.find(loc);
+    if (keyringIt == m_Keyrings.end())
+        return false;
+
+    // libHSPlasma is free to hand out new object IDs when it writes a page. The keyring
+    // it wrote is correct either way, but the stubs still contain the old IDs.
+    bool renumbered = false;
+    for (const auto& [type, keys] : keyringIt->second) {
+        for (const auto& key : keys) {
+            if (key->getID() != m_Entries.at(key).m_ID) {
+                renumbered = true;
+                break;
+            }
+        }
+    }
+    if (!renumbered)
+        return false;
+
+    log::warning("  -> Object IDs changed while writing '{}', reencoding everything", loc.toString());
+    for (const auto& [type, keys] : keyringIt->second) {
+        for (const auto& key : keys) {
+            if (auto* stub = hsKeyedObjectStub::Convert(key->getObj(), false))
+                materialize_stub(key, stub);
+        }
+    }
+    return true;
+}
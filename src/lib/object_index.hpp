@@ -0,0 +1,162 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_OBJECT_INDEX_H
+#define _GPP_OBJECT_INDEX_H
+
+#include <cstdint>
+#include <filesystem>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include <ResManager/plResManager.h>
+
+class hsKeyedObject;
+class hsKeyedObjectStub;
+
+namespace gpp
+{
+    enum class load_mode
+    {
+        /** Every object in every page is deserialized up front. */
+        e_full,
+
+        /** Objects are kept as raw stubs until something asks for their class. */
+        e_lazy,
+    };
+
+    /**
+     * Remembers where each object in a registry was read from and, in lazy mode,
+     * deserializes stubbed objects one class at a time.
+     */
+    class object_index
+    {
+    public:
+        struct entry
+        {
+            std::filesystem::path m_File;
+            plLocation m_Location;
+            uint32_t m_Offset;
+            uint32_t m_Size;
+            uint32_t m_ID;
+        };
+
+    private:
+        plResManager* m_Mgr;
+        load_mode m_Mode;
+        std::map<plKey, entry> m_Entries;
+        std::map<plLocation, std::map<uint16_t, std::vector<plKey>>> m_Keyrings;
+        std::map<plLocation, std::filesystem::path> m_Pages;
+        std::set<uint16_t> m_Pending;
+
+    public:
+        object_index() = delete;
+        object_index(const object_index&) = delete;
+        object_index(object_index&&) = delete;
+
+        object_index(plResManager* mgr, load_mode mode);
+        ~object_index();
+
+    public:
+        /** Records the byte ranges of all objects in a freshly read or written page. */
+        void add_page(const plLocation& loc, const std::filesystem::path& file);
+
+        [[nodiscard]]
+        const entry* find(const plKey& key) const;
+
+        [[nodiscard]]
+        load_mode mode() const { return m_Mode; }
+
+        /** The keys that were in a page when it was first loaded, sorted by class. */
+        [[nodiscard]]
+        const std::map<uint16_t, std::vector<plKey>>* keyring(const plLocation& loc) const
+        {
+            auto it = m_Keyrings.find(loc);
+            return it != m_Keyrings.end() ? &it->second : nullptr;
+        }
+
+        /** The file each indexed page was last read from or written to. */
+        [[nodiscard]]
+        const std::map<plLocation, std::filesystem::path>& pages() const { return m_Pages; }
+
+        /** Returns the object behind a key, deserializing it first if it is still a stub. */
+        hsKeyedObject* get(const plKey& key);
+
+        /** Deserializes every stubbed object of the given class. */
+        void materialize(uint16_t classType);
+
+        void materialize(std::initializer_list<uint16_t> classTypes)
+        {
+            for (auto classType : classTypes)
+                materialize(classType);
+        }
+
+        /**
+         * The pages whose keys have been added, removed, reordered, or renumbered since they
+         * were indexed. Uoids in the original bytes that point into these pages are stale.
+         */
+        [[nodiscard]]
+        std::set<plLocation> changed_pages() const;
+
+        /**
+         * Whether any object in a page, as it was originally read, refers to one of the
+         * other pages. This only looks at the raw bytes, so nothing is deserialized.
+         */
+        [[nodiscard]]
+        bool page_refers_to(const plLocation& loc, const std::set<plLocation>& locs) const;
+
+        /**
+         * Replaces every object in the page that is not in the dirty set with a stub of
+         * its original bytes so that it is written back bit-for-bit. Objects whose bytes
+         * refer to any of the changed pages are left alone.
+         * \returns The number of objects that will be passed through.
+         */
+        size_t passthrough(const plLocation& loc, const std::set<plKey>& dirty,
+                           const std::set<plLocation>& changedPages);
+
+        /**
+         * Deserializes every stub that lives in or refers to one of the changed pages so
+         * that it is encoded with the object IDs those pages will be written with.
+         * \returns The number of objects deserialized.
+         */
+        size_t materialize_stale(const std::set<plLocation>& changedPages);
+
+        /**
+         * Deserializes the passed through objects in a page again if writing it out gave any
+         * of its keys a different object ID than the original bytes assume.
+         * \returns true if the page has to be written again.
+         */
+        bool revert_passthrough(const plLocation& loc);
+
+        [[nodiscard]]
+        static bool is_stub(const plKey& key);
+
+        /**
+         * Returns the object behind a key from any registry that has a live index,
+         * deserializing it first if it is still a stub. The stub is read by whichever
+         * index most recently indexed the key, without touching any other index.
+         */
+        static hsKeyedObject* resolve(const plKey& key);
+
+    private:
+        void materialize_stub(const plKey& key, hsKeyedObjectStub* stub);
+    };
+};
+
+#endif
@@ -16,12 +16,20 @@
 
 #include "patcher.hpp"
 #include "errors.hpp"
+#include "events.hpp"
+#include "log.hpp"
+#include "memory.hpp"
+#include "plan.hpp"
+#include "progress.hpp"
+#include "reference_graph.hpp"
+#include "shard.hpp"
 #include "span_hacker.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 #include <algorithm>
 #include <regex>
 
-#include <Debug/plDebug.h>
 #include <PRP/Object/plDrawInterface.h>
 #include <PRP/Object/plSceneObject.h>
 #include <PRP/Object/plSimulationInterface.h>
@@ -34,17 +42,83 @@ using namespace ST::literals;
 
  // ===========================================================================
 
-gpp::patcher::patcher(const std::filesystem::path& source, const std::filesystem::path& dest)
+gpp::patcher::patcher(const std::filesystem::path& source, const std::filesystem::path& dest,
+                      load_mode mode)
 {
     sanity_check_paths(source, dest);
-    m_Source = load(source);
-    m_Destination = load(dest);
+    std::tie(m_Source, m_SourceIndex) = load(source, mode);
+    std::tie(m_Destination, m_DestinationIndex) = load(dest, mode);
     sanity_check_registry();
 }
 
+gpp::patcher::patcher(std::shared_ptr<plResManager> source, std::shared_ptr<object_index> sourceIndex,
+                      std::shared_ptr<plResManager> dest, std::shared_ptr<object_index> destIndex)
+{
+    m_Source = std::move(source);
+    m_SourceIndex = std::move(sourceIndex);
+    m_Destination = std::move(dest);
+    m_DestinationIndex = std::move(destIndex);
+    sanity_check_registry();
+}
+
+void gpp::patcher::load_source(const std::filesystem::path& source, load_mode mode)
+{
+    if (!std::filesystem::is_regular_file(source))
+        error::raise("Source file '{}' is not a valid regular file.", source);
+
+    // These are keyed on objects from the old source.
+    m_KeyLUT.clear();
+    m_Unchanged.clear();
+    m_PendingFingerprints.clear();
+
+    // The old source still owns anything that was moved into the destination, so it has
+    // to stay around for as long as the destination does.
+    if (m_LentSource)
+        m_Lenders.emplace_back(std::move(m_Source), std::move(m_SourceIndex));
+    m_LentSource = false;
+    m_SourceIndex.reset();
+    m_Source.reset();
+
+    std::tie(m_Source, m_SourceIndex) = load(source, mode);
+    sanity_check_registry();
+}
+
+void gpp::patcher::load_destination(const std::filesystem::path& dest, load_mode mode)
+{
+    if (!std::filesystem::is_regular_file(dest))
+        error::raise("Destination file '{}' is not a valid regular file.", dest);
+
+    clear_damage();
+    m_KeyLUT.clear();
+    m_Unchanged.clear();
+    m_PendingFingerprints.clear();
+    m_AppliedFingerprints.clear();
+    m_ReferenceGraph.reset();
+    m_DestinationIndex.reset();
+    m_Destination.reset();
+
+    // Nothing is left that needs the objects we moved out of old sources.
+    m_Lenders.clear();
+    m_LentSource = false;
+
+    std::tie(m_Destination, m_DestinationIndex) = load(dest, mode);
+    sanity_check_registry();
+}
+
+std::vector<std::shared_ptr<plResManager>> gpp::patcher::lenders() const
+{
+    std::vector<std::shared_ptr<plResManager>> result;
+    for (const auto& [mgr, index] : m_Lenders)
+        result.push_back(mgr);
+    if (m_LentSource)
+        result.push_back(m_Source);
+    return result;
+}
+
 void gpp::patcher::sanity_check_registry() const
 {
-    plDebug::Debug("Checking if merge environment is sane...");
+    trace::scope scope("sanity_check_registry");
+    log::debug("Checking if merge environment is sane...");
 
     if (!m_Source || !m_Destination)
         error::raise("WTF? ResManagers are null?!?!");
@@ -83,7 +157,7 @@ void gpp::patcher::sanity_check_registry() const
         }
     }
 
-    plDebug::Debug("... patch environment is grinning and holding a spatula.");
+    log::debug("... patch environment is grinning and holding a spatula.");
 }
 
 // ===========================================================================
@@ -91,6 +165,8 @@ void gpp::patcher::sanity_check_registry() const
 plKey gpp::patcher::find_named_key(const plLocation& loc, uint16_t classType, const ST::string& name,
                                    const std::vector<plKey>& haystack) const
 {
+    trace::scope scope("find_named_key", name);
+
     plKey result;
     auto findIt = std::find_if(haystack.begin(), haystack.end(),
         [&loc, classType, &name](const plKey& i) {
@@ -101,6 +177,8 @@ plKey gpp::patcher::find_named_key(const plLocation& loc, uint16_t classType, co
     );
     if (findIt != haystack.end())
         result = *findIt;
+    stats::add(stats::counter::e_keys_scanned,
+               std::distance(haystack.begin(), findIt) + (findIt != haystack.end() ? 1 : 0));
     return result;
 }
 
@@ -121,6 +199,7 @@ plKey gpp::patcher::find_named_key(const plLocation& loc, uint16_t classType, co
 plKey gpp::patcher::find_homologous_key(const plKey& needle,
                                         const std::function<bool(const plKey&, const plKey&)> func)
 {
+    trace::scope scope("find_homologous_key", needle->getName());
     auto dstKeys = m_Destination->getKeys(needle->getLocation(), needle->getType());
 
     plKey dstKey = find_homologous_key(needle, dstKeys);
@@ -129,9 +208,18 @@ plKey gpp::patcher::find_homologous_key(const plKey& needle,
             return dstKey;
     }
 
+    // When only part of the destination is loaded, references to the other pages can
+    // still be resolved by name.
+    if (!dstKey.Exists() && m_References && !m_Destination->FindPage(needle->getLocation())) {
+        dstKey = m_References->resolve(m_Destination.get(), needle->getLocation(),
+                                       needle->getType(), needle->getName());
+        if (dstKey.Exists() && (!func || func(needle, dstKey)))
+            return dstKey;
+    }
+
     // now we ask external code for key name suggestions until they stop giving us any.
     if (!m_MapFunc) {
-        plDebug::Error("  -> Cannot map [{}] '{}' to another key - no function available",
+        log::error("  -> Cannot map [{}] '{}' to another key - no function available",
             plFactory::ClassName(needle->getType()), needle->getName());
         return dstKey;
     }
@@ -139,19 +227,20 @@ plKey gpp::patcher::find_homologous_key(const plKey& needle,
     do {
         plKey suggestion = map_homologous_key(needle, dstKeys);
         if (!suggestion.Exists()) {
-            plDebug::Error("  -> No match available for [{}] '{}'",
+            log::error("  -> No match available for [{}] '{}'",
                 plFactory::ClassName(needle->getType()), needle->getName());
             break;
         }
 
-        plDebug::Debug("  -> Trying suggested override for [{}] '{}' -> '{}'",
+        log::debug("  -> Trying suggested override for [{}] '{}' -> '{}'",
             plFactory::ClassName(needle->getType()),
             needle->getName(), suggestion->getName());
         if (!func || (func && func(needle, suggestion))) {
             m_KeyLUT[needle] = suggestion;
+            events::remap(needle, suggestion);
             break;
         } else {
-            plDebug::Error("  -> Iterator rejected suggested override for [{}] '{}' -> '{}'",
+            log::error("  -> Iterator rejected suggested override for [{}] '{}' -> '{}'",
                 plFactory::ClassName(needle->getType()),
                 needle->getName(), suggestion->getName());
             continue;
@@ -166,6 +255,7 @@ plKey gpp::patcher::find_homologous_key(const plKey& needle,
 plKey gpp::patcher::find_homologous_key(const plKey& needle,
                                         const std::vector<plKey>& haystack)
 {
+    trace::scope scope("find_homologous_key", needle->getName());
     plKey result = find_named_key(needle->getLocation(), needle->getType(), needle->getName(), haystack);
     if (result.Exists())
         return result;
@@ -173,8 +263,9 @@ plKey gpp::patcher::find_homologous_key(const plKey& needle,
     // either the key was rejected by the iterator OR we just couldn't find it. so check the LUT
     // and the finder.
     auto lutIt = m_KeyLUT.find(needle);
+    stats::add(lutIt != m_KeyLUT.end() ? stats::counter::e_lut_hits : stats::counter::e_lut_misses);
     if (lutIt != m_KeyLUT.end()) {
-        plDebug::Debug("  -> Using cached key override for [{}] '{}' -> '{}'",
+        log::debug("  -> Using cached key override for [{}] '{}' -> '{}'",
             plFactory::ClassName(needle->getType()),
             needle->getName(), lutIt->second->getName());
         result = lutIt->second;
@@ -188,21 +279,57 @@ plKey gpp::patcher::map_homologous_key(const plKey& needle,
 {
     plKey result;
     if (m_MapFunc) {
+        trace::scope scope("map_homologous_key", needle->getName());
+        stats::add(stats::counter::e_map_prompts);
         result = m_MapFunc(needle, haystack);
         if (!result.Exists()) {
-            plDebug::Error("  -> No match available for [{}] '{}'",
+            log::error("  -> No match available for [{}] '{}'",
                 plFactory::ClassName(needle->getType()), needle->getName());
         }
     }
     return result;
 }
 
+plKey gpp::patcher::planned_key(const plKey& needle)
+{
+    plKey result = find_homologous_key(needle, m_Destination->getKeys(needle->getLocation(), needle->getType()));
+    if (!result.Exists() && m_References && !m_Destination->FindPage(needle->getLocation())) {
+        result = m_References->resolve(m_Destination.get(), needle->getLocation(),
+                                       needle->getType(), needle->getName());
+    }
+    return result;
+}
+
+void gpp::patcher::plan_key(edit_plan& plan, const plKey& needle)
+{
+    if (!needle.Exists())
+        return;
+
+    // This may only record a prompted answer in the LUT, so look again afterward.
+    (void)find_homologous_key(needle);
+    plKey result = planned_key(needle);
+    if (result.Exists())
+        plan.map_key(needle, result);
+}
+
 void gpp::patcher::iterate_keys(uint16_t classType,
-                                const std::function<bool(const plKey&, const plKey&)> iter)
+                                const std::function<bool(const plKey&, const plKey&)> iter,
+                                const std::function<bool(const plKey&)> filter)
 {
+    trace::scope scope("iterate_keys", plFactory::ClassName(classType));
+    if (m_Progress) {
+        size_t total = 0;
+        for (const auto& loc : m_Source->getLocations())
+            total += m_Source->getKeys(loc, classType).size();
+        begin_progress(plFactory::ClassName(classType), total);
+    }
+
     for (const auto& loc : m_Source->getLocations()) {
         auto srcKeys = m_Source->getKeys(loc, classType);
         for (const auto& i : srcKeys) {
+            step_progress();
+            if (filter && !filter(i))
+                continue;
             (void)find_homologous_key(i, iter);
         }
     }
@@ -210,6 +337,79 @@ void gpp::patcher::iterate_keys(uint16_t classType,
 
 // ===========================================================================
 
+void gpp::patcher::load_fingerprints(const std::filesystem::path& path)
+{
+    log::debug("Loading fingerprints...");
+    m_Fingerprints.emplace();
+    m_Fingerprints->load(path);
+    m_Unchanged.clear();
+    m_PendingFingerprints.clear();
+    m_AppliedFingerprints.clear();
+}
+
+void gpp::patcher::save_fingerprints(const std::filesystem::path& path)
+{
+    if (m_Fingerprints) {
+        // The destination objects are hashed as they are now, after patching, so that
+        // anybody else changing them later on is noticed by the next run.
+        log::debug("Saving fingerprints to '{}'...", path);
+        for (const auto& [srcKey, dstKey] : m_AppliedFingerprints)
+            m_Fingerprints->record(srcKey, fingerprint_pair(srcKey, dstKey));
+        m_AppliedFingerprints.clear();
+        m_Fingerprints->save(path);
+    }
+}
+
+gpp::hash_t gpp::patcher::fingerprint_pair(const plKey& srcKey, const plKey& dstKey) const
+{
+    hasher hash;
+    hash.update(fingerprint_scene_object(m_Source.get(), get_object<plSceneObject>(srcKey)));
+    hash.update(fingerprint_scene_object(m_Destination.get(), get_object<plSceneObject>(dstKey)));
+    hash.update(m_Passes);
+    return hash.digest();
+}
+
+bool gpp::patcher::is_unchanged(const plKey& srcKey)
+{
+    // Both the collision and drawable passes ask, so only hash once.
+    auto it = m_Unchanged.find(srcKey);
+    if (it != m_Unchanged.end())
+        return it->second;
+
+    // Only objects that can be matched without asking anybody can be skipped.
+    plKey dstKey = find_homologous_key(srcKey, m_Destination->getKeys(srcKey->getLocation(), srcKey->getType()));
+    bool unchanged = dstKey.Exists() && m_Fingerprints->matches(srcKey, fingerprint_pair(srcKey, dstKey));
+    if (unchanged)
+        log::debug("  -> Skipping '{}', which is unchanged since the last run", srcKey->getName());
+    else if (dstKey.Exists())
+        m_PendingFingerprints[srcKey] = dstKey;
+    m_Unchanged[srcKey] = unchanged;
+    return unchanged;
+}
+
+bool gpp::patcher::is_identical_physical(const plSceneObject* srcSO, const plSceneObject* dstSO) const
+{
+    auto srcSimIface = get_object<plSimulationInterface>(srcSO->getSimInterface());
+    auto dstSimIface = get_object<plSimulationInterface>(dstSO->getSimInterface());
+    if (!srcSimIface->getPhysical().Exists() || !dstSimIface->getPhysical().Exists())
+        return false;
+
+    auto src = get_object<plGenericPhysical>(srcSimIface->getPhysical());
+    auto dst = get_object<plGenericPhysical>(dstSimIface->getPhysical());
+    return fingerprint_physical(src) == fingerprint_physical(dst);
+}
+
+bool gpp::patcher::is_identical_drawable(const plSceneObject* srcSO, const plSceneObject* dstSO) const
+{
+    // Hashing the packed spans means nothing has to be unpacked just to find out.
+    auto src = get_object<plDrawInterface>(srcSO->getDrawInterface());
+    auto dst = get_object<plDrawInterface>(dstSO->getDrawInterface());
+    hash_t srcHash = fingerprint_geometry(src);
+    return srcHash != 0 && srcHash == fingerprint_geometry(dst);
+}
+
+// ===========================================================================
+
 namespace
 {
     class override_map_func
@@ -266,44 +466,212 @@ namespace
 
 // ===========================================================================
 
-void gpp::patcher::process_collision()
+plKey gpp::patcher::suggest_collision_key(const plKey& srcKey, const std::vector<plKey>& keys) const
+{
+    // This is a common ZLZ replacement for us to check before prompting.
+    stats::add(stats::counter::e_rename_rules);
+    return find_named_key(
+        srcKey->getLocation(),
+        srcKey->getType(),
+        srcKey->getName(),
+        "_COLLISION_001"_st,
+        keys
+    );
+}
+
+plKey gpp::patcher::suggest_drawable_key(const plKey& srcKey, const std::vector<plKey>& keys) const
+{
+    static const std::regex materialRegex(R"(^(?:m_)(\d+)(.+)?$)");
+    static const std::regex lightmapRegex("_LM$");
+
+    plKey result;
+    if (srcKey->getType() == kSceneObject || srcKey->getType() == kDrawInterface) {
+        stats::add(stats::counter::e_rename_rules);
+        result = find_named_key(
+            srcKey->getLocation(),
+            srcKey->getType(),
+            srcKey->getName(),
+            "_DRAW_001"_st,
+            keys
+        );
+        if (result.Exists())
+            return result;
+    }
+
+    // ZLZ does these translations unambiguously, so they should be safe.
+    const auto& ogname = srcKey->getName();
+    auto rename = ST_regex_replace(materialRegex, ogname, "Material #$01$02");
+    stats::add(stats::counter::e_rename_rules);
+    result = find_named_key(
+        srcKey->getLocation(),
+        srcKey->getType(),
+        rename,
+        keys
+    );
+    if (result.Exists())
+        return result;
+
+    rename = ST_regex_replace(lightmapRegex, rename, "_LIGHTMAPGEN");
+    stats::add(stats::counter::e_rename_rules);
+    result = find_named_key(
+        srcKey->getLocation(),
+        srcKey->getType(),
+        rename,
+        keys
+    );
+    if (result.Exists())
+        return result;
+
+    // There are other possibilities for replacement checking, but those might be
+    // fairly difficult to handle. For now, bail out and wait for users to complain
+    // about patterns that we could match.
+    return result;
+}
+
+// ===========================================================================
+
+gpp::edit_plan gpp::patcher::plan_collision()
 {
-    plDebug::Debug("Processing colliders...");
+    log::debug("Planning colliders...");
+    trace::scope scope("plan_collision");
 
     override_map_func keyHelper(
         this,
         [this](const plKey& srcKey, const std::vector<plKey>& keys) {
-            // This is a common ZLZ replacement for us to check before prompting.
-            return find_named_key(
-                srcKey->getLocation(),
-                srcKey->getType(),
-                srcKey->getName(),
-                "_COLLISION_001"_st,
-                keys
-            );
+            return suggest_collision_key(srcKey, keys);
         }
     );
 
+    edit_plan plan;
     iterate_objects<plSceneObject>(
-        [this](const plSceneObject* srcSO, plSceneObject* dstSO) {
+        [this, &plan](const plSceneObject* srcSO, plSceneObject* dstSO) {
         if (!srcSO->getSimInterface().Exists() && !dstSO->getSimInterface().Exists())
             return true;
 
-        // Was the physical deleted?
         if (!srcSO->getSimInterface().Exists() && dstSO->getSimInterface().Exists()) {
-            plDebug::Debug("  -> Deleting '{}' collision...", dstSO->getKey()->getName());
+            plan.add(edit_op::e_delete_physical, srcSO->getKey(), dstSO->getKey());
+        } else if (srcSO->getSimInterface().Exists() && dstSO->getSimInterface().Exists()) {
+            if (is_identical_physical(srcSO, dstSO)) {
+                log::debug("  -> '{}' collision is already up to date", dstSO->getKey()->getName());
+                stats::add(stats::counter::e_physicals_unchanged);
+                return true;
+            }
+            plan.add(edit_op::e_replace_physical, srcSO->getKey(), dstSO->getKey());
+        } else {
+            auto simIface = get_object<plSimulationInterface>(srcSO->getSimInterface());
+            auto phys = get_object<plGenericPhysical>(simIface->getPhysical());
+            plan_key(plan, phys->getSubWorld());
+            plan_key(plan, phys->getSoundGroup());
+            plan.add(edit_op::e_move_key, simIface->getKey(), dstSO->getKey());
+            plan.add(edit_op::e_move_key, phys->getKey(), dstSO->getKey());
+            plan.add(edit_op::e_add_physical, srcSO->getKey(), dstSO->getKey());
+        }
+        return true;
+    }
+    );
+
+    // Any answers given to the map function while matching SceneObjects go in too.
+    for (const auto& [srcKey, dstKey] : m_KeyLUT)
+        plan.map_key(srcKey, dstKey);
+    return plan;
+}
+
+gpp::edit_plan gpp::patcher::plan_drawables()
+{
+    log::debug("Planning drawables...");
+    trace::scope scope("plan_drawables");
+
+    override_map_func keyHelper(
+        this,
+        [this](const plKey& srcKey, const std::vector<plKey>& keys) {
+            return suggest_drawable_key(srcKey, keys);
+        }
+    );
+
+    edit_plan plan;
+    iterate_objects<plSceneObject>(
+        [this, &plan](const plSceneObject* srcSO, plSceneObject* dstSO) -> bool {
+            if (srcSO->getDrawInterface().Exists() && dstSO->getDrawInterface().Exists()) {
+                // Leaving identical objects alone keeps their DSpans from being unpacked.
+                if (is_identical_drawable(srcSO, dstSO)) {
+                    log::debug("  -> '{}' drawable is already up to date", dstSO->getKey()->getName());
+                    stats::add(stats::counter::e_drawables_unchanged);
+                    return true;
+                }
+                for (const auto& key : span_hacker::mapped_keys(srcSO->getDrawInterface()))
+                    plan_key(plan, key);
+                plan.add(edit_op::e_replace_spans, srcSO->getKey(), dstSO->getKey());
+            }
+            return true;
+        }
+    );
+
+    for (const auto& [srcKey, dstKey] : m_KeyLUT)
+        plan.map_key(srcKey, dstKey);
+    return plan;
+}
+
+gpp::edit_plan gpp::patcher::plan(bool colliders, bool drawables)
+{
+    // The fingerprints depend on which passes ran, so a run with fewer passes doesn't
+    // cause a later run with more of them to skip anything.
+    m_Passes = (colliders ? 1 : 0) | (drawables ? 2 : 0);
+    m_Unchanged.clear();
+    m_PendingFingerprints.clear();
+
+    edit_plan result;
+    if (colliders)
+        result.append(plan_collision());
+    if (drawables)
+        result.append(plan_drawables());
+    memory::mark_phase("plan");
+    return result;
+}
+
+// ===========================================================================
+
+void gpp::patcher::apply_physical(const edit& edit)
+{
+    const plSceneObject* srcSO = get_object<plSceneObject>(edit.m_Source);
+    plSceneObject* dstSO = get_object<plSceneObject>(edit.m_Destination);
+
+    switch (edit.m_Op) {
+    case edit_op::e_delete_physical:
+        {
+            log::debug("  -> Deleting '{}' collision...", dstSO->getKey()->getName());
             {
-                auto simIface = plSimulationInterface::Convert(dstSO->getSimInterface()->getObj());
-                m_Destination->DelObject(simIface->getPhysical());
-                m_Destination->DelObject(simIface->getKey());
+                auto simIface = get_object<plSimulationInterface>(dstSO->getSimInterface());
+
+                // Only SceneObjects hold sim interfaces and only sim interfaces hold physicals,
+                // so walking those two classes (which collision already read) finds every
+                // referrer the full graph would without deserializing the rest of the Age.
+                std::tuple<plKey, uint16_t> deleted[] = {
+                    { simIface->getKey(), kSceneObject },
+                    { simIface->getPhysical(), kSimulationInterface },
+                };
+                for (const auto& [key, referrerType] : deleted) {
+                    for (const auto& referrer : find_referrers(key, referrerType)) {
+                        if (referrer == dstSO->getKey() || referrer == simIface->getKey())
+                            continue;
+                        log::warning("  -> '{}' still references deleted '{}'",
+                                     referrer.toString(), key.toString());
+                    }
+                }
+                delete_object(simIface->getPhysical());
+                delete_object(simIface->getKey());
             }
             dstSO->setSimInterface(plKey());
-        } else if (srcSO->getSimInterface().Exists() && dstSO->getSimInterface().Exists()) {
-            plDebug::Debug("  -> Patching '{}' collision", dstSO->getKey()->getName());
-            auto srcSimIface = plSimulationInterface::Convert(srcSO->getSimInterface()->getObj());
-            auto dstSimIface = plSimulationInterface::Convert(dstSO->getSimInterface()->getObj());
-            auto src = plGenericPhysical::Convert(srcSimIface->getPhysical()->getObj());
-            auto dst = plGenericPhysical::Convert(dstSimIface->getPhysical()->getObj());
+            touch(dstSO->getKey());
+            events::object("delete_physical", edit.m_Source, edit.m_Destination);
+        }
+        break;
+    case edit_op::e_replace_physical:
+        {
+            log::debug("  -> Patching '{}' collision", dstSO->getKey()->getName());
+            auto srcSimIface = get_object<plSimulationInterface>(srcSO->getSimInterface());
+            auto dstSimIface = get_object<plSimulationInterface>(dstSO->getSimInterface());
+            auto src = get_object<plGenericPhysical>(srcSimIface->getPhysical());
+            auto dst = get_object<plGenericPhysical>(dstSimIface->getPhysical());
 
             // Note: these are not all the properties...
             dst->setMass(src->getMass());
@@ -317,102 +685,137 @@ void gpp::patcher::process_collision()
             dst->setLength(src->getLength());
             dst->setIndices(src->getIndices().size(), src->getIndices().data());
             dst->setVerts(src->getVerts().size(), src->getVerts().data());
-        } else if (srcSO->getSimInterface().Exists() && !dstSO->getSimInterface().Exists()) {
-            plDebug::Debug("  -> Adding collision to '{}' - be certain you are not spin washing colliders!",
+            touch(dst->getKey());
+            events::object("replace_physical", edit.m_Source, edit.m_Destination);
+        }
+        break;
+    case edit_op::e_add_physical:
+        {
+            log::debug("  -> Adding collision to '{}' - be certain you are not spin washing colliders!",
                 dstSO->getKey()->getName());
 
-            auto simIface = plSimulationInterface::Convert(srcSO->getSimInterface()->getObj());
-            auto phys = plGenericPhysical::Convert(simIface->getPhysical()->getObj());
+            auto simIface = get_object<plSimulationInterface>(srcSO->getSimInterface());
+            auto phys = get_object<plGenericPhysical>(simIface->getPhysical());
 
-            // Update all refs just to make sure...
-            m_Destination->MoveKey(simIface->getKey(), dstSO->getKey()->getLocation());
-            m_Destination->MoveKey(phys->getKey(), dstSO->getKey()->getLocation());
+            // The plan already moved the keys, so update all refs just to make sure...
             simIface->setOwner(dstSO->getKey());
             simIface->setPhysical(phys->getKey());
             phys->setObject(dstSO->getKey());
             phys->setSceneNode(m_Destination->getSceneNode(dstSO->getKey()->getLocation())->getKey());
             if (phys->getSubWorld().Exists())
-                phys->setSubWorld(find_homologous_key(phys->getSubWorld()));
+                phys->setSubWorld(planned_key(phys->getSubWorld()));
             if (phys->getSoundGroup().Exists())
-                phys->setSoundGroup(find_homologous_key(phys->getSoundGroup()));
+                phys->setSoundGroup(planned_key(phys->getSoundGroup()));
             dstSO->setSimInterface(simIface->getKey());
+            touch(simIface->getKey());
+            touch(phys->getKey());
+            touch(dstSO->getKey());
+            events::object("add_physical", edit.m_Source, edit.m_Destination);
         }
-
-        m_DirtyPages.insert(dstSO->getKey()->getLocation());
-        return true;
+        break;
+    default:
+        error::raise("WTF? '{}' is not a collision edit", edit_op_name(edit.m_Op));
     }
-    );
+
+    m_DirtyPages.insert(dstSO->getKey()->getLocation());
 }
 
-void gpp::patcher::process_drawables()
+void gpp::patcher::apply_move(const edit& edit)
 {
-    plDebug::Debug("Processing drawables...");
-
-    std::regex materialRegex(R"(^(?:m_)(\d+)(.+)?$)");
-    std::regex lightmapRegex("_LM$");
+    log::debug("  -> Moving [{}] '{}' into '{}'", plFactory::ClassName(edit.m_Source->getType()),
+                   edit.m_Source->getName(), edit.m_Destination->getLocation().toString());
+    m_Destination->MoveKey(edit.m_Source, edit.m_Destination->getLocation());
+    m_LentSource = true;
+    m_DirtyPages.insert(edit.m_Destination->getLocation());
+}
 
-    override_map_func keyHelper(
-        this,
-        [&](const plKey& srcKey, const std::vector<plKey>& keys) -> plKey {
-            plKey result;
-            if (srcKey->getType() == kSceneObject || srcKey->getType() == kDrawInterface) {
-                result = find_named_key(
-                    srcKey->getLocation(),
-                    srcKey->getType(),
-                    srcKey->getName(),
-                    "_DRAW_001"_st,
-                    keys
-                );
-                if (result.Exists())
-                    return result;
-            }
+void gpp::patcher::apply(const edit_plan& plan)
+{
+    log::debug("Applying {} edits...", plan.size());
 
-            // ZLZ does these translations unambiguously, so they should be safe.
-            const auto& ogname = srcKey->getName();
-            auto rename = ST_regex_replace(materialRegex, ogname, "Material #$01$02");
-            result = find_named_key(
-                srcKey->getLocation(),
-                srcKey->getType(),
-                rename,
-                keys
-            );
-            if (result.Exists())
-                return result;
-
-            rename = ST_regex_replace(lightmapRegex, rename, "_LIGHTMAPGEN");
-            result = find_named_key(
-                srcKey->getLocation(),
-                srcKey->getType(),
-                rename,
-                keys
-            );
-            if (result.Exists())
-                return result;
-
-            // There are other possibilities for replacement checking, but those might be
-            // fairly difficult to handle. For now, bail out and wait for users to complain
-            // about patterns that we could match.
-            return result;
-        }
-    );
+    // Everything the map function was asked while planning is answered by the plan now.
+    for (const auto& i : plan.edits()) {
+        if (i.m_Op == edit_op::e_map_key)
+            m_KeyLUT[i.m_Source] = i.m_Destination;
+    }
 
-    span_hacker geom(m_Source, m_Destination);
-    geom.set_map_func(
-        [this](const plKey& obj) -> plKey {
-            return find_homologous_key(obj);
+    auto isPhysical = [](const edit& i) {
+        return i.m_Op != edit_op::e_replace_spans && i.m_Op != edit_op::e_map_key;
+    };
+    bool hasSpans = std::any_of(plan.edits().begin(), plan.edits().end(),
+                                [](const edit& i) { return i.m_Op == edit_op::e_replace_spans; });
+    bool hasPhysicals = std::any_of(plan.edits().begin(), plan.edits().end(), isPhysical);
+
+    // Physicals are independent of one another, so just do them in order.
+    if (hasPhysicals) {
+        trace::scope scope("apply_physicals");
+        begin_progress("Patching collision", std::count_if(plan.edits().begin(), plan.edits().end(), isPhysical));
+        for (const auto& i : plan.edits()) {
+            if (!isPhysical(i))
+                continue;
+            step_progress();
+            if (i.m_Op == edit_op::e_move_key)
+                apply_move(i);
+            else
+                apply_physical(i);
         }
-    );
-
-    iterate_objects<plSceneObject>(
-        [this, &geom](const plSceneObject* srcSO, plSceneObject* dstSO) -> bool {
-            if (!srcSO->getDrawInterface().Exists() || !dstSO->getDrawInterface().Exists())
-                return true;
+        memory::mark_phase("process_collision");
+    }
 
-            plDebug::Debug("  -> Patching '{}' drawable", dstSO->getKey()->getName());
+    // All span replacements go through one span_hacker so each DSpan is only
+    // unpacked and packed once, no matter how many objects use it.
+    if (hasSpans) {
+        trace::scope scope("apply_spans");
+        span_hacker geom(m_Source, m_Destination);
+        geom.set_map_func(
+            [this](const plKey& obj) -> plKey {
+                return planned_key(obj);
+            }
+        );
+        geom.set_touch_func([this](const plKey& obj) { touch(obj); });
+        geom.set_referrers_func(
+            [this](const plKey& obj, uint16_t classType) {
+                return find_referrers(obj, classType);
+            }
+        );
+        geom.set_progress(m_Progress);
+
+        begin_progress("Patching drawables",
+                       std::count_if(plan.edits().begin(), plan.edits().end(),
+                                     [](const edit& i) { return i.m_Op == edit_op::e_replace_spans; }));
+        for (const auto& i : plan.edits()) {
+            if (i.m_Op != edit_op::e_replace_spans)
+                continue;
+            step_progress();
+
+            const plSceneObject* srcSO = get_object<plSceneObject>(i.m_Source);
+            plSceneObject* dstSO = get_object<plSceneObject>(i.m_Destination);
+            log::debug("  -> Patching '{}' drawable", dstSO->getKey()->getName());
             geom.overwrite_spans(srcSO->getDrawInterface(), dstSO->getDrawInterface());
 
             m_DirtyPages.insert(dstSO->getKey()->getLocation());
-            return true;
         }
-    );
+        memory::mark_phase("process_drawables");
+    }
+
+    // The span hacker packs the dirty spans back up as it goes away, but it can only stop
+    // early when cancelled, so this is where we find out about it.
+    if (hasSpans) {
+        memory::mark_phase("cleanup");
+        check_progress();
+    }
+
+    // Nothing gets fingerprinted until it has actually been patched.
+    m_AppliedFingerprints.insert(m_PendingFingerprints.begin(), m_PendingFingerprints.end());
+    m_PendingFingerprints.clear();
+}
+
+void gpp::patcher::process_collision()
+{
+    apply(plan_collision());
+}
+
+void gpp::patcher::process_drawables()
+{
+    apply(plan_drawables());
 }
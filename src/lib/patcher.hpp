@@ -21,19 +21,33 @@
 
 #include <ResManager/plResManager.h>
 
+#include "class_traits.hpp"
+#include "fingerprint.hpp"
+#include "object_index.hpp"
+#include "plan.hpp"
+
 #include <filesystem>
 #include <functional>
 #include <map>
 #include <memory>
+#include <optional>
 #include <set>
 #include <tuple>
+#include <type_traits>
+#include <vector>
 
+class hsRAMStream;
 class plAgeInfo;
 class plGenericPhysical;
 class plPageInfo;
+class plSceneObject;
 
 namespace gpp
 {
+    class progress;
+    class reference_catalog;
+    class reference_graph;
+
     using object_mapping_func = std::function<plKey(const plKey&, const std::vector<plKey>&)>;
 
     class patcher_base
@@ -41,7 +55,12 @@ namespace gpp
     protected:
         std::shared_ptr<plResManager> m_Destination;
         std::shared_ptr<plResManager> m_Source;
+        std::shared_ptr<object_index> m_DestinationIndex;
+        std::shared_ptr<object_index> m_SourceIndex;
         std::set<plLocation> m_DirtyPages;
+        std::set<plKey> m_DirtyObjects;
+        std::shared_ptr<progress> m_Progress;
+        std::shared_ptr<reference_graph> m_ReferenceGraph;
 
     protected:
         patcher_base() = default;
@@ -49,17 +68,79 @@ namespace gpp
         patcher_base(patcher_base&&) = delete;
         ~patcher_base() = default;
 
+    public:
+        /** Reads an age or page into a new registry along with its object index. */
+        static std::tuple<std::shared_ptr<plResManager>, std::shared_ptr<object_index>>
+        load(const std::filesystem::path& file, load_mode mode = load_mode::e_full);
+
     protected:
-        std::shared_ptr<plResManager> load(const std::filesystem::path& file) const;
+        void materialize(std::initializer_list<uint16_t> classTypes) const;
+
+        /** Marks an object as modified so it will be reencoded when saved. */
+        void touch(const plKey& key);
+
+        /** Deletes an object from the destination registry. */
+        void delete_object(const plKey& key);
+
+        /**
+         * The reverse references in the destination registry. This is built from the objects
+         * in memory the first time it is needed and kept up to date by touch() and
+         * delete_object() after that.
+         */
+        const reference_graph& get_reference_graph();
+
+        /**
+         * The destination objects of exactly \a classType that reference \a key. Unless the
+         * whole reference graph has been built, only that class is walked, once.
+         */
+        [[nodiscard]]
+        std::vector<plKey> find_referrers(const plKey& key, uint16_t classType);
+
         void sanity_check_paths(const std::filesystem::path& source, const std::filesystem::path& dest) const;
 
+        void begin_progress(const ST::string& phase, size_t total) const;
+
+        /** \throws gpp::cancelled if somebody asked us to stop. */
+        void step_progress(size_t count = 1) const;
+        void check_progress() const;
+
     private:
         void save_age(const std::filesystem::path& agePath) const;
-        void save_page(const plLocation& loc, const std::filesystem::path& pagePath) const;
-        void save_page(plPageInfo* page, const std::filesystem::path& pagePath) const;
+        std::tuple<bool, size_t> save_page(const plLocation& loc, const std::filesystem::path& pagePath) const;
+        std::tuple<bool, size_t> save_page(plPageInfo* page, const std::filesystem::path& pagePath,
+                                           const std::unique_ptr<hsRAMStream>& stream) const;
+
+        /**
+         * Encodes pages, passing through as many objects as possible. If writing a page gives
+         * its keys new object IDs, everything that refers to it is encoded again.
+         */
+        std::vector<std::unique_ptr<hsRAMStream>> encode_pages(const std::vector<plPageInfo*>& pages) const;
+        std::unique_ptr<hsRAMStream> encode_page(plPageInfo* page, const std::set<plLocation>& changedPages) const;
+        std::set<plLocation> changed_pages() const;
+        void reindex_page(const plLocation& loc, const std::filesystem::path& pagePath) const;
 
     public:
+        /** Reports progress to and takes cancellation requests from a token. */
+        void set_progress(std::shared_ptr<progress> token) { m_Progress = std::move(token); }
+
+        [[nodiscard]]
+        bool has_damage() const { return !m_DirtyPages.empty(); }
+
+        /** Forgets about the damage once it has been saved so the registry can be patched again. */
+        void clear_damage()
+        {
+            m_DirtyPages.clear();
+            m_DirtyObjects.clear();
+        }
+
         void save_damage(const std::filesystem::path& source, const std::filesystem::path& dest) const;
+
+        /** The files the destination pages were last read from or written to. */
+        [[nodiscard]]
+        std::set<std::filesystem::path> destination_files() const;
+
+        /** Saves only the objects that changed instead of full pages. */
+        void save_delta(const std::filesystem::path& deltaPath) const;
     };
 
     /**
@@ -70,23 +151,48 @@ namespace gpp
     protected:
         std::map<plKey, plKey> m_KeyLUT;
         object_mapping_func m_MapFunc;
+        std::optional<fingerprint_cache> m_Fingerprints;
+        std::map<plKey, bool> m_Unchanged;
+        std::map<plKey, plKey> m_PendingFingerprints;
+        std::map<plKey, plKey> m_AppliedFingerprints;
+        uint8_t m_Passes{ 3 };
+        bool m_LentSource{ false };
+        std::vector<std::tuple<std::shared_ptr<plResManager>, std::shared_ptr<object_index>>> m_Lenders;
+        std::shared_ptr<const reference_catalog> m_References;
 
     public:
         patcher() = delete;
-        patcher(const std::filesystem::path& source, const std::filesystem::path& dest);
+        patcher(const std::filesystem::path& source, const std::filesystem::path& dest,
+                load_mode mode = load_mode::e_full);
+
+        /** Patches between registries that were already loaded by patcher_base::load(). */
+        patcher(std::shared_ptr<plResManager> source, std::shared_ptr<object_index> sourceIndex,
+                std::shared_ptr<plResManager> dest, std::shared_ptr<object_index> destIndex);
         ~patcher() = default;
 
         void sanity_check_registry() const;
 
-    private:
-        template<typename T>
+        /**
+         * Replaces the source registry but keeps the destination and its damage, so many
+         * sources can be patched into one destination that is only loaded and saved once.
+         */
+        void load_source(const std::filesystem::path& source, load_mode mode = load_mode::e_full);
+
+        /**
+         * The source registries that objects were moved out of and into the destination.
+         * They still own those objects, so they must outlive the destination.
+         */
         [[nodiscard]]
-        uint16_t hack_determine_classID() const
-        {
-            // I hate this.
-            return std::make_unique<T>()->ClassIndex();
-        }
+        std::vector<std::shared_ptr<plResManager>> lenders() const;
+
+        /**
+         * Throws away the destination registry, along with its damage, and reads it from
+         * disk again. Use this when patching failed partway through. Anything that was
+         * moved out of the current source goes with it, so reload the source too.
+         */
+        void load_destination(const std::filesystem::path& dest, load_mode mode = load_mode::e_full);
 
+    private:
         [[nodiscard]]
         plKey find_named_key(const plLocation& loc, uint16_t classType, const ST::string& name,
                              const std::vector<plKey>& haystack) const;
@@ -105,30 +211,125 @@ namespace gpp
         [[nodiscard]]
         plKey map_homologous_key(const plKey& needle, const std::vector<plKey>& haystack) const;
 
-        void iterate_keys(uint16_t classType, const std::function<bool(const plKey&, const plKey&)> iter);
+        /** Resolves a key by name or from the mappings decided while planning. Never prompts. */
+        [[nodiscard]]
+        plKey planned_key(const plKey& needle);
+
+        /** Resolves a key, prompting if needed, and records the answer in the plan. */
+        void plan_key(edit_plan& plan, const plKey& needle);
+
+        [[nodiscard]]
+        plKey suggest_collision_key(const plKey& srcKey, const std::vector<plKey>& keys) const;
+
+        [[nodiscard]]
+        plKey suggest_drawable_key(const plKey& srcKey, const std::vector<plKey>& keys) const;
+
+        void iterate_keys(uint16_t classType, const std::function<bool(const plKey&, const plKey&)> iter,
+                          const std::function<bool(const plKey&)> filter = {});
+
+        /**
+         * Checks if a source SceneObject and its destination are both exactly as the last
+         * run left them, with the same passes enabled.
+         */
+        [[nodiscard]]
+        bool is_unchanged(const plKey& srcKey);
+
+        [[nodiscard]]
+        hash_t fingerprint_pair(const plKey& srcKey, const plKey& dstKey) const;
+
+        /** Checks if patching a destination object's collision would leave it exactly as it is. */
+        [[nodiscard]]
+        bool is_identical_physical(const plSceneObject* srcSO, const plSceneObject* dstSO) const;
+
+        /** Checks if the destination object already draws the same geometry with the same materials. */
+        [[nodiscard]]
+        bool is_identical_drawable(const plSceneObject* srcSO, const plSceneObject* dstSO) const;
+
+        template<typename T>
+        [[nodiscard]]
+        T* get_object(const plKey& key) const
+        {
+            return T::Convert(object_index::resolve(key));
+        }
 
         template<typename T>
         void iterate_objects(const std::function<bool(const T*, T*)> iter)
         {
-            iterate_keys(hack_determine_classID<T>(),
+            // Deserializing the whole class up front is cheaper than doing it one key at a time.
+            constexpr uint16_t classType = class_traits<T>::index;
+            materialize({ classType });
+
+            // Incremental patching means skipping everything that hasn't changed since last time.
+            std::function<bool(const plKey&)> filter;
+            if constexpr (std::is_same_v<T, plSceneObject>) {
+                if (m_Fingerprints)
+                    filter = [this](const plKey& src) { return !is_unchanged(src); };
+            }
+
+            iterate_keys(classType,
                 [&iter](const plKey& src, const plKey& dst) {
-                return iter(T::Convert(src->getObj()), T::Convert(dst->getObj()));
-            });
+                return iter(T::Convert(object_index::resolve(src)), T::Convert(object_index::resolve(dst)));
+            }, filter);
         }
 
     public:
         void set_map_func(object_mapping_func func) { m_MapFunc = std::move(func); }
 
+        /** Resolves references to destination pages that were not loaded into this patcher. */
+        void set_references(std::shared_ptr<const reference_catalog> references) { m_References = std::move(references); }
+
+        /**
+         * Only patch SceneObjects whose source or destination fingerprint differs from the
+         * one recorded by the previous run in the given file.
+         */
+        void load_fingerprints(const std::filesystem::path& path);
+
+        /**
+         * Records the fingerprints of everything that was applied. Only call this once the
+         * damage has been saved, or the next run will skip objects that were never written.
+         */
+        void save_fingerprints(const std::filesystem::path& path);
+
+        /**
+         * Decides what needs to change without modifying either registry. Keys that can't
+         * be matched are still resolved with the map function during planning.
+         */
+        [[nodiscard]]
+        edit_plan plan_collision();
+
+        [[nodiscard]]
+        edit_plan plan_drawables();
+
+        [[nodiscard]]
+        edit_plan plan(bool colliders = true, bool drawables = true);
+
+        /** Loads a plan saved by an earlier run against these same registries. */
+        [[nodiscard]]
+        edit_plan load_plan(const std::filesystem::path& path) const
+        {
+            return edit_plan::load(path, m_Source.get(), m_Destination.get());
+        }
+
+        /**
+         * Makes the changes in the plan to the destination registry. Keys are only resolved
+         * by name or from the plan's mappings, so this never calls the map function.
+         */
+        void apply(const edit_plan& plan);
+
         void process_collision();
         void process_drawables();
+
+    private:
+        void apply_physical(const edit& edit);
+        void apply_move(const edit& edit);
     };
 
     /**
-     * Merges the contents of one registry into another.
+     * Merges the contents of one or more registries into another.
      */
     class merger : public patcher_base
     {
-        plLocation m_SourcePage;
+        std::vector<plLocation> m_SourcePages;
         plLocation m_DestinationPage;
         std::filesystem::path m_ParentPath;
 
@@ -136,11 +337,20 @@ namespace gpp
         plLocation load_location(const std::filesystem::path& path, plResManager* mgr) const;
         void load_age(const std::filesystem::path& wd, plResManager* mgr) const;
 
+        [[nodiscard]]
+        bool is_source_page(const plLocation& loc) const;
+
         void merge_textures();
 
     public:
         merger() = delete;
         merger(const std::filesystem::path& source, const std::filesystem::path& dest);
+
+        /**
+         * Folds all of the source pages into the destination in one pass, so the geometry
+         * is only repacked and the Age only written once.
+         */
+        merger(const std::vector<std::filesystem::path>& sources, const std::filesystem::path& dest);
         ~merger() = default;
 
         void process();
@@ -15,32 +15,167 @@
  */
 
 #include "patcher.hpp"
+#include "delta.hpp"
 #include "errors.hpp"
+#include "events.hpp"
+#include "hash.hpp"
+#include "log.hpp"
+#include "memory.hpp"
+#include "progress.hpp"
+#include "reference_graph.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
-#include <Debug/plDebug.h>
+#include <algorithm>
+
+#include <ResManager/plAgeInfo.h>
 #include <ResManager/plResManager.h>
+#include <Stream/hsRAMStream.h>
+#include <Stream/hsStream.h>
 
 // ===========================================================================
 
-std::shared_ptr<plResManager> gpp::patcher_base::load(const std::filesystem::path& file) const
+namespace
+{
+    std::filesystem::path find_page_file(const std::filesystem::path& wd, const plAgeInfo* age,
+                                         size_t idx, PlasmaVer ver)
+    {
+        // The page filename depends on the Plasma version, which we don't know until
+        // the first page has been read. So, try every naming convention for this entry
+        // in the page list before giving up on it.
+        if (ver != PlasmaVer::pvUnknown)
+            return wd / age->getPageFilename(idx, ver).to_path();
+
+        for (auto guess : { PlasmaVer::pvPrime, PlasmaVer::pvPots, PlasmaVer::pvMoul,
+                            PlasmaVer::pvEoa, PlasmaVer::pvHex }) {
+            std::filesystem::path prp = wd / age->getPageFilename(idx, guess).to_path();
+            if (std::filesystem::is_regular_file(prp))
+                return prp;
+        }
+        return {};
+    }
+
+    void read_age_stubs(plResManager* mgr, const std::filesystem::path& file)
+    {
+        // Can't use ReadAge(..., true) here because it has no way to stub out the pages.
+        plAgeInfo* age = mgr->ReadAge(ST::string::from_path(file), false);
+        std::filesystem::path wd = file.parent_path();
+        for (size_t i = 0; i < age->getNumPages(); ++i) {
+            std::filesystem::path prp = find_page_file(wd, age, i, mgr->getVer());
+            if (std::filesystem::is_regular_file(prp))
+                mgr->ReadPage(ST::string::from_path(prp), true);
+            else
+                gpp::log::warning("  -> Page '{}' is listed in '{}' but could not be found",
+                                 age->getPage(i).fName, file);
+        }
+        for (size_t i = 0; i < age->getNumCommonPages(mgr->getVer()); ++i) {
+            std::filesystem::path prp = wd / age->getCommonPageFilename(i, mgr->getVer()).to_path();
+            if (std::filesystem::is_regular_file(prp))
+                mgr->ReadPage(ST::string::from_path(prp), true);
+        }
+    }
+};
+
+std::tuple<std::shared_ptr<plResManager>, std::shared_ptr<gpp::object_index>>
+gpp::patcher_base::load(const std::filesystem::path& file, load_mode mode)
 {
     auto mgr = std::make_shared<plResManager>();
+    auto index = std::make_shared<object_index>(mgr.get(), mode);
     ST::string stupidPath = ST::string::from_path(file);
     ST::string stupidExt = ST::string::from_path(file.extension());
+    bool stub = mode == load_mode::e_lazy;
+    trace::scope scope("load", stupidPath);
 
-    plDebug::Debug("Loading registry: {}", file);
+    log::debug("Loading registry: {}", file);
     if (stupidExt.compare_i(".age") == 0) {
-        plDebug::Debug("  -> Loading AGE");
+        log::debug("  -> Loading AGE{}", stub ? " (lazy)" : "");
         // not a memory leak...
-        mgr->ReadAge(stupidPath, true);
+        if (stub)
+            read_age_stubs(mgr.get(), file);
+        else
+            mgr->ReadAge(stupidPath, true);
+
+        std::filesystem::path wd = file.parent_path();
+        for (const auto& loc : mgr->getLocations()) {
+            plPageInfo* page = mgr->FindPage(loc);
+            index->add_page(loc, wd / page->getFilename(mgr->getVer()).to_path());
+        }
     } else if (stupidExt.compare_i(".prp") == 0) {
-        plDebug::Debug("  -> Loading PRP");
+        log::debug("  -> Loading PRP{}", stub ? " (lazy)" : "");
         // not a memory leak...
-        mgr->ReadPage(stupidPath, false);
+        plPageInfo* page = mgr->ReadPage(stupidPath, stub);
+        index->add_page(page->getLocation(), file);
     } else {
         gpp::error::raise("What the extension: {}???", stupidExt);
     }
-    return mgr;
+
+    memory::account_registry(file, mgr.get());
+    memory::mark_phase("load");
+    return std::make_tuple(mgr, index);
+}
+
+void gpp::patcher_base::begin_progress(const ST::string& phase, size_t total) const
+{
+    if (m_Progress)
+        m_Progress->begin(phase, total);
+}
+
+void gpp::patcher_base::step_progress(size_t count) const
+{
+    if (m_Progress)
+        m_Progress->step(count);
+}
+
+void gpp::patcher_base::check_progress() const
+{
+    if (m_Progress)
+        m_Progress->check();
+}
+
+// ===========================================================================
+
+void gpp::patcher_base::touch(const plKey& key)
+{
+    m_DirtyObjects.insert(key);
+    if (m_ReferenceGraph)
+        m_ReferenceGraph->update(key);
+}
+
+void gpp::patcher_base::delete_object(const plKey& key)
+{
+    if (m_ReferenceGraph)
+        m_ReferenceGraph->remove(key);
+    m_Destination->DelObject(key);
+}
+
+const gpp::reference_graph& gpp::patcher_base::get_reference_graph()
+{
+    if (!m_ReferenceGraph || !m_ReferenceGraph->complete()) {
+        log::debug("Building reference graph...");
+        m_ReferenceGraph = std::make_shared<reference_graph>(m_Destination.get());
+        memory::mark_phase("reference_graph");
+    }
+    return *m_ReferenceGraph;
+}
+
+std::vector<plKey> gpp::patcher_base::find_referrers(const plKey& key, uint16_t classType)
+{
+    // Reading one class is far cheaper than building the whole graph, but asking about
+    // every object means reading it just once.
+    if (!m_ReferenceGraph)
+        m_ReferenceGraph = std::make_shared<reference_graph>();
+    m_ReferenceGraph->walk(m_Destination.get(), classType);
+    return m_ReferenceGraph->referrers(key, classType);
+}
+
+// ===========================================================================
+
+void gpp::patcher_base::materialize(std::initializer_list<uint16_t> classTypes) const
+{
+    if (m_SourceIndex)
+        m_SourceIndex->materialize(classTypes);
+    if (m_DestinationIndex && m_DestinationIndex != m_SourceIndex)
+        m_DestinationIndex->materialize(classTypes);
 }
 
 // ===========================================================================
@@ -63,7 +198,7 @@ void gpp::patcher_base::sanity_check_paths(const std::filesystem::path& source,
 
 void gpp::patcher_base::save_damage(const std::filesystem::path& source, const std::filesystem::path& dest) const
 {
-    plDebug::Debug("Saving damage...");
+    log::debug("Saving damage...");
     if (m_DirtyPages.empty())
         error::raise("No damage is available to save.");
     sanity_check_paths(source, dest);
@@ -86,44 +221,179 @@ void gpp::patcher_base::save_damage(const std::filesystem::path& source, const s
     }
 #else
     std::filesystem::path wd = dest.parent_path();
+    size_t bytesWritten = 0, bytesSkipped = 0;
+    size_t pagesWritten = 0, pagesSkipped = 0;
     // TODO: maybe allow writing out just the dirty pages for pvPrime, pvPots
+    std::vector<plPageInfo*> pages;
     for (const auto& loc : m_Destination->getLocations()) {
-        plPageInfo* page = m_Destination->FindPage(loc);
-        if (page != nullptr)
-            save_page(page, wd / page->getFilename(m_Destination->getVer()).to_path());
+        if (plPageInfo* page = m_Destination->FindPage(loc))
+            pages.push_back(page);
     }
+
+    // Nothing goes to disk until every page has been encoded with its final object IDs.
+    auto streams = encode_pages(pages);
+    for (size_t i = 0; i < pages.size(); ++i) {
+        plPageInfo* page = pages[i];
+        auto [written, size] = save_page(page, wd / page->getFilename(m_Destination->getVer()).to_path(),
+                                         streams[i]);
+        if (written) {
+            bytesWritten += size;
+            ++pagesWritten;
+        } else {
+            bytesSkipped += size;
+            ++pagesSkipped;
+        }
+    }
+    log::debug("Wrote {} pages ({} bytes), skipped {} unchanged pages ({} bytes)",
+                   pagesWritten, bytesWritten, pagesSkipped, bytesSkipped);
 #endif
+    memory::mark_phase("save");
+}
+
+void gpp::patcher_base::save_delta(const std::filesystem::path& deltaPath) const
+{
+    log::debug("Saving damage as a delta...");
+    if (m_DirtyPages.empty())
+        error::raise("No damage is available to save.");
+    if (!m_DestinationIndex)
+        error::raise("WTF? No object index for the destination?");
+    write_delta(deltaPath, m_Destination.get(), *m_DestinationIndex, m_DirtyObjects);
+    memory::mark_phase("save_delta");
 }
 
 void gpp::patcher_base::save_age(const std::filesystem::path& agePath) const
 {
     // Only save the specific pages that have been damaged to prevent large deltas.
+    std::vector<plPageInfo*> pages;
     for (const auto& i : m_DirtyPages) {
         plPageInfo* page = m_Destination->FindPage(i);
         if (!page)
             error::raise("WTF: Could not find page '{}' in registry!", i.toString());
+        pages.push_back(page);
+    }
 
-        ST::string pageFn = page->getFilename(m_Destination->getVer());
+    auto streams = encode_pages(pages);
+    for (size_t i = 0; i < pages.size(); ++i) {
+        ST::string pageFn = pages[i]->getFilename(m_Destination->getVer());
         std::filesystem::path pagePath = agePath;
         pagePath.replace_filename(pageFn.to_path());
-        save_page(page, pagePath);
+        save_page(pages[i], pagePath, streams[i]);
     }
 }
 
-void gpp::patcher_base::save_page(const plLocation& loc, const std::filesystem::path& pagePath) const
+std::tuple<bool, size_t> gpp::patcher_base::save_page(const plLocation& loc,
+                                                      const std::filesystem::path& pagePath) const
 {
     plPageInfo* page = m_Destination->FindPage(loc);
     if (!page)
         error::raise("WTF: Could not find page '{}' in registry!", loc.toString());
-    save_page(page, pagePath);
+    auto streams = encode_pages({ page });
+    return save_page(page, pagePath, streams.front());
 }
 
-void gpp::patcher_base::save_page(plPageInfo* page, const std::filesystem::path& pagePath) const
+std::vector<std::unique_ptr<hsRAMStream>> gpp::patcher_base::encode_pages(const std::vector<plPageInfo*>& pages) const
+{
+    // Writing a page reindexes it, so decide what's stale before anything is written.
+    std::set<plLocation> changedPages = changed_pages();
+    while (true) {
+        // Stubs that were never deserialized still hold the object IDs they were read with.
+        if (m_DestinationIndex) {
+            size_t count = m_DestinationIndex->materialize_stale(changedPages);
+            if (count != 0)
+                log::debug("  -> Reencoding {} objects that live in or refer to changed pages", count);
+        }
+
+        std::vector<std::unique_ptr<hsRAMStream>> result;
+        for (plPageInfo* page : pages)
+            result.push_back(encode_page(page, changedPages));
+
+        // libHSPlasma is free to hand out new object IDs as it writes. Anything passed
+        // through into a page written earlier doesn't know about that, so go around
+        // again with the renumbered pages counted as changed.
+        std::set<plLocation> renumbered = changed_pages();
+        if (std::includes(changedPages.begin(), changedPages.end(), renumbered.begin(), renumbered.end()))
+            return result;
+        log::warning("  -> Object IDs changed while writing, reencoding the pages that refer to them");
+        changedPages.insert(renumbered.begin(), renumbered.end());
+    }
+}
+
+std::unique_ptr<hsRAMStream> gpp::patcher_base::encode_page(plPageInfo* page,
+                                                            const std::set<plLocation>& changedPages) const
+{
+    // Anything nobody touched gets copied from the original file instead of reencoded.
+    if (m_DestinationIndex) {
+        trace::scope scope("passthrough", page->getPage());
+        size_t count = m_DestinationIndex->passthrough(page->getLocation(), m_DirtyObjects, changedPages);
+        log::debug("  -> Passing through {} unmodified objects in '{}_{}'", count, page->getAge(), page->getPage());
+    }
+
+    // Serialize to memory first so we can leave the file (and its mtime) alone if
+    // patching turned out to be a no-op for this page.
+    trace::scope scope("WritePage", page->getPage());
+    auto S = std::make_unique<hsRAMStream>(m_Destination->getVer());
+    m_Destination->WritePage(S.get(), page);
+    if (m_DestinationIndex && m_DestinationIndex->revert_passthrough(page->getLocation())) {
+        S = std::make_unique<hsRAMStream>(m_Destination->getVer());
+        m_Destination->WritePage(S.get(), page);
+    }
+    return S;
+}
+
+std::tuple<bool, size_t> gpp::patcher_base::save_page(plPageInfo* page,
+                                                      const std::filesystem::path& pagePath,
+                                                      const std::unique_ptr<hsRAMStream>& stream) const
 {
     if (!std::filesystem::is_regular_file(pagePath))
-        plDebug::Error("WARNING: Saving a brand new '{}_{}' page to '{}' -- is this intended?",
+        log::error("WARNING: Saving a brand new '{}_{}' page to '{}' -- is this intended?",
             page->getAge(), page->getPage(), pagePath);
     else
-        plDebug::Debug("Saving '{}_{}' to '{}'...", page->getAge(), page->getPage(), pagePath);
-    m_Destination->WritePage(pagePath, page);
+        log::debug("Saving '{}_{}' to '{}'...", page->getAge(), page->getPage(), pagePath);
+
+    const hsRAMStream* S = stream.get();
+    size_t size = S->size();
+    if (std::filesystem::is_regular_file(pagePath) &&
+        std::filesystem::file_size(pagePath) == size &&
+        hash_file(pagePath) == hash_buffer(S->data(), size)) {
+        log::debug("  -> '{}_{}' is unchanged, not writing it.", page->getAge(), page->getPage());
+        reindex_page(page->getLocation(), pagePath);
+        events::page_saved(ST::format("{}_{}", page->getAge(), page->getPage()), pagePath, false, size);
+        return std::make_tuple(false, size);
+    }
+
+    hsFileStream file(m_Destination->getVer());
+    if (!file.open(ST::string::from_path(pagePath), fmCreate))
+        error::raise("Unable to open '{}' for writing", pagePath);
+    file.write(size, S->data());
+    file.close();
+    ST::string pageName = ST::format("{}_{}", page->getAge(), page->getPage());
+    stats::add_page_bytes(pageName, size);
+    events::page_saved(pageName, pagePath, true, size);
+    reindex_page(page->getLocation(), pagePath);
+    return std::make_tuple(true, size);
+}
+
+std::set<std::filesystem::path> gpp::patcher_base::destination_files() const
+{
+    std::set<std::filesystem::path> result;
+    if (m_DestinationIndex) {
+        for (const auto& [loc, file] : m_DestinationIndex->pages())
+            result.insert(file);
+    }
+    return result;
+}
+
+std::set<plLocation> gpp::patcher_base::changed_pages() const
+{
+    if (m_DestinationIndex)
+        return m_DestinationIndex->changed_pages();
+    return {};
+}
+
+void gpp::patcher_base::reindex_page(const plLocation& loc, const std::filesystem::path& pagePath) const
+{
+    // WritePage() moved the objects to new offsets, so anything that passes through the
+    // original bytes later on (ie a resident destination) has to look at the new file.
+    if (m_DestinationIndex)
+        m_DestinationIndex->add_page(loc, pagePath);
 }
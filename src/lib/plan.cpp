@@ -0,0 +1,180 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "plan.hpp"
+#include "errors.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+
+#include <string_theory/format>
+#include <string_theory/iostream>
+#include <string_theory/string_stream>
+
+#include <ResManager/plFactory.h>
+
+// ===========================================================================
+
+namespace
+{
+    constexpr const char* kPlanHeader = "# gpp edit plan v2";
+
+    constexpr gpp::edit_op kAllOps[] = {
+        gpp::edit_op::e_delete_physical,
+        gpp::edit_op::e_replace_physical,
+        gpp::edit_op::e_add_physical,
+        gpp::edit_op::e_replace_spans,
+        gpp::edit_op::e_map_key,
+        gpp::edit_op::e_move_key,
+    };
+
+    plKey find_key(plResManager* mgr, int seqPrefix, int pageNum, const ST::string& className,
+                   const ST::string& name)
+    {
+        short classType = plFactory::ClassIndex(className.c_str());
+        if (classType < 0)
+            return plKey();
+
+        for (const auto& loc : mgr->getLocations()) {
+            if (loc.getSeqPrefix() != seqPrefix || loc.getPageNum() != pageNum)
+                continue;
+            for (const auto& key : mgr->getKeys(loc, classType)) {
+                if (key->getName() == name)
+                    return key;
+            }
+        }
+        return plKey();
+    }
+};
+
+// ===========================================================================
+
+const char* gpp::edit_op_name(edit_op op)
+{
+    switch (op) {
+    case edit_op::e_delete_physical:
+        return "delete_physical";
+    case edit_op::e_replace_physical:
+        return "replace_physical";
+    case edit_op::e_add_physical:
+        return "add_physical";
+    case edit_op::e_replace_spans:
+        return "replace_spans";
+    case edit_op::e_map_key:
+        return "map_key";
+    case edit_op::e_move_key:
+        return "move_key";
+    default:
+        return "???";
+    }
+}
+
+void gpp::edit_plan::map_key(const plKey& source, const plKey& dest)
+{
+    if (!mapped_key(source).Exists())
+        add(edit_op::e_map_key, source, dest);
+}
+
+void gpp::edit_plan::append(const edit_plan& plan)
+{
+    for (const auto& i : plan.m_Edits) {
+        if (i.m_Op == edit_op::e_map_key)
+            map_key(i.m_Source, i.m_Destination);
+        else
+            m_Edits.push_back(i);
+    }
+}
+
+plKey gpp::edit_plan::mapped_key(const plKey& source) const
+{
+    auto it = std::find_if(m_Edits.begin(), m_Edits.end(),
+                           [&source](const edit& i) { return i.m_Op == edit_op::e_map_key && i.m_Source == source; });
+    return it != m_Edits.end() ? it->m_Destination : plKey();
+}
+
+ST::string gpp::edit_plan::describe() const
+{
+    ST::string_stream ss;
+    for (const auto& i : m_Edits) {
+        ss << edit_op_name(i.m_Op) << ": '" << i.m_Source->getName() << "' -> '"
+           << i.m_Destination->getName() << "' " << i.m_Destination->getLocation().toString() << "\n";
+    }
+    return ss.to_string();
+}
+
+// ===========================================================================
+
+void gpp::edit_plan::save(const std::filesystem::path& path) const
+{
+    std::ofstream stream(path, std::ios::out | std::ios::trunc);
+    if (!stream)
+        error::raise("Unable to open '{}' for writing", path);
+
+    // One edit per line, tab separated: the op, then the sequence prefix, page number,
+    // class, and name of the source and destination keys.
+    stream << kPlanHeader << '\n';
+    for (const auto& i : m_Edits) {
+        const plLocation& srcLoc = i.m_Source->getLocation();
+        const plLocation& dstLoc = i.m_Destination->getLocation();
+        stream << ST::format("{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}", edit_op_name(i.m_Op),
+                             srcLoc.getSeqPrefix(), srcLoc.getPageNum(),
+                             plFactory::ClassName(i.m_Source->getType()), i.m_Source->getName(),
+                             dstLoc.getSeqPrefix(), dstLoc.getPageNum(),
+                             plFactory::ClassName(i.m_Destination->getType()), i.m_Destination->getName())
+               << '\n';
+    }
+}
+
+gpp::edit_plan gpp::edit_plan::load(const std::filesystem::path& path, plResManager* source,
+                                    plResManager* dest)
+{
+    std::ifstream stream(path);
+    if (!stream)
+        error::raise("Unable to open plan '{}'", path);
+
+    std::string line;
+    if (!std::getline(stream, line) || line != kPlanHeader)
+        error::raise("'{}' is not an edit plan", path);
+
+    edit_plan result;
+    size_t lineNum = 1;
+    while (std::getline(stream, line)) {
+        ++lineNum;
+        if (line.empty())
+            continue;
+
+        std::vector<ST::string> fields = ST::string::from_std_string(line).split('\t');
+        if (fields.size() != 9)
+            error::raise("Malformed edit on line {} of '{}'", lineNum, path);
+
+        auto opIt = std::find_if(std::begin(kAllOps), std::end(kAllOps),
+                                 [&fields](edit_op op) { return fields[0] == edit_op_name(op); });
+        if (opIt == std::end(kAllOps))
+            error::raise("Unknown edit '{}' on line {} of '{}'", fields[0], lineNum, path);
+
+        plKey srcKey = find_key(source, fields[1].to_int(), fields[2].to_int(), fields[3], fields[4]);
+        plKey dstKey = find_key(dest, fields[5].to_int(), fields[6].to_int(), fields[7], fields[8]);
+        if (!srcKey.Exists() || !dstKey.Exists())
+            error::raise("Plan '{}' refers to keys that don't exist ([{}] '{}' -> [{}] '{}')",
+                         path, fields[3], fields[4], fields[7], fields[8]);
+        result.add(*opIt, std::move(srcKey), std::move(dstKey));
+    }
+
+    log::debug("  -> Loaded {} edits from '{}'", result.size(), path);
+    return result;
+}
@@ -0,0 +1,118 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_PLAN_H
+#define _GPP_PLAN_H
+
+#include <filesystem>
+#include <vector>
+
+#include <string_theory/string>
+
+#include <ResManager/plResManager.h>
+
+namespace gpp
+{
+    enum class edit_op
+    {
+        /** Removes the destination SceneObject's SimulationInterface and physical. */
+        e_delete_physical,
+
+        /** Copies the source physical's shape and properties over the destination's. */
+        e_replace_physical,
+
+        /** Moves the source SimulationInterface and physical onto the destination SceneObject. */
+        e_add_physical,
+
+        /** Replaces the destination DrawInterface's spans with the source's. */
+        e_replace_spans,
+
+        /** Resolves references to a source key with a destination key of the same class. */
+        e_map_key,
+
+        /** Moves a source key into the page of the destination SceneObject. */
+        e_move_key,
+    };
+
+    [[nodiscard]]
+    const char* edit_op_name(edit_op op);
+
+    /**
+     * One change to make. Everything but e_map_key and e_move_key is expressed as a source
+     * and destination SceneObject pair.
+     */
+    struct edit
+    {
+        edit_op m_Op;
+        plKey m_Source;
+        plKey m_Destination;
+    };
+
+    /**
+     * Everything a patch run is going to do, decided up front without touching either
+     * registry. Plans can be saved and loaded again to skip the decision making.
+     */
+    class edit_plan
+    {
+        std::vector<edit> m_Edits;
+
+    public:
+        edit_plan() = default;
+        edit_plan(const edit_plan&) = default;
+        edit_plan(edit_plan&&) = default;
+        ~edit_plan() = default;
+
+        edit_plan& operator =(const edit_plan&) = default;
+        edit_plan& operator =(edit_plan&&) = default;
+
+    public:
+        void add(edit_op op, plKey source, plKey dest)
+        {
+            m_Edits.push_back({ op, std::move(source), std::move(dest) });
+        }
+
+        /** Records a key mapping, unless the plan already has one for \a source. */
+        void map_key(const plKey& source, const plKey& dest);
+
+        void append(const edit_plan& plan);
+
+        /** The destination key the plan resolved \a source to, if any. */
+        [[nodiscard]]
+        plKey mapped_key(const plKey& source) const;
+
+        [[nodiscard]]
+        const std::vector<edit>& edits() const { return m_Edits; }
+
+        [[nodiscard]]
+        bool empty() const { return m_Edits.empty(); }
+
+        [[nodiscard]]
+        size_t size() const { return m_Edits.size(); }
+
+        /** Human readable, one line per edit. */
+        [[nodiscard]]
+        ST::string describe() const;
+
+    public:
+        void save(const std::filesystem::path& path) const;
+
+        /** Reads a saved plan, resolving its keys by class and name in the given registries. */
+        [[nodiscard]]
+        static edit_plan load(const std::filesystem::path& path, plResManager* source, plResManager* dest);
+    };
+};
+
+#endif
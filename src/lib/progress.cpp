@@ -0,0 +1,92 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "progress.hpp"
+
+// ===========================================================================
+
+gpp::progress::progress()
+    : m_Cancelled(false), m_Done(0), m_Total(0), m_LastReport(0)
+{ }
+
+void gpp::progress::set_callback(status_func func)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_Callback = std::move(func);
+}
+
+// ===========================================================================
+
+void gpp::progress::begin(const ST::string& phase, size_t total)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        m_Phase = phase;
+        m_Begin = std::chrono::steady_clock::now();
+        m_Done = 0;
+        m_Total = total;
+    }
+    report(true);
+}
+
+void gpp::progress::step(size_t count)
+{
+    if (!try_step(count))
+        throw cancelled();
+}
+
+bool gpp::progress::try_step(size_t count)
+{
+    size_t done = m_Done.fetch_add(count, std::memory_order_relaxed) + count;
+    size_t total = m_Total.load(std::memory_order_relaxed);
+    report(done >= total && done - count < total);
+    return !is_cancelled();
+}
+
+void gpp::progress::report(bool force)
+{
+    // This happens for every object, so only take the lock when it's time to report.
+    auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    auto last = m_LastReport.load(std::memory_order_relaxed);
+    auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(kReportInterval).count();
+    if (!force && now - last < interval)
+        return;
+    if (!m_LastReport.compare_exchange_strong(last, now, std::memory_order_relaxed) && !force)
+        return;
+
+    status_func callback;
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        callback = m_Callback;
+    }
+
+    // Don't hold the lock while somebody else's code runs.
+    if (callback)
+        callback(snapshot());
+}
+
+gpp::progress::status gpp::progress::snapshot() const
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    status result;
+    result.m_Phase = m_Phase;
+    result.m_Done = m_Done.load(std::memory_order_relaxed);
+    result.m_Total = m_Total.load(std::memory_order_relaxed);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_Begin;
+    result.m_Rate = elapsed.count() > 0.0 ? result.m_Done / elapsed.count() : 0.0;
+    return result;
+}
@@ -0,0 +1,117 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_PROGRESS_H
+#define _GPP_PROGRESS_H
+
+#include "errors.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+#include <string_theory/string>
+
+namespace gpp
+{
+    /** Thrown out of whatever was running when a progress token is cancelled. */
+    class cancelled : public error
+    {
+    public:
+        cancelled()
+            : error("The operation was cancelled")
+        { }
+    };
+
+    /**
+     * Shared between the code doing the work, which reports how far along it is, and
+     * whoever is watching, who may ask for the work to stop. Everything here may be
+     * called from any thread, and cancel() is safe to call from a signal handler.
+     */
+    class progress
+    {
+    public:
+        struct status
+        {
+            ST::string m_Phase;
+            size_t m_Done;
+            size_t m_Total;
+
+            /** Objects per second since the phase began. */
+            double m_Rate;
+        };
+
+        using status_func = std::function<void(const status&)>;
+
+    private:
+        std::atomic<bool> m_Cancelled;
+        std::atomic<size_t> m_Done;
+        std::atomic<size_t> m_Total;
+        std::atomic<std::chrono::steady_clock::rep> m_LastReport;
+
+        mutable std::mutex m_Lock;
+        ST::string m_Phase;
+        std::chrono::steady_clock::time_point m_Begin;
+        status_func m_Callback;
+
+        void report(bool force);
+
+    public:
+        progress();
+        progress(const progress&) = delete;
+        progress(progress&&) = delete;
+
+    public:
+        /** How often the callback hears about progress within a phase. */
+        static constexpr std::chrono::milliseconds kReportInterval{ 100 };
+
+        /** Sets a function that hears about progress, throttled to kReportInterval. */
+        void set_callback(status_func func);
+
+        void begin(const ST::string& phase, size_t total);
+
+        /**
+         * Marks some objects as done.
+         * \throws gpp::cancelled if the work should stop.
+         */
+        void step(size_t count = 1);
+
+        /**
+         * Like step(), but for places that can't throw, like destructors.
+         * \returns false if the work should stop.
+         */
+        [[nodiscard]]
+        bool try_step(size_t count = 1);
+
+        void cancel() { m_Cancelled.store(true, std::memory_order_relaxed); }
+
+        [[nodiscard]]
+        bool is_cancelled() const { return m_Cancelled.load(std::memory_order_relaxed); }
+
+        /** \throws gpp::cancelled if the work should stop. */
+        void check() const
+        {
+            if (is_cancelled())
+                throw cancelled();
+        }
+
+        [[nodiscard]]
+        status snapshot() const;
+    };
+};
+
+#endif
@@ -0,0 +1,271 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "reference_graph.hpp"
+#include "errors.hpp"
+#include "log.hpp"
+#include "object_index.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include <PRP/plSceneNode.h>
+#include <PRP/Audio/plAudible.h>
+#include <PRP/Geometry/plClusterGroup.h>
+#include <PRP/Geometry/plDrawableSpans.h>
+#include <PRP/Geometry/plOccluder.h>
+#include <PRP/GUI/pfGUIDialogMod.h>
+#include <PRP/Light/plLightInfo.h>
+#include <PRP/Modifier/plImageLibMod.h>
+#include <PRP/Modifier/plPythonFileMod.h>
+#include <PRP/Object/plAudioInterface.h>
+#include <PRP/Object/plCoordinateInterface.h>
+#include <PRP/Object/plDrawInterface.h>
+#include <PRP/Object/plSceneObject.h>
+#include <PRP/Object/plSimulationInterface.h>
+#include <PRP/Physics/plGenericPhysical.h>
+#include <PRP/Surface/hsGMaterial.h>
+#include <PRP/Surface/plLayerInterface.h>
+#include <ResManager/plFactory.h>
+
+// ===========================================================================
+
+namespace
+{
+    template<typename T>
+    T* convert(hsKeyedObject* obj)
+    {
+        return T::Convert(obj, false);
+    }
+};
+
+// ===========================================================================
+
+void gpp::collect_references(hsKeyedObject* obj, std::vector<plKey>& refs)
+{
+    auto add = [&refs](const plKey& key) {
+        if (key.Exists())
+            refs.push_back(key);
+    };
+    auto add_all = [&add](const std::vector<plKey>& keys) {
+        std::for_each(keys.begin(), keys.end(), add);
+    };
+
+    if (auto so = convert<plSceneObject>(obj)) {
+        add(so->getSceneNode());
+        add(so->getDrawInterface());
+        add(so->getSimInterface());
+        add(so->getCoordInterface());
+        add(so->getAudioInterface());
+        add_all(so->getInterfaces());
+        add_all(so->getModifiers());
+    }
+    if (auto iface = convert<plObjInterface>(obj))
+        add(iface->getOwner());
+    if (auto diface = convert<plDrawInterface>(obj)) {
+        for (size_t i = 0; i < diface->getNumDrawables(); ++i)
+            add(diface->getDrawable(i));
+        add_all(diface->getRegions());
+    }
+    if (auto simIface = convert<plSimulationInterface>(obj))
+        add(simIface->getPhysical());
+    if (auto coordIface = convert<plCoordinateInterface>(obj))
+        add_all(coordIface->getChildren());
+    if (auto audioIface = convert<plAudioInterface>(obj))
+        add(audioIface->getAudible());
+    if (auto phys = convert<plGenericPhysical>(obj)) {
+        add(phys->getObject());
+        add(phys->getSceneNode());
+        add(phys->getSubWorld());
+        add(phys->getSoundGroup());
+    }
+    if (auto dspan = convert<plDrawableSpans>(obj)) {
+        add(dspan->getSceneNode());
+        add_all(dspan->getMaterials());
+    }
+    if (auto node = convert<plSceneNode>(obj)) {
+        add_all(node->getSceneObjects());
+        add_all(node->getPoolObjects());
+    }
+    if (auto material = convert<hsGMaterial>(obj)) {
+        add_all(material->getLayers());
+        add_all(material->getPiggyBacks());
+    }
+    if (auto layer = convert<plLayerInterface>(obj)) {
+        add(layer->getUnderLay());
+        add(layer->getTexture());
+    }
+    if (auto imageLib = convert<plImageLibMod>(obj))
+        add_all(imageLib->getImages());
+    if (auto pfm = convert<plPythonFileMod>(obj)) {
+        for (const auto& param : pfm->getParameters())
+            add(param.fObjKey);
+    }
+
+    // Everything else we know about only points back at its SceneNode.
+    if (auto audible = convert<plWinAudible>(obj))
+        add(audible->getSceneNode());
+    if (auto cluster = convert<plClusterGroup>(obj))
+        add(cluster->getSceneNode());
+    if (auto occluder = convert<plOccluder>(obj))
+        add(occluder->getSceneNode());
+    if (auto dialog = convert<pfGUIDialogMod>(obj))
+        add(dialog->getSceneNode());
+    if (auto light = convert<plLightInfo>(obj))
+        add(light->getSceneNode());
+}
+
+// ===========================================================================
+
+gpp::reference_graph::reference_graph(plResManager* mgr)
+    : m_Complete(true)
+{
+    trace::scope scope("reference_graph");
+    auto start = std::chrono::steady_clock::now();
+
+    // This can't be split up per page. Deserializing a stub reads Uoids through the
+    // registry, which adds keys to it, and neither plResManager nor plKey's reference
+    // counts are safe to touch from more than one thread.
+    // Textures don't point anywhere, so there's no need to deserialize them if they're
+    // still stubs. Everything else has to be read to find out what it references.
+    size_t numObjects = 0;
+    std::vector<plKey> refs;
+    for (const auto& loc : mgr->getLocations()) {
+        for (auto type : mgr->getTypes(loc)) {
+            if (type == kMipmap || type == kCubicEnvironmap)
+                continue;
+            for (const auto& key : mgr->getKeys(loc, type)) {
+                hsKeyedObject* obj = object_index::resolve(key);
+                if (!obj)
+                    continue;
+                refs.clear();
+                collect_references(obj, refs);
+                add(key, refs);
+                ++numObjects;
+            }
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    log::debug("  -> Found {} references in {} objects in {.2f}s", size(), numObjects, elapsed.count());
+}
+
+void gpp::reference_graph::walk(plResManager* mgr, uint16_t classType)
+{
+    if (walked(classType))
+        return;
+
+    trace::scope scope("reference_graph", plFactory::ClassName(classType));
+    std::vector<plKey> refs;
+    for (const auto& key : mgr->getKeys(classType)) {
+        hsKeyedObject* obj = object_index::resolve(key);
+        if (!obj)
+            continue;
+        refs.clear();
+        collect_references(obj, refs);
+        forget_references(key);
+        add(key, refs);
+    }
+    m_Classes.insert(classType);
+}
+
+// ===========================================================================
+
+void gpp::reference_graph::add(const plKey& from, std::vector<plKey> refs)
+{
+    std::sort(refs.begin(), refs.end());
+    refs.erase(std::unique(refs.begin(), refs.end()), refs.end());
+    for (const auto& to : refs)
+        m_Referrers[to].insert(from);
+    m_References[from] = std::move(refs);
+}
+
+void gpp::reference_graph::update(const plKey& key)
+{
+    // A stub was never deserialized, so it can't have been edited either.
+    if (!key.Exists() || object_index::is_stub(key))
+        return;
+
+    forget_references(key);
+    if (key.isLoaded()) {
+        std::vector<plKey> refs;
+        collect_references(key->getObj(), refs);
+        add(key, std::move(refs));
+    }
+}
+
+void gpp::reference_graph::remove(const plKey& key)
+{
+    forget_references(key);
+    m_Referrers.erase(key);
+}
+
+void gpp::reference_graph::forget_references(const plKey& key)
+{
+    auto it = m_References.find(key);
+    if (it == m_References.end())
+        return;
+
+    for (const auto& to : it->second) {
+        auto referrersIt = m_Referrers.find(to);
+        if (referrersIt != m_Referrers.end()) {
+            referrersIt->second.erase(key);
+            if (referrersIt->second.empty())
+                m_Referrers.erase(referrersIt);
+        }
+    }
+    m_References.erase(it);
+}
+
+// ===========================================================================
+
+std::vector<plKey> gpp::reference_graph::referrers(const plKey& key) const
+{
+    std::vector<plKey> result;
+    auto it = m_Referrers.find(key);
+    if (it != m_Referrers.end()) {
+        std::copy_if(it->second.begin(), it->second.end(), std::back_inserter(result),
+                     [](const plKey& i) { return i.isLoaded(); });
+    }
+    return result;
+}
+
+std::vector<plKey> gpp::reference_graph::referrers(const plKey& key, uint16_t classType) const
+{
+    std::vector<plKey> result;
+    auto it = m_Referrers.find(key);
+    if (it != m_Referrers.end()) {
+        std::copy_if(it->second.begin(), it->second.end(), std::back_inserter(result),
+                     [classType](const plKey& i) { return i.isLoaded() && i->getType() == classType; });
+    }
+    return result;
+}
+
+const std::vector<plKey>& gpp::reference_graph::references(const plKey& key) const
+{
+    static const std::vector<plKey> kNone;
+    auto it = m_References.find(key);
+    return it != m_References.end() ? it->second : kNone;
+}
+
+size_t gpp::reference_graph::size() const
+{
+    size_t count = 0;
+    for (const auto& [_, refs] : m_References)
+        count += refs.size();
+    return count;
+}
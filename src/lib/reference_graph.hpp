@@ -0,0 +1,101 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_REFERENCE_GRAPH_H
+#define _GPP_REFERENCE_GRAPH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include <ResManager/plResManager.h>
+
+class hsKeyedObject;
+
+namespace gpp
+{
+    /**
+     * Answers "who references this key?" for a whole registry. Only the classes gpp knows
+     * how to edit are walked, so references held by anything else will not show up.
+     */
+    class reference_graph
+    {
+        std::map<plKey, std::vector<plKey>> m_References;
+        std::map<plKey, std::set<plKey>> m_Referrers;
+        std::set<uint16_t> m_Classes;
+        bool m_Complete{ false };
+
+    private:
+        void add(const plKey& from, std::vector<plKey> refs);
+        void forget_references(const plKey& key);
+
+    public:
+        reference_graph() = default;
+        reference_graph(const reference_graph&) = delete;
+        reference_graph(reference_graph&&) = default;
+
+        /** Builds the graph from everything in the registry, deserializing stubs as needed. */
+        explicit reference_graph(plResManager* mgr);
+
+    public:
+        /**
+         * Adds the references held by every object of one class, deserializing stubs as
+         * needed. Until the whole graph is built, only referrers of walked classes are known.
+         */
+        void walk(plResManager* mgr, uint16_t classType);
+
+        [[nodiscard]]
+        bool walked(uint16_t classType) const
+        {
+            return m_Complete || m_Classes.find(classType) != m_Classes.end();
+        }
+
+        /** Whether every object in the registry was walked. */
+        [[nodiscard]]
+        bool complete() const { return m_Complete; }
+
+    public:
+        /** Rereads the references held by an object after it has been edited. */
+        void update(const plKey& key);
+
+        /** Forgets an object that is going away, along with the references it holds. */
+        void remove(const plKey& key);
+
+    public:
+        /** The live objects that reference \a key. */
+        [[nodiscard]]
+        std::vector<plKey> referrers(const plKey& key) const;
+
+        /** The live objects of exactly \a classType that reference \a key. */
+        [[nodiscard]]
+        std::vector<plKey> referrers(const plKey& key, uint16_t classType) const;
+
+        /** The keys that \a key references. */
+        [[nodiscard]]
+        const std::vector<plKey>& references(const plKey& key) const;
+
+        [[nodiscard]]
+        size_t size() const;
+    };
+
+    /** Appends every key that an object references to \a refs. */
+    void collect_references(hsKeyedObject* obj, std::vector<plKey>& refs);
+};
+
+#endif
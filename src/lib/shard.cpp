@@ -0,0 +1,201 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shard.hpp"
+#include "errors.hpp"
+#include "log.hpp"
+#include "patcher.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <PRP/plPageInfo.h>
+#include <Stream/hsRAMStream.h>
+
+// ===========================================================================
+
+namespace
+{
+    /**
+     * Every shard saves its page on its own, so if libHSPlasma gave a page new object IDs
+     * while writing it, everything else still refers to its keys by the old ones. Reload
+     * the whole Age and rewrite those referrers until the object IDs settle down.
+     * \returns The number of pages rewritten.
+     */
+    size_t rewrite_referrers(const std::filesystem::path& dest, const gpp::reference_catalog& before)
+    {
+        auto [mgr, index] = gpp::patcher_base::load(dest, gpp::load_mode::e_lazy);
+        std::set<plLocation> changedPages = before.changed_pages(gpp::reference_catalog(mgr.get()));
+
+        size_t count = 0;
+        while (!changedPages.empty()) {
+            std::vector<plLocation> referrers;
+            for (const auto& loc : mgr->getLocations()) {
+                if (index->page_refers_to(loc, changedPages))
+                    referrers.push_back(loc);
+            }
+            if (referrers.empty())
+                break;
+
+            gpp::log::warning("  -> Object IDs changed in {} pages, rewriting {} pages that refer to them",
+                              changedPages.size(), referrers.size());
+            index->materialize_stale(changedPages);
+            for (const auto& loc : referrers)
+                mgr->WritePage(ST::string::from_path(index->pages().at(loc)), mgr->FindPage(loc));
+
+            // Rewriting a referrer can renumber it, too.
+            changedPages = index->changed_pages();
+            for (const auto& loc : referrers)
+                index->add_page(loc, index->pages().at(loc));
+            count += referrers.size();
+        }
+
+        // The index holds keys from the registry, so it has to go first.
+        index.reset();
+        return count;
+    }
+};
+
+// ===========================================================================
+
+gpp::reference_catalog::reference_catalog(plResManager* mgr)
+    : m_Version(mgr->getVer())
+{
+    for (const auto& loc : mgr->getLocations()) {
+        for (auto type : mgr->getTypes(loc)) {
+            for (const auto& key : mgr->getKeys(loc, type)) {
+                hsRAMStream S(m_Version);
+                mgr->writeUoid(&S, key);
+                std::vector<uint8_t> uoid(S.data(), S.data() + S.size());
+                m_Keys.try_emplace(std::make_tuple(loc, type, key->getName().to_lower()), std::move(uoid));
+            }
+        }
+    }
+}
+
+plKey gpp::reference_catalog::resolve(plResManager* mgr, const plLocation& loc, uint16_t classType,
+                                      const ST::string& name) const
+{
+    auto it = m_Keys.find(std::make_tuple(loc, classType, name.to_lower()));
+    if (it == m_Keys.end())
+        return plKey();
+
+    // Reading the Uoid adds the key to the registry without needing the page it lives in.
+    hsRAMStream S(m_Version);
+    S.copyFrom(it->second.data(), it->second.size());
+    return mgr->readUoid(&S);
+}
+
+std::set<plLocation> gpp::reference_catalog::changed_pages(const reference_catalog& other) const
+{
+    std::set<plLocation> result;
+    for (const auto& [name, uoid] : m_Keys) {
+        auto it = other.m_Keys.find(name);
+        if (it == other.m_Keys.end() || it->second != uoid)
+            result.insert(std::get<0>(name));
+    }
+    for (const auto& [name, uoid] : other.m_Keys) {
+        if (m_Keys.find(name) == m_Keys.end())
+            result.insert(std::get<0>(name));
+    }
+    return result;
+}
+
+// ===========================================================================
+
+size_t gpp::patch_sharded(const std::filesystem::path& source, const std::filesystem::path& dest,
+                          const shard_options& options)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // Skim the destination to find the pages worth patching and every key another page
+    // might want to reference. This is a stub load, so it's pretty cheap.
+    std::vector<std::tuple<std::filesystem::path, std::filesystem::path>> shards;
+    std::shared_ptr<const reference_catalog> references;
+    {
+        auto [mgr, index] = patcher_base::load(dest, load_mode::e_lazy);
+        if (ST::string::from_path(source.extension()).compare_i(".prp") == 0) {
+            shards.emplace_back(source, dest);
+        } else {
+            for (const auto& loc : mgr->getLocations()) {
+                if (mgr->getKeys(loc, kSceneObject).empty())
+                    continue;
+                plPageInfo* page = mgr->FindPage(loc);
+                if (!page)
+                    continue;
+                std::filesystem::path filename = page->getFilename(mgr->getVer()).to_path();
+                std::filesystem::path srcPage = source.parent_path() / filename;
+                if (std::filesystem::is_regular_file(srcPage))
+                    shards.emplace_back(srcPage, dest.parent_path() / filename);
+            }
+        }
+        references = std::make_shared<const reference_catalog>(mgr.get());
+
+        // The index holds keys from the registry, so it has to go first.
+        index.reset();
+    }
+
+    if (shards.empty())
+        error::raise("None of the pages in '{}' can be patched from '{}'", dest, source);
+
+    size_t threads = options.m_Threads ? options.m_Threads : std::thread::hardware_concurrency();
+    threads = std::clamp(threads, (size_t)1, shards.size());
+    log::debug("Patching {} pages on {} threads...", shards.size(), threads);
+
+    std::atomic<size_t> nextShard = 0;
+    std::atomic<size_t> failures = 0;
+    auto worker = [&]() {
+        for (size_t i = nextShard++; i < shards.size(); i = nextShard++) {
+            const auto& [srcPage, dstPage] = shards[i];
+            try {
+                patcher myPatcher(srcPage, dstPage, options.m_Mode);
+                myPatcher.set_references(references);
+                if (options.m_Colliders)
+                    myPatcher.process_collision();
+                if (options.m_Drawables)
+                    myPatcher.process_drawables();
+                if (myPatcher.has_damage())
+                    myPatcher.save_damage(srcPage, dstPage);
+            } catch (const std::exception& ex) {
+                log::error("Unable to patch '{}': {}", srcPage.filename(), ex.what());
+                ++failures;
+            }
+        }
+    };
+    {
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; ++i)
+            pool.emplace_back(worker);
+        worker();
+        for (auto& thread : pool)
+            thread.join();
+    }
+
+    if (ST::string::from_path(dest.extension()).compare_i(".age") == 0) {
+        try {
+            rewrite_referrers(dest, *references);
+        } catch (const std::exception& ex) {
+            log::error("Unable to rewrite pages referring to renumbered pages: {}", ex.what());
+            ++failures;
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    log::debug("Patched {} of {} pages in {.2f}s", shards.size() - failures, shards.size(), elapsed.count());
+    return failures;
+}
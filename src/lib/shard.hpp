@@ -0,0 +1,86 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_SHARD_H
+#define _GPP_SHARD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include <string_theory/string>
+
+#include <ResManager/plResManager.h>
+
+#include "object_index.hpp"
+
+namespace gpp
+{
+    /**
+     * Read-only snapshot of every key in a registry, stored as serialized Uoids so that
+     * any number of threads can turn them into keys in their own plResManager.
+     */
+    class reference_catalog
+    {
+        std::map<std::tuple<plLocation, uint16_t, ST::string>, std::vector<uint8_t>> m_Keys;
+        PlasmaVer m_Version;
+
+    public:
+        reference_catalog() = delete;
+        reference_catalog(const reference_catalog&) = delete;
+        reference_catalog(reference_catalog&&) = delete;
+
+        reference_catalog(plResManager* mgr);
+        ~reference_catalog() = default;
+
+    public:
+        /**
+         * Finds a key by case-insensitive name and adds it to the given registry.
+         * \returns A null key if there is no such key in the catalog.
+         */
+        [[nodiscard]]
+        plKey resolve(plResManager* mgr, const plLocation& loc, uint16_t classType,
+                      const ST::string& name) const;
+
+        /** The pages whose keys were added, removed, or given new Uoids in \a other. */
+        [[nodiscard]]
+        std::set<plLocation> changed_pages(const reference_catalog& other) const;
+    };
+
+    struct shard_options
+    {
+        bool m_Colliders{ true };
+        bool m_Drawables{ true };
+        load_mode m_Mode{ load_mode::e_full };
+        size_t m_Threads{ 0 };
+    };
+
+    /**
+     * Patches each page of an Age on its own, in parallel, with separate registries for
+     * every page. References to objects in other pages are resolved via a reference_catalog
+     * of the destination Age. If saving a page renumbers it, the pages that refer to it are
+     * rewritten afterward.
+     * \returns The number of pages that could not be patched.
+     */
+    size_t patch_sharded(const std::filesystem::path& source, const std::filesystem::path& dest,
+                         const shard_options& options);
+};
+
+#endif
@@ -16,6 +16,15 @@
 
 #include "span_hacker.hpp"
 #include "errors.hpp"
+#include "events.hpp"
+#include "log.hpp"
+#include "object_index.hpp"
+#include "progress.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <type_traits>
 
 #include <PRP/Geometry/plDrawableSpans.h>
 #include <PRP/Geometry/plIcicle.h>
@@ -66,13 +75,13 @@ namespace
         switch (obj->getType()) {
         case kSceneObject:
         {
-            plSceneObject* so = plSceneObject::Convert(obj->getObj());
+            plSceneObject* so = plSceneObject::Convert(gpp::object_index::resolve(obj));
             if (so->getDrawInterface().Exists())
-                diface = plDrawInterface::Convert(so->getDrawInterface()->getObj());
+                diface = plDrawInterface::Convert(gpp::object_index::resolve(so->getDrawInterface()));
         }
         break;
         case kDrawInterface:
-            diface = plDrawInterface::Convert(obj->getObj());
+            diface = plDrawInterface::Convert(gpp::object_index::resolve(obj));
             break;
         default:
             gpp::error::raise("Cannot iterate passes for {}", obj.toString());
@@ -105,7 +114,7 @@ namespace
         dstDSpan->setSceneNode(mgr->getSceneNode(loc)->getKey());
         mgr->AddObject(loc, dstDSpan);
 
-        plDebug::Debug(
+        gpp::log::debug(
             "  -> Behold! A new DrawableSpan: '{}'@{X}",
             dstDSpan->getKey().toString(),
             (uintptr_t)dstDSpan
@@ -123,7 +132,7 @@ namespace
         auto drawKeys = mgr->getKeys(loc, kDrawableSpans);
         auto it = std::find_if(drawKeys.begin(), drawKeys.end(),
             [&](const plKey& test) {
-            const auto* maybeDSpan = plDrawableSpans::Convert(test->getObj());
+            const auto* maybeDSpan = plDrawableSpans::Convert(gpp::object_index::resolve(test));
             if (compare_passes(maybeDSpan, new_pass, minor)) {
                 if (maybeDSpan->getCriteria() == criteria) {
                     if (maybeDSpan->getProps() == props)
@@ -135,7 +144,7 @@ namespace
         );
 
         if (it != drawKeys.end())
-            return plDrawableSpans::Convert((*it)->getObj());
+            return plDrawableSpans::Convert(gpp::object_index::resolve(*it));
         return nullptr;
     }
 
@@ -158,7 +167,7 @@ namespace
         drawables_t ret(diface->getNumDrawables());
         for (size_t i = 0; i < diface->getNumDrawables(); ++i) {
             ret[i] = std::make_tuple(
-                plDrawableSpans::Convert(diface->getDrawable(i)->getObj()),
+                plDrawableSpans::Convert(gpp::object_index::resolve(diface->getDrawable(i))),
                 diface->getDrawableKey(i)
             );
         }
@@ -175,14 +184,14 @@ namespace
     get_interfaces(const plDrawableSpans* dspan)
     {
         std::map<plDrawInterface*, std::vector<size_t>> ret;
-        plSceneNode* node = plSceneNode::Convert(dspan->getSceneNode()->getObj());
+        plSceneNode* node = plSceneNode::Convert(gpp::object_index::resolve(dspan->getSceneNode()));
         for (const auto& soKey : node->getSceneObjects()) {
             plDrawInterface* dIface = find_diface(soKey);
             if (!dIface)
                 continue;
 
             for (size_t i = 0; i < dIface->getNumDrawables(); ++i) {
-                if (dIface->getDrawable(i)->getObj() == dspan) {
+                if (gpp::object_index::resolve(dIface->getDrawable(i)) == dspan) {
                     ret[dIface].push_back(i);
                 }
             }
@@ -198,7 +207,7 @@ bool gpp::span_hacker::iterate_passes(const gpp::span_hacker::pass_iter& func, c
     plDrawInterface* diface = find_diface(obj);
     if (diface) {
         for (size_t i = 0; i < diface->getNumDrawables(); ++i) {
-            plDrawableSpans* dspan = plDrawableSpans::Convert(diface->getDrawable(i)->getObj());
+            plDrawableSpans* dspan = plDrawableSpans::Convert(object_index::resolve(diface->getDrawable(i)));
             const auto& diindex = dspan->getDIIndex(diface->getDrawableKey(i));
 
             std::vector<plKey> materials;
@@ -218,7 +227,7 @@ bool gpp::span_hacker::change_pass(const plKey& obj, size_t idx, render_pass new
 {
     plDrawInterface* diface = find_diface(obj);
 
-    plDrawableSpans* sourceDSpan = plDrawableSpans::Convert(diface->getDrawable(idx)->getObj());
+    plDrawableSpans* sourceDSpan = plDrawableSpans::Convert(object_index::resolve(diface->getDrawable(idx)));
     if (compare_passes(sourceDSpan, new_pass, minor))
         return false;
 
@@ -257,21 +266,73 @@ bool gpp::span_hacker::change_page(const plKey& obj, const plLocation& page)
     return true;
 }
 
+std::vector<plKey> gpp::span_hacker::mapped_keys(const plKey& srcObj)
+{
+    std::vector<plKey> result;
+    auto add = [&result](const plKey& key) {
+        if (key.Exists() && std::find(result.begin(), result.end(), key) == result.end())
+            result.push_back(key);
+    };
+
+    plDrawInterface* diface = find_diface(srcObj);
+    if (!diface)
+        return result;
+
+    for (const auto& [dspan, dii] : get_drawables(diface)) {
+        if (dii == (size_t)-1)
+            continue;
+        for (uint32_t spanidx : dspan->getDIIndex(dii).fIndices) {
+            const plSpan* span = dspan->getSpan(spanidx);
+            add(dspan->getMaterials().at(span->getMaterialIdx()));
+            add(span->getFogEnvironment());
+            for (const auto& light : span->getPermaLights())
+                add(light);
+            for (const auto& light : span->getPermaProjs())
+                add(light);
+        }
+    }
+    return result;
+}
+
 bool gpp::span_hacker::overwrite_spans(const plKey& srcObj, const plKey& dstObj)
 {
     plDrawInterface* srcDIface = find_diface(srcObj);
     plDrawInterface* dstDIface = find_diface(dstObj);
 
+    // Anyone else drawing with the DIIs we're about to drop keeps the old geometry. That
+    // may or may not be what the artist wants, so just point it out.
+    if (m_ReferrersFunc && log::enabled(plDebug::kDLWarning)) {
+        for (size_t i = 0; i < dstDIface->getNumDrawables(); ++i) {
+            plKey dsKey = dstDIface->getDrawable(i);
+            int dii = dstDIface->getDrawableKey(i);
+            if (dii == -1)
+                continue;
+
+            for (const auto& diKey : m_ReferrersFunc(dsKey, kDrawInterface)) {
+                if (diKey == dstDIface->getKey())
+                    continue;
+                plDrawInterface* other = plDrawInterface::Convert(object_index::resolve(diKey));
+                for (size_t j = 0; j < other->getNumDrawables(); ++j) {
+                    if (other->getDrawable(j) == dsKey && other->getDrawableKey(j) == dii) {
+                        log::warning("  -> '{}' shares [DII: {}] of '{}' with '{}' and keeps the old geometry",
+                                     diKey.toString(), dii, dsKey.toString(), dstDIface->getKey().toString());
+                    }
+                }
+            }
+        }
+    }
+
     // This might have to be made less naïve if we ever support bone animations.
     // Anyway, just blow up all the drawables currently in the dst DI and dirty them.
     // We'll want to have them marked dirty for the cleanup pass.
     for (ssize_t i = dstDIface->getNumDrawables() - 1; i >= 0; --i) {
-        plDrawableSpans* dspan = plDrawableSpans::Convert(dstDIface->getDrawable(i)->getObj());
+        plDrawableSpans* dspan = plDrawableSpans::Convert(object_index::resolve(dstDIface->getDrawable(i)));
         //m_DirtySpans.insert(dspan);
         // Dirty also means unpacked, dammit.
         unpack_span(dspan);
         dstDIface->delDrawable(i);
     }
+    touch(dstDIface->getKey());
 
     auto srcDrawables = get_drawables(srcDIface);
     for (size_t i = 0; i < srcDIface->getNumDrawables(); ++i) {
@@ -289,9 +350,7 @@ bool gpp::span_hacker::overwrite_spans(const plKey& srcObj, const plKey& dstObj)
         dstDIface->addDrawable(dstDSpan->getKey(), dstDII);
     }
 
-    // TODO QUESTION: should we scan for anyone else using these DIIs and
-    // fixup those references to use our new spans? Seems useful, but
-    // potentially misleading.
+    events::object("replace_spans", srcObj, dstObj);
 
     // Cleanup pass will happen when the hacker is destroyed.
     return true;
@@ -301,12 +360,12 @@ bool gpp::span_hacker::overwrite_spans(const plKey& srcObj, const plKey& dstObj)
 
 void gpp::span_hacker::change_span(plDrawInterface* diface, size_t idx, plDrawableSpans* dstDSpan)
 {
-    plDrawableSpans* srcDSpan = plDrawableSpans::Convert(diface->getDrawable(idx)->getObj());
+    plDrawableSpans* srcDSpan = plDrawableSpans::Convert(object_index::resolve(diface->getDrawable(idx)));
     size_t srcDII = diface->getDrawableKey(idx);
 
     // Maybe this was already done by an optimization pass?
     if (srcDSpan == dstDSpan) {
-        plDebug::Debug(
+        log::debug(
             "  -> Move request for '{}' [DII: {}] into '{}'@{X} already done?",
             diface->getKey().toString(),
             srcDII,
@@ -318,6 +377,7 @@ void gpp::span_hacker::change_span(plDrawInterface* diface, size_t idx, plDrawab
 
     size_t newDII = import_span(srcDSpan, srcDII, dstDSpan);
     diface->setDrawable(idx, dstDSpan->getKey(), newDII);
+    touch(diface->getKey());
 }
 
 size_t gpp::span_hacker::import_span(plDrawableSpans* srcDSpan, size_t srcDII,
@@ -325,25 +385,30 @@ size_t gpp::span_hacker::import_span(plDrawableSpans* srcDSpan, size_t srcDII,
 {
     auto doneIt = m_PatchedKeys.find(std::make_tuple(srcDSpan, srcDII, dstDSpan));
     if (doneIt != m_PatchedKeys.end()) {
-        plDebug::Debug(
-            "  -> Import for '{}'@{X} [DII: {}] into '{}'@{X} already done",
-            srcDSpan->getKey().toString(),
-            (uintptr_t)srcDSpan,
-            srcDII,
-            dstDSpan->getKey().toString(),
-            (uintptr_t)dstDSpan
-        );
+        if (log::enabled(plDebug::kDLDebug)) {
+            log::debug(
+                "  -> Import for '{}'@{X} [DII: {}] into '{}'@{X} already done",
+                srcDSpan->getKey().toString(),
+                (uintptr_t)srcDSpan,
+                srcDII,
+                dstDSpan->getKey().toString(),
+                (uintptr_t)dstDSpan
+            );
+        }
         return doneIt->second;
     } else {
-        plDebug::Debug(
-            "  -> Importing '{}'@{X} [DII: {}] into '{}'@{X}",
-            srcDSpan->getKey().toString(),
-            (uintptr_t)srcDSpan,
-            srcDII,
-            dstDSpan->getKey().toString(),
-            (uintptr_t)dstDSpan
-        );
+        if (log::enabled(plDebug::kDLDebug)) {
+            log::debug(
+                "  -> Importing '{}'@{X} [DII: {}] into '{}'@{X}",
+                srcDSpan->getKey().toString(),
+                (uintptr_t)srcDSpan,
+                srcDII,
+                dstDSpan->getKey().toString(),
+                (uintptr_t)dstDSpan
+            );
+        }
 
+        stats::add(stats::counter::e_spans_imported);
         const auto& srcDIIndices = srcDSpan->getDIIndices()[srcDII];
         plDISpanIndex dstDIIndices;
         dstDIIndices.fFlags = srcDIIndices.fFlags;
@@ -396,8 +461,14 @@ void gpp::span_hacker::copy_geometry(const plDISpanIndex& srcDIIndices, plDrawab
         dstGeoSpan->setMaxDist(srcGeoSpan->getMaxDist());
         dstGeoSpan->setWaterHeight(srcGeoSpan->getWaterHeight());
         dstGeoSpan->setProps(srcGeoSpan->getProps());
-        dstGeoSpan->setVertices(srcGeoSpan->getVertices());
-        dstGeoSpan->setIndices(srcGeoSpan->getIndices());
+        const auto& vertices = srcGeoSpan->getVertices();
+        const auto& indices = srcGeoSpan->getIndices();
+        dstGeoSpan->setVertices(vertices);
+        dstGeoSpan->setIndices(indices);
+        stats::add(stats::counter::e_vertex_bytes_copied,
+                   vertices.size() * sizeof(std::decay_t<decltype(vertices)>::value_type));
+        stats::add(stats::counter::e_index_bytes_copied,
+                   indices.size() * sizeof(std::decay_t<decltype(indices)>::value_type));
         // decal level, instance group, l2obb, obb2l... nope
 
         dstGeoSpan->getPermaLights().reserve(srcGeoSpan->getPermaLights().size());
@@ -423,8 +494,14 @@ void gpp::span_hacker::cleanup_dirty_spans(std::optional<std::vector<plDrawableS
             m_DirtySpans.erase(dspan);
         }
     } else {
-        for (plDrawableSpans* dspan : m_DirtySpans)
+        if (m_Progress)
+            m_Progress->begin("Packing drawables", m_DirtySpans.size());
+        for (plDrawableSpans* dspan : m_DirtySpans) {
+            // Cancelled? The spans are left unpacked, so nothing had better save them.
+            if (m_Progress && !m_Progress->try_step())
+                break;
             pack_span(dspan);
+        }
         m_DirtySpans.clear();
     }
 }
@@ -444,15 +521,18 @@ namespace
         return unusedIdxes;
     }
 
-    static inline void nuke_dii(plDrawableSpans* dspan, size_t dii, interfaces_t& myDIfaces)
+    static inline void nuke_dii(plDrawableSpans* dspan, size_t dii, interfaces_t& myDIfaces,
+                                const gpp::span_touch_func& touch)
     {
-        plDebug::Debug(
-            "  -> Cleaning up unused DISpan [DII: {}] [BONE: {}]  in '{}'@{X}",
-            dii,
-            (bool)(dspan->getDIIndex(dii).fFlags & plDISpanIndex::kMatrixOnly),
-            dspan->getKey().toString(),
-            (uintptr_t)dspan
-        );
+        if (gpp::log::enabled(plDebug::kDLDebug)) {
+            gpp::log::debug(
+                "  -> Cleaning up unused DISpan [DII: {}] [BONE: {}]  in '{}'@{X}",
+                dii,
+                (bool)(dspan->getDIIndex(dii).fFlags & plDISpanIndex::kMatrixOnly),
+                dspan->getKey().toString(),
+                (uintptr_t)dspan
+            );
+        }
 
         // This crap is complicated by the fact that we need to keep the DrawInterface
         // index LUT correct because it will continue to be used. Ugh.
@@ -467,6 +547,8 @@ namespace
                     dIface->delDrawable(*idxIt); // KABLOOEY!
                     myIdxes.erase(idxIt);
                     ++numDrawDeletions;
+                    if (touch)
+                        touch(dIface->getKey());
                 } else {
                     dIface->setDrawable(
                         *idxIt,
@@ -474,15 +556,20 @@ namespace
                         dIface->getDrawableKey(*idxIt) - 1
                     );
                     ++idxIt;
+                    if (touch)
+                        touch(dIface->getKey());
                 }
             }
         }
 
         dspan->delDIIndex(dii);
+        gpp::stats::add(gpp::stats::counter::e_diis_purged);
     }
 
-    static inline void purge_unused_diis(plDrawableSpans* dspan)
+    static inline void purge_unused_diis(plDrawableSpans* dspan, const gpp::span_touch_func& touch)
     {
+        gpp::trace::scope scope("purge_unused_diis");
+
         // Prepare a set of all valid DIIs in this DrawableSpan by brute-forcing
         // backwards through the DrawInterfaces. Then, cleanup by evicting any
         // that were not used.
@@ -505,18 +592,20 @@ namespace
         for (auto diiIt = unusedDIIs.crbegin(); diiIt != unusedDIIs.crend(); ++diiIt) {
             // Yeah, there are multiple kinds of DISpans, but the actual handling of
             // the transform/geospan reference removal will be handled later.
-            nuke_dii(dspan, *diiIt, myDIfaces);
+            nuke_dii(dspan, *diiIt, myDIfaces, touch);
         }
     }
 
     static inline void nuke_source_span(plDrawableSpans* dspan, size_t idx)
     {
-        plDebug::Debug(
-            "  -> Cleaning up unused source span [IDX: {}] in '{}'@{X}",
-            idx,
-            dspan->getKey().toString(),
-            (uintptr_t)dspan
-        );
+        if (gpp::log::enabled(plDebug::kDLDebug)) {
+            gpp::log::debug(
+                "  -> Cleaning up unused source span [IDX: {}] in '{}'@{X}",
+                idx,
+                dspan->getKey().toString(),
+                (uintptr_t)dspan
+            );
+        }
 
         // Adjust all remaining DIIs
         for (auto& diiSpan : dspan->getDIIndices()) {
@@ -531,10 +620,13 @@ namespace
         }
 
         dspan->delSourceSpan(idx);
+        gpp::stats::add(gpp::stats::counter::e_source_spans_purged);
     }
 
     static inline void purge_unused_geometry(plDrawableSpans* dspan)
     {
+        gpp::trace::scope scope("purge_unused_geometry");
+
         // Prepare a set of all valid Source Span indices so we can
         // know what to nuke out.
         std::set<size_t> usedSourceSpans;
@@ -556,17 +648,24 @@ void gpp::span_hacker::pack_span(plDrawableSpans* dspan)
     // unmodified span.
     unpack_span(dspan);
 
-    plDebug::Debug(
-        "  -> Packing DSpan '{}'@{X}",
-        dspan->getKey().toString(),
-        (uintptr_t)dspan
-    );
+    trace::scope scope("pack_span", dspan->getKey()->getName());
+    stats::add(stats::counter::e_dspans_packed);
+    if (log::enabled(plDebug::kDLDebug)) {
+        log::debug(
+            "  -> Packing DSpan '{}'@{X}",
+            dspan->getKey().toString(),
+            (uintptr_t)dspan
+        );
+    }
 
-    purge_unused_diis(dspan);
+    purge_unused_diis(dspan, m_TouchFunc);
     purge_unused_geometry(dspan);
     // TODO: bones/transforms... ugh
 
-    dspan->composeGeometry();
+    {
+        trace::scope composeScope("composeGeometry");
+        dspan->composeGeometry();
+    }
 }
 
 void gpp::span_hacker::unpack_span(plDrawableSpans* dspan)
@@ -574,13 +673,18 @@ void gpp::span_hacker::unpack_span(plDrawableSpans* dspan)
     if (m_DirtySpans.find(dspan) != m_DirtySpans.end())
         return;
 
-    plDebug::Debug(
-        "  -> Unpacking DSpan '{}'@{X}",
-        dspan->getKey().toString(),
-        (uintptr_t)dspan
-    );
+    trace::scope scope("unpack_span", dspan->getKey()->getName());
+    stats::add(stats::counter::e_dspans_unpacked);
+    if (log::enabled(plDebug::kDLDebug)) {
+        log::debug(
+            "  -> Unpacking DSpan '{}'@{X}",
+            dspan->getKey().toString(),
+            (uintptr_t)dspan
+        );
+    }
     dspan->decomposeGeometry();
     m_DirtySpans.insert(dspan);
+    touch(dspan->getKey());
 
     // Forcibly clear the span because we may be in an indeterminant state.
     dspan->clearSpans();
@@ -591,9 +695,9 @@ void gpp::span_hacker::unpack_span(plDrawableSpans* dspan)
 void gpp::span_hacker::purge_empty_drawables(plResManager* mgr) const
 {
     for (const auto& diKey : mgr->getKeys(kDrawInterface)) {
-        plDrawInterface* dIface = plDrawInterface::Convert(diKey->getObj());
+        plDrawInterface* dIface = plDrawInterface::Convert(object_index::resolve(diKey));
         if (dIface->getNumDrawables() == 0) {
-            plDebug::Debug("  -> Purging empty drawable '{}'", diKey.toString());
+            log::debug("  -> Purging empty drawable '{}'", diKey.toString());
             mgr->DelObject(diKey);
         }
     }
@@ -603,11 +707,11 @@ void gpp::span_hacker::purge_empty_drawables(plResManager* mgr) const
     // force them to be deleted. Might not be a good idea. Revisit later.
 #if 0
     for (const auto& dsKey : mgr->getKeys(kDrawableSpans)) {
-        plDrawableSpans* dspan = plDrawableSpans::Convert(dsKey->getObj());
+        plDrawableSpans* dspan = plDrawableSpans::Convert(object_index::resolve(dsKey));
 
         // Is this too simplistic? Verify that bone anims are not deleted.
         if (dspan->getNumSpans() == 0) {
-            plDebug::Debug("  -> Purging empty drawable '{}'", dsKey.toString());
+            log::debug("  -> Purging empty drawable '{}'", dsKey.toString());
             mgr->DelObject(dsKey);
         }
     }
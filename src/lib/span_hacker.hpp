@@ -33,7 +33,11 @@ class plDrawableSpans;
 
 namespace gpp
 {
+    class progress;
+
     using span_key_map_func = std::function<plKey(const plKey&)>;
+    using span_touch_func = std::function<void(const plKey&)>;
+    using span_referrers_func = std::function<std::vector<plKey>(const plKey&, uint16_t)>;
 
     enum class render_pass
     {
@@ -51,6 +55,9 @@ namespace gpp
         std::shared_ptr<plResManager> m_Source;
         std::shared_ptr<plResManager> m_Destination;
         span_key_map_func m_MapFunc;
+        span_touch_func m_TouchFunc;
+        span_referrers_func m_ReferrersFunc;
+        std::shared_ptr<progress> m_Progress;
 
     public:
         using pass_iter = std::function<void(const plKey&, render_pass, size_t, const std::vector<plKey>&)>;
@@ -75,6 +82,18 @@ namespace gpp
     public:
         void set_map_func(span_key_map_func func) { m_MapFunc = std::move(func); }
 
+        /** Sets a function to be notified about every object the hacker modifies. */
+        void set_touch_func(span_touch_func func) { m_TouchFunc = std::move(func); }
+
+        /** Sets a function that finds the objects of a given class referencing a key. */
+        void set_referrers_func(span_referrers_func func) { m_ReferrersFunc = std::move(func); }
+
+        /**
+         * Reports how the cleanup pass is going. The cleanup pass runs in the destructor, so
+         * cancelling just stops it early; the owner has to check the token afterward.
+         */
+        void set_progress(std::shared_ptr<progress> token) { m_Progress = std::move(token); }
+
     public:
         /** Iterates through all render passes on an object. */
         bool iterate_passes(const pass_iter& func, const plKey& obj) const;
@@ -88,6 +107,10 @@ namespace gpp
 
         bool overwrite_spans(const plKey& srcObj, const plKey& dstObj);
 
+        /** The keys overwrite_spans() will ask the map function about when copying \a srcObj. */
+        [[nodiscard]]
+        static std::vector<plKey> mapped_keys(const plKey& srcObj);
+
     private:
         void change_span(plDrawInterface* obj, size_t idx, plDrawableSpans* dstDSpan);
 
@@ -121,6 +144,12 @@ namespace gpp
                 return m_MapFunc(obj);
             return obj;
         }
+
+        void touch(const plKey& obj) const
+        {
+            if (obj.Exists() && m_TouchFunc)
+                m_TouchFunc(obj);
+        }
     };
 };
 
@@ -0,0 +1,108 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "stats.hpp"
+
+#include <map>
+#include <mutex>
+
+#include <string_theory/format>
+#include <string_theory/string_stream>
+
+// ===========================================================================
+
+namespace
+{
+    std::mutex s_PagesLock;
+    std::map<ST::string, uint64_t> s_PageBytes;
+};
+
+std::atomic<uint64_t> gpp::stats::detail::s_Counters[(size_t)gpp::stats::counter::e_num_counters];
+
+// ===========================================================================
+
+const char* gpp::stats::counter_name(counter which)
+{
+    switch (which) {
+    case counter::e_keys_scanned:
+        return "keys scanned";
+    case counter::e_lut_hits:
+        return "key LUT hits";
+    case counter::e_lut_misses:
+        return "key LUT misses";
+    case counter::e_rename_rules:
+        return "rename rules evaluated";
+    case counter::e_map_prompts:
+        return "map function prompts";
+    case counter::e_dspans_unpacked:
+        return "DSpans unpacked";
+    case counter::e_dspans_packed:
+        return "DSpans packed";
+    case counter::e_diis_purged:
+        return "DIIs purged";
+    case counter::e_source_spans_purged:
+        return "source spans purged";
+    case counter::e_spans_imported:
+        return "geometry spans imported";
+    case counter::e_vertex_bytes_copied:
+        return "vertex bytes copied";
+    case counter::e_index_bytes_copied:
+        return "index bytes copied";
+    case counter::e_physicals_unchanged:
+        return "physicals unchanged";
+    case counter::e_drawables_unchanged:
+        return "drawables unchanged";
+    default:
+        return "???";
+    }
+}
+
+void gpp::stats::add_page_bytes(const ST::string& page, uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(s_PagesLock);
+    s_PageBytes[page] += size;
+}
+
+std::map<ST::string, uint64_t> gpp::stats::page_bytes()
+{
+    std::lock_guard<std::mutex> lock(s_PagesLock);
+    return s_PageBytes;
+}
+
+void gpp::stats::reset()
+{
+    for (auto& i : detail::s_Counters)
+        i.store(0, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(s_PagesLock);
+    s_PageBytes.clear();
+}
+
+ST::string gpp::stats::report()
+{
+    ST::string_stream ss;
+    ss << "Counters:\n";
+    for (size_t i = 0; i < (size_t)counter::e_num_counters; ++i)
+        ss << ST::format("  {<24} {>12}\n", counter_name((counter)i), get((counter)i));
+
+    std::lock_guard<std::mutex> lock(s_PagesLock);
+    ss << "Bytes written:\n";
+    if (s_PageBytes.empty())
+        ss << "  (none)\n";
+    for (const auto& [page, size] : s_PageBytes)
+        ss << ST::format("  {<24} {>12}\n", page, size);
+    return ss.to_string();
+}
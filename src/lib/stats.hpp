@@ -0,0 +1,83 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_STATS_H
+#define _GPP_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+
+#include <string_theory/string>
+
+namespace gpp
+{
+    namespace stats
+    {
+        enum class counter
+        {
+            e_keys_scanned,
+            e_lut_hits,
+            e_lut_misses,
+            e_rename_rules,
+            e_map_prompts,
+            e_dspans_unpacked,
+            e_dspans_packed,
+            e_diis_purged,
+            e_source_spans_purged,
+            e_spans_imported,
+            e_vertex_bytes_copied,
+            e_index_bytes_copied,
+            e_physicals_unchanged,
+            e_drawables_unchanged,
+
+            e_num_counters,
+        };
+
+        namespace detail
+        {
+            extern std::atomic<uint64_t> s_Counters[(size_t)counter::e_num_counters];
+        };
+
+        [[nodiscard]]
+        const char* counter_name(counter which);
+
+        inline void add(counter which, uint64_t value = 1)
+        {
+            detail::s_Counters[(size_t)which].fetch_add(value, std::memory_order_relaxed);
+        }
+
+        [[nodiscard]]
+        inline uint64_t get(counter which)
+        {
+            return detail::s_Counters[(size_t)which].load(std::memory_order_relaxed);
+        }
+
+        /** Records the size of a page that was written to disk. */
+        void add_page_bytes(const ST::string& page, uint64_t size);
+
+        [[nodiscard]]
+        std::map<ST::string, uint64_t> page_bytes();
+
+        void reset();
+
+        /** A human readable summary of every counter and every page written. */
+        [[nodiscard]]
+        ST::string report();
+    };
+};
+
+#endif
@@ -0,0 +1,172 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "trace.hpp"
+#include "errors.hpp"
+#include "log.hpp"
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <string_theory/format>
+#include <string_theory/iostream>
+#include <string_theory/string_stream>
+
+
+// ===========================================================================
+
+namespace
+{
+    struct event
+    {
+        const char* m_Name;
+        ST::string m_Detail;
+        std::chrono::steady_clock::time_point m_Begin;
+        std::chrono::steady_clock::time_point m_End;
+    };
+
+    struct thread_events
+    {
+        size_t m_ThreadId;
+        std::mutex m_Lock;
+        std::vector<event> m_Events;
+    };
+
+    std::mutex s_ThreadsLock;
+    std::vector<std::shared_ptr<thread_events>> s_Threads;
+    std::chrono::steady_clock::time_point s_Epoch;
+
+    thread_events& this_thread_events()
+    {
+        // Each thread appends to its own buffer, so the only contention is with write().
+        thread_local std::shared_ptr<thread_events> events;
+        if (!events) {
+            events = std::make_shared<thread_events>();
+            std::lock_guard<std::mutex> lock(s_ThreadsLock);
+            events->m_ThreadId = s_Threads.size() + 1;
+            s_Threads.push_back(events);
+        }
+        return *events;
+    }
+
+    ST::string escape_json(const ST::string& str)
+    {
+        ST::string_stream ss;
+        for (size_t i = 0; i < str.size(); ++i) {
+            char ch = str.c_str()[i];
+            switch (ch) {
+            case '"':
+                ss << "\\\"";
+                break;
+            case '\\':
+                ss << "\\\\";
+                break;
+            case '\n':
+                ss << "\\n";
+                break;
+            default:
+                if ((unsigned char)ch < 0x20)
+                    ss << ST::format("\\u{04x}", (int)ch);
+                else
+                    ss.append_char(ch);
+                break;
+            }
+        }
+        return ss.to_string();
+    }
+};
+
+std::atomic<bool> gpp::trace::detail::s_Enabled = false;
+
+// ===========================================================================
+
+void gpp::trace::detail::record(const char* name, const ST::string& detail,
+                                std::chrono::steady_clock::time_point begin,
+                                std::chrono::steady_clock::time_point end)
+{
+    thread_events& events = this_thread_events();
+    std::lock_guard<std::mutex> lock(events.m_Lock);
+    events.m_Events.push_back({ name, detail, begin, end });
+}
+
+void gpp::trace::start()
+{
+    {
+        std::lock_guard<std::mutex> lock(s_ThreadsLock);
+        for (auto& thread : s_Threads) {
+            std::lock_guard<std::mutex> threadLock(thread->m_Lock);
+            thread->m_Events.clear();
+        }
+        s_Epoch = std::chrono::steady_clock::now();
+    }
+    detail::s_Enabled = true;
+}
+
+void gpp::trace::stop()
+{
+    detail::s_Enabled = false;
+}
+
+void gpp::trace::write(const std::filesystem::path& path)
+{
+    std::ofstream stream(path, std::ios::out | std::ios::trunc);
+    if (!stream)
+        error::raise("Unable to open '{}' for writing", path);
+
+    auto micros = [](std::chrono::steady_clock::duration duration) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    };
+
+    size_t count = 0;
+    stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    std::lock_guard<std::mutex> lock(s_ThreadsLock);
+    for (const auto& thread : s_Threads) {
+        std::lock_guard<std::mutex> threadLock(thread->m_Lock);
+        for (const auto& i : thread->m_Events) {
+            if (count++ != 0)
+                stream << ',';
+            stream << "\n{\"name\":\"" << i.m_Name << "\",\"cat\":\"gpp\",\"ph\":\"X\",\"pid\":1"
+                   << ",\"tid\":" << thread->m_ThreadId
+                   << ",\"ts\":" << micros(i.m_Begin - s_Epoch)
+                   << ",\"dur\":" << micros(i.m_End - i.m_Begin);
+            if (!i.m_Detail.empty())
+                stream << ",\"args\":{\"detail\":\"" << escape_json(i.m_Detail) << "\"}";
+            stream << '}';
+        }
+    }
+    stream << "\n]}\n";
+    log::debug("Wrote {} trace events to '{}'", count, path);
+}
+
+// ===========================================================================
+
+gpp::trace::session::session(std::filesystem::path path)
+    : m_Path(std::move(path))
+{
+    start();
+}
+
+gpp::trace::session::~session()
+{
+    stop();
+    try {
+        write(m_Path);
+    } catch (const std::exception& ex) {
+        log::error("Unable to write trace: {}", ex.what());
+    }
+}
@@ -0,0 +1,108 @@
+/* This file is part of GnastyPlasmaPatcher.
+ *
+ * GnastyPlasmaPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnastyPlasmaPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GnastyPlasmaPatcher.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GPP_TRACE_H
+#define _GPP_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+
+#include <string_theory/string>
+
+namespace gpp
+{
+    namespace trace
+    {
+        namespace detail
+        {
+            extern std::atomic<bool> s_Enabled;
+
+            void record(const char* name, const ST::string& detail,
+                        std::chrono::steady_clock::time_point begin,
+                        std::chrono::steady_clock::time_point end);
+        };
+
+        /** Throws away anything recorded so far and starts recording. */
+        void start();
+        void stop();
+
+        [[nodiscard]]
+        inline bool enabled() { return detail::s_Enabled.load(std::memory_order_relaxed); }
+
+        /** Writes everything recorded so far as Chrome trace event JSON. */
+        void write(const std::filesystem::path& path);
+
+        /**
+         * Times the enclosing block. This is just a flag check when nothing is recording,
+         * so it is fine to leave in hot paths.
+         */
+        class scope
+        {
+            const char* m_Name;
+            ST::string m_Detail;
+            std::chrono::steady_clock::time_point m_Begin;
+
+        public:
+            scope() = delete;
+            scope(const scope&) = delete;
+            scope(scope&&) = delete;
+
+            scope(const char* name)
+                : m_Name(enabled() ? name : nullptr)
+            {
+                if (m_Name)
+                    m_Begin = std::chrono::steady_clock::now();
+            }
+
+            scope(const char* name, const ST::string& detail)
+                : scope(name)
+            {
+                if (m_Name)
+                    m_Detail = detail;
+            }
+
+            scope(const char* name, const char* detail)
+                : scope(name)
+            {
+                if (m_Name)
+                    m_Detail = detail;
+            }
+
+            ~scope()
+            {
+                if (m_Name)
+                    detail::record(m_Name, m_Detail, m_Begin, std::chrono::steady_clock::now());
+            }
+        };
+
+        /** Records for as long as it is alive, then writes the trace. */
+        class session
+        {
+            std::filesystem::path m_Path;
+
+        public:
+            session() = delete;
+            session(const session&) = delete;
+            session(session&&) = delete;
+
+            session(std::filesystem::path path);
+            ~session();
+        };
+    };
+};
+
+#endif